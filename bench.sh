@@ -0,0 +1,116 @@
+#!/bin/sh
+# Flashing throughput benchmark against the bootloader emulator.
+# Usage: bench.sh <flasher> <emulator>
+#
+# Environment:
+#   BENCH_BAUDRATES      baudrates to run, default: all the bootloader supports
+#   BENCH_BLOCKS         data blocks in the synthetic image, default 32
+#   BENCH_BLOCK_SIZES    largest data block the emulated bootloader accepts, default "136 246":
+#                        an old bootloader and one taking a whole write multiple registers request
+#   BENCH_EMULATOR_ARGS  extra emulator keys, e.g. "-w 20 -x 50" for flash write time and drops
+#   BENCH_FLASHER_ARGS   extra flasher keys
+#   BENCH_TRANSPORT      serial (default, a pty), tcp or rtu-over-tcp: emulator behind a gateway on a loopback port
+#   BENCH_TCP_PORT       the gateway's port, default 15020
+#
+# Every run must leave the whole image on the emulated device: its last session holds all the data bytes,
+# and with no replies dropped that session is the only one. Otherwise the run is reported and the exit
+# status is 1.
+
+set -e
+
+FLASHER=${1:-./wb-mcu-fw-flasher}
+EMULATOR=${2:-./wb-mcu-fw-emulator}
+BAUDRATES=${BENCH_BAUDRATES:-"1200 2400 4800 9600 19200 38400 57600 115200 230400"}
+BLOCKS=${BENCH_BLOCKS:-32}
+BLOCK_SIZES=${BENCH_BLOCK_SIZES:-"136 246"}
+TRANSPORT=${BENCH_TRANSPORT:-serial}
+TCP_PORT=${BENCH_TCP_PORT:-15020}
+
+INFO_BLOCK_SIZE=32
+DATA_BLOCK_SIZE=136
+BITS_PER_CHAR=11
+
+FAILED=0
+WORKDIR=$(mktemp -d)
+EMULATOR_PID=
+cleanup() {
+    [ -n "$EMULATOR_PID" ] && kill "$EMULATOR_PID" 2>/dev/null || true
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+IMAGE=$WORKDIR/bench.wbfw
+IMAGE_BYTES=$((DATA_BLOCK_SIZE * BLOCKS))
+head -c $((INFO_BLOCK_SIZE + IMAGE_BYTES)) /dev/urandom > "$IMAGE"
+PORT=$WORKDIR/tty
+
+# Gateway line runs at the benchmarked baudrate, the flasher can't change it
+case $TRANSPORT in
+    serial)       DEVICE=$PORT ;;
+    tcp)          DEVICE=tcp://127.0.0.1:$TCP_PORT ;;
+    rtu-over-tcp) DEVICE=rtu-over-tcp://127.0.0.1:$TCP_PORT; GATEWAY_ARGS=-R ;;
+    *)            echo "Unknown transport $TRANSPORT" >&2; exit 1 ;;
+esac
+
+now() {
+    date +%s.%N
+}
+
+# Emulator's counter from the line it prints on exit
+counter() {
+    echo "$counters" | sed -n "s/.* $1=\\([0-9]*\\).*/\\1/p"
+}
+
+printf "%-8s %6s %8s %10s %10s %10s %6s %8s %8s\n" "Baud" "Block" "Time, s" "Blocks/s" "Eff. B/s" "Line B/s" "Eff.%" "Retries" "Dropped"
+for baud in $BAUDRATES; do
+for block in $BLOCK_SIZES; do
+    # shellcheck disable=SC2086
+    if [ "$TRANSPORT" = serial ]; then
+        "$EMULATOR" -l "$PORT" -B "$block" $BENCH_EMULATOR_ARGS > "$WORKDIR/emulator.log" 2>&1 &
+    else
+        "$EMULATOR" -t "$TCP_PORT" $GATEWAY_ARGS -b "$baud" -B "$block" $BENCH_EMULATOR_ARGS > "$WORKDIR/emulator.log" 2>&1 &
+    fi
+    EMULATOR_PID=$!
+    while ! grep -q "^Emulating" "$WORKDIR/emulator.log"; do
+        if ! kill -0 "$EMULATOR_PID" 2>/dev/null; then
+            cat "$WORKDIR/emulator.log" >&2
+            exit 1
+        fi
+        sleep 0.05
+    done
+
+    start=$(now)
+    # shellcheck disable=SC2086
+    if ! "$FLASHER" -d "$DEVICE" -B "$baud" -f "$IMAGE" $BENCH_FLASHER_ARGS > "$WORKDIR/flasher.log" 2>&1; then
+        echo "$baud: flashing failed, see the log below" >&2
+        tr '\r' '\n' < "$WORKDIR/flasher.log" | tail -n 20 >&2
+        FAILED=1
+    fi
+    end=$(now)
+
+    kill "$EMULATOR_PID"
+    wait "$EMULATOR_PID" || true
+    EMULATOR_PID=
+
+    retries=$(grep -c "Error while sending" "$WORKDIR/flasher.log" || true)
+    counters=$(tail -n 1 "$WORKDIR/emulator.log")
+    dropped=$(counter dropped)
+    if [ "$(counter last_session_bytes)" != "$IMAGE_BYTES" ] ||
+       { [ "${dropped:-0}" = 0 ] && { [ "$(counter sessions)" != 1 ] ||
+                                     [ "$(counter data_blocks)" != $(((IMAGE_BYTES + block - 1) / block)) ]; }; }
+    then
+        echo "$baud: emulator didn't get one whole image: $counters" >&2
+        FAILED=1
+    fi
+
+    awk -v baud="$baud" -v block="$block" -v start="$start" -v end="$end" -v blocks="$BLOCKS" -v size="$DATA_BLOCK_SIZE" \
+        -v bits="$BITS_PER_CHAR" -v retries="$retries" -v dropped="${dropped:-0}" 'BEGIN {
+        t = end - start
+        line = baud / bits
+        eff = blocks * size / t
+        printf "%-8d %6d %8.2f %10.2f %10.1f %10.1f %6.1f %8d %8d\n", baud, block, t, blocks / t, eff, line, 100 * eff / line, retries, dropped
+    }'
+done
+done
+
+exit $FAILED
@@ -0,0 +1,102 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#if defined(_WIN32)
+#include <io.h>
+#define fsync _commit
+#endif
+
+#include "checkpoint.h"
+
+#define CHECKPOINT_HEADER           "# wb-mcu-fw-flasher checkpoint"
+#define CHECKPOINT_LINE_MAX         (CHECKPOINT_DEVICE_MAX + 16)
+
+int loadCheckpoint(const char *fileName, struct Checkpoint *checkpoint) {
+    FILE *f = fopen(fileName, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char line[CHECKPOINT_LINE_MAX];
+    unsigned long long hash;
+    int fields = 0;
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    checkpoint->fileName = fileName;
+
+    if ((fgets(line, sizeof(line), f) == NULL) || (strncmp(line, CHECKPOINT_HEADER, strlen(CHECKPOINT_HEADER)) != 0)) {
+        fclose(f);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(line, "device=", 7) == 0) {
+            snprintf(checkpoint->device, sizeof(checkpoint->device), "%s", line + 7);
+            fields++;
+        } else if ((sscanf(line, "address=%d", &checkpoint->modbusID) == 1) ||
+                   (sscanf(line, "size=%u", &checkpoint->imageSize) == 1) ||
+                   (sscanf(line, "baudrate=%d", &checkpoint->baudrate) == 1) ||
+                   (sscanf(line, "parity=%c", &checkpoint->parity) == 1) ||
+                   (sscanf(line, "acked=%u", &checkpoint->acked) == 1)) {
+            fields++;
+        } else if (sscanf(line, "block=%u", &checkpoint->blockSize) == 1) {
+            continue;   // optional, older files don't have it
+        } else if (sscanf(line, "image=%llx", &hash) == 1) {
+            checkpoint->imageHash = hash;
+            fields++;
+        }
+    }
+    fclose(f);
+    return (fields == 7) ? 0 : -1;
+}
+
+int saveCheckpoint(const struct Checkpoint *checkpoint) {
+    char tmpName[FILENAME_MAX];
+    if (snprintf(tmpName, sizeof(tmpName), "%s.tmp", checkpoint->fileName) >= (int)sizeof(tmpName)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    FILE *f = fopen(tmpName, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    int rc = fprintf(f, CHECKPOINT_HEADER "\n"
+                        "device=%s\n"
+                        "address=%d\n"
+                        "image=%016llx\n"
+                        "size=%u\n"
+                        "baudrate=%d\n"
+                        "parity=%c\n"
+                        "acked=%u\n"
+                        "block=%u\n",
+                     checkpoint->device, checkpoint->modbusID, (unsigned long long)checkpoint->imageHash, checkpoint->imageSize,
+                     checkpoint->baudrate, checkpoint->parity, checkpoint->acked, checkpoint->blockSize);
+    // On disk before it replaces the old one: a power cut after rename() must leave one of them whole
+    if ((rc < 0) || (fflush(f) != 0) || (fsync(fileno(f)) != 0)) {
+        int error = errno;
+        fclose(f);
+        remove(tmpName);
+        errno = error;
+        return -1;
+    }
+    if (fclose(f) != 0) {
+        remove(tmpName);
+        return -1;
+    }
+#if defined(_WIN32)
+    remove(checkpoint->fileName);   // rename() doesn't replace files there
+#endif
+    if (rename(tmpName, checkpoint->fileName) != 0) {
+        remove(tmpName);
+        return -1;
+    }
+    return 0;
+}
+
+void removeCheckpoint(const struct Checkpoint *checkpoint) {
+    remove(checkpoint->fileName);
+}
@@ -0,0 +1,34 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+
+#define CHECKPOINT_DEVICE_MAX       256
+
+/*
+Flashing progress kept on disk by --resume. Bootloader writes data blocks one
+after another from the last info block on, so the only thing worth saving is
+how many blocks it acknowledged in a row since then, together with what was
+flashed where: resuming with another image or device would corrupt it.
+*/
+struct Checkpoint {
+    const char *fileName;
+    char device[CHECKPOINT_DEVICE_MAX];
+    int modbusID;
+    uint64_t imageHash;
+    unsigned int imageSize;
+    int baudrate;               // bootloader was left on these settings
+    char parity;
+    unsigned int acked;         // data blocks acknowledged since the info block
+    unsigned int blockSize;     // of this many bytes, 0 in older files: the image's own blocks
+};
+
+// Returns -1 if the file is missing or unreadable, a half-written file is never seen
+int loadCheckpoint(const char *fileName, struct Checkpoint *checkpoint);
+
+// Replaces the file atomically. Returns -1 on error, the previous file stays then.
+int saveCheckpoint(const struct Checkpoint *checkpoint);
+
+void removeCheckpoint(const struct Checkpoint *checkpoint);
+
+#endif
@@ -0,0 +1,832 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 600
+
+/*
+Software model of the Wiren Board bootloader for benchmarks and checks
+without hardware. Creates a pseudo-terminal, links its slave side to a
+path the flasher can open with -d, and answers Modbus RTU on it.
+
+The line itself is emulated: every frame takes as long as it would on a
+real wire at the baudrate the flasher set on the pty, and frames sent at
+a baudrate the emulated device doesn't listen on are ignored.
+
+Several identical devices at consecutive addresses can share the line (-n),
+so that broadcast flashing has someone to reach: frames to address 0 go to
+all of them and are never answered.
+
+With -t the line is behind a gateway on a loopback TCP port instead: Modbus
+TCP (tcp://) or, with -R, RTU frames as they are (rtu-over-tcp://). The
+gateway's line runs at -b whatever the flasher asks for, and -o makes it
+answer pipelined data blocks out of order, pairs swapped.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <modbus.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define INFO_BLOCK_SIZE             32
+#define INFO_BLOCK_REG_ADDRESS      0x1000
+
+#define DATA_BLOCK_SIZE             136
+#define DATA_BLOCK_REG_ADDRESS      0x2000
+
+#define HOLD_REG_JUMP_TO_BOOT_STANDARD_BAUD 129
+#define HOLD_REG_JUMP_TO_BOOT_CURRENT_BAUD  131
+#define HOLD_REG_CMD_UART_SETTINGS_RESET    1000
+#define HOLD_REG_CMD_EEPROM_ERASE           1001
+#define HOLD_REG_CMD_FLASHFS_ERASE_SETTINGS 1002
+#define HOLD_REG_FLASHFS_MAX_BLOCKS         1003
+#define HOLD_REG_CMD_JUMP_TO_FIRMWARE       1004
+#define HOLD_REG_CMD_FLASHFS_FULL_ERASE     1005
+#define HOLD_REG_DATA_BLOCK_SIZE_MAX        1006
+
+#define HOLD_REG_BOOTLOADER_VERSION 330
+#define BOOTLOADER_VERSION_LEN      8
+#define HOLD_REG_FIRMWARE_SIGNATURE 290
+#define FW_SIG_LEN                  12
+#define HOLD_REG_FIRMWARE_VERSION   250
+#define FW_VERSION_LEN              15
+
+#define COMP_FW_FLAGS_REG           0xFE80
+#define COMP_FW_BASE_REG            0xFD00
+#define COMP_FW_INFO_STRIDE         48
+#define COMP_FW_MODEL_LEN           20
+#define COMP_FW_SIGNATURE_OFFSET    0x14
+#define COMP_FW_SIGNATURE_LEN       12
+#define COMP_FW_VERSION_OFFSET      0x20
+#define COMP_FW_VERSION_LEN         16
+#define COMP_FW_MAX_COUNT           8
+
+#define MODBUS_FC_READ_DISCRETE_INPUTS      0x02
+#define MODBUS_FC_READ_HOLDING_REGISTERS    0x03
+#define MODBUS_FC_READ_INPUT_REGISTERS      0x04
+#define MODBUS_FC_WRITE_SINGLE_REGISTER     0x06
+#define MODBUS_FC_WRITE_MULTIPLE_REGISTERS  0x10
+
+#define REGISTER_SPACE              0x10000
+#define DEFAULT_LINK                "/tmp/wb-mcu-fw-emulator"
+#define BITS_PER_CHAR               11      // start, 8 data, parity or second stop, stop
+#define DEVICES_MAX                 32
+#define PARTIAL_FRAME_TIMEOUT_USEC  50000   // rest of a frame is that late only if it's lost
+#define MBAP_HEADER_LEN             7
+#define FRAME_BUFFER_SIZE           (2 * MODBUS_TCP_MAX_ADU_LENGTH)
+
+enum device_mode {
+    MODE_FIRMWARE,
+    MODE_BOOTLOADER
+};
+
+enum framing {
+    FRAMING_RTU,                // pty and rtu-over-tcp://
+    FRAMING_MBAP                // tcp://
+};
+
+struct EmulatorOptions {
+    const char *link;
+    int slaveAddr;
+    int firmwareBaudrate;
+    const char *signature;
+    const char *bootloaderVersion;
+    const char *firmwareVersion;
+    enum device_mode startMode;
+    double blockDelaySec;       // flash write time per info/data block
+    double rebootDelaySec;      // deaf after jump or command, as the real device reboots
+    int dropEvery;              // leave every n-th data block unanswered and unwritten
+    int busyEvery;              // answer every n-th data block with SLAVE_OR_SERVER_BUSY
+    int components;             // component firmwares present
+    int maxBlockSize;           // data block bytes accepted; DATA_BLOCK_SIZE only, as old bootloaders, if not above it
+    int deviceCount;            // devices at slaveAddr and the addresses after it
+    unsigned int imageBytes;    // data bytes of a whole image: bootloader starts the firmware after them, 0 never does
+    int tcpPort;                // gateway on 127.0.0.1 instead of the pty, 0 for the pty
+    enum framing framing;
+    int reorderReplies;         // swap replies to pipelined data blocks, Modbus TCP only
+    int debug;
+};
+
+// State of one emulated device; registers are the same for all of them
+struct EmulatedDevice {
+    int slaveAddr;
+    enum device_mode mode;
+    int firmwareBaudrate;
+    int listenBaudrate;
+    int anyBaudrate;                // freshly powered bootloader: take whatever flasher uses
+    double deafUntil;
+    int sessionOpen;                // info block received since the bootloader started
+    unsigned int dataBlocksInSession;
+    unsigned int sessionBytes;
+    unsigned int dataBlockRequests;
+    int faulty;                     // -x and -y apply to it
+    int rebootAfterReply;
+};
+
+struct EmulatorStats {
+    unsigned int frames;
+    unsigned int ignoredFrames;     // wrong baudrate or device rebooting
+    unsigned int infoBlocks;
+    unsigned int dataBlocks;
+    unsigned int dataBytes;
+    unsigned int dropped;
+    unsigned int busy;
+    unsigned int sessions;          // info blocks followed by at least one data block
+    unsigned int lastSessionBytes;  // data bytes the first device got since its last info block
+    unsigned int reordered;         // replies sent before the one to the previous request
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onSignal(int sig) {
+    (void)sig;
+    stopRequested = 1;
+}
+
+static const int allowedBaudrates[] = {1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400};
+static const speed_t speedConstants[] = {B1200, B2400, B4800, B9600, B19200, B38400, B57600, B115200, B230400};
+
+static int baudrateFromTermios(int fd) {
+    struct termios tios;
+    if (tcgetattr(fd, &tios) != 0) {
+        return 0;
+    }
+    speed_t speed = cfgetispeed(&tios);
+    for (unsigned int i = 0; i < sizeof(speedConstants) / sizeof(speedConstants[0]); i++) {
+        if (speedConstants[i] == speed) {
+            return allowedBaudrates[i];
+        }
+    }
+    return 0;
+}
+
+static void sleepSeconds(double seconds) {
+    if (seconds <= 0) {
+        return;
+    }
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    while ((nanosleep(&ts, &ts) != 0) && (errno == EINTR) && !stopRequested) {};
+}
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void putString(uint16_t *regs, int startAddr, int len, const char *s) {
+    for (int i = 0; i < len; i++) {
+        regs[startAddr + i] = (i < (int)strlen(s)) ? (uint8_t)s[i] : 0;
+    }
+}
+
+static void initDevice(struct EmulatedDevice *dev, const struct EmulatorOptions *options, int slaveAddr) {
+    memset(dev, 0, sizeof(*dev));
+    dev->slaveAddr = slaveAddr;
+    dev->mode = options->startMode;
+    dev->firmwareBaudrate = options->firmwareBaudrate;
+    dev->listenBaudrate = (dev->mode == MODE_FIRMWARE) ? dev->firmwareBaudrate : 9600;
+    dev->anyBaudrate = (dev->mode == MODE_BOOTLOADER);
+}
+
+static uint16_t crc16(const uint8_t *data, int len) {
+    uint16_t crc = 0xFFFF;
+    for (int i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+// Whole RTU request length from its first bytes, 0 if more are needed, -1 if it's no request
+static int requestLength(const uint8_t *buf, int len) {
+    if (len < 2) {
+        return 0;
+    }
+    if ((buf[1] >= 0x01) && (buf[1] <= 0x06)) {
+        return 8;
+    }
+    if ((buf[1] == 0x0F) || (buf[1] == MODBUS_FC_WRITE_MULTIPLE_REGISTERS)) {
+        return (len < 7) ? 0 : 9 + buf[6];
+    }
+    return -1;
+}
+
+// Same for Modbus TCP: the header tells the length
+static int mbapLength(const uint8_t *buf, int len) {
+    if (len < MBAP_HEADER_LEN) {
+        return 0;
+    }
+    int pduLen = (buf[4] << 8) | buf[5];
+    if ((buf[2] != 0) || (buf[3] != 0) || (pduLen < 2) || (pduLen > MODBUS_TCP_MAX_ADU_LENGTH - 6)) {
+        return -1;
+    }
+    return 6 + pduLen;
+}
+
+// Bytes received but not taken as a frame yet, one per connection
+struct FrameReader {
+    uint8_t buf[FRAME_BUFFER_SIZE];
+    int len;
+};
+
+/*
+modbus_receive() drops frames to other addresses and waits forever, restarting
+on signals; devices here have several addresses, and a broadcast block may be
+followed by a request with no gap the pty would show, so frames are split by
+their length. Returns the frame length, 0 if there was none yet, -1 if the
+other side closed the connection.
+*/
+static int receiveFrame(int fd, struct FrameReader *reader, enum framing framing, uint8_t *frame, int debug) {
+    for (;;) {
+        int frameLen = (framing == FRAMING_MBAP) ? mbapLength(reader->buf, reader->len) : requestLength(reader->buf, reader->len);
+        if ((frameLen < 0) || (frameLen > MODBUS_TCP_MAX_ADU_LENGTH)) {
+            reader->len = 0;    // garbage, resync on the next frame
+            return 0;
+        }
+        if (frameLen && (reader->len >= frameLen)) {
+            int valid = 1;
+            if (framing == FRAMING_RTU) {
+                uint16_t crc = crc16(reader->buf, frameLen - 2);
+                valid = (reader->buf[frameLen - 2] == (crc & 0xFF)) && (reader->buf[frameLen - 1] == (crc >> 8));
+            }
+            memcpy(frame, reader->buf, frameLen);
+            reader->len -= frameLen;
+            memmove(reader->buf, reader->buf + frameLen, reader->len);
+            if (debug) {
+                for (int i = 0; i < frameLen; i++) {
+                    printf("<%.2X>", frame[i]);
+                }
+                printf(valid ? "\n" : " bad CRC\n");
+            }
+            if (!valid) {
+                reader->len = 0;
+                return 0;
+            }
+            return frameLen;
+        }
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        struct timeval tv = {0, reader->len ? PARTIAL_FRAME_TIMEOUT_USEC : 200000};
+        if (select(fd + 1, &fds, NULL, NULL, &tv) <= 0) {
+            reader->len = 0;
+            return 0;
+        }
+        int rc = read(fd, reader->buf + reader->len, sizeof(reader->buf) - reader->len);
+        if (rc == 0) {
+            return -1;
+        }
+        if (rc < 0) {
+            if (errno != EINTR) {
+                sleepSeconds(0.01);
+            }
+            return 0;
+        }
+        reader->len += rc;
+    }
+}
+
+// Next request is already on its way: a reply held for it won't wait for long
+static int requestPending(int fd, const struct FrameReader *reader) {
+    if (reader->len) {
+        return 1;
+    }
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    struct timeval tv = {0, 0};
+    return select(fd + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+// Loopback listener for -t
+static int listenTcp(int port) {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((bind(s, (struct sockaddr *)&address, sizeof(address)) != 0) || (listen(s, 1) != 0)) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+// Next client of the gateway, -1 if none came for a while
+static int acceptClient(int listener) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(listener, &fds);
+    struct timeval tv = {0, 200000};
+    if (select(listener + 1, &fds, NULL, NULL, &tv) <= 0) {
+        return -1;
+    }
+    int client = accept(listener, NULL, NULL);
+    if (client >= 0) {
+        int on = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return client;
+}
+
+/*
+Write multiple registers reply, or the exception, as Modbus TCP frames it. Built
+here rather than by libmodbus, so that -o can hold it back.
+*/
+static int buildBlockReply(const uint8_t *query, int exception, uint8_t *reply) {
+    memcpy(reply, query, MBAP_HEADER_LEN);
+    uint8_t *pdu = reply + MBAP_HEADER_LEN;
+    int pduLen;
+    if (exception) {
+        pdu[0] = MODBUS_FC_WRITE_MULTIPLE_REGISTERS | 0x80;
+        pdu[1] = exception;
+        pduLen = 2;
+    } else {
+        memcpy(pdu, query + MBAP_HEADER_LEN, 5);    // function, address and quantity echoed
+        pduLen = 5;
+    }
+    reply[4] = 0;
+    reply[5] = pduLen + 1;
+    return MBAP_HEADER_LEN + pduLen;
+}
+
+/*
+Does what the device does on the request. Returns the exception to answer with,
+0 for a normal reply and -1 for no reply at all. *writing is set if the device
+writes flash, which takes -w.
+*/
+static int handleRequest(struct EmulatedDevice *dev, struct EmulatorOptions *options, struct EmulatorStats *stats,
+                         int function, int addr, int byteCount, int *writing)
+{
+    int largeBlocks = (options->maxBlockSize > DATA_BLOCK_SIZE);
+    // Firmware of a device with components takes their images the same way bootloader takes its own
+    int componentWrite = options->components && (function == MODBUS_FC_WRITE_MULTIPLE_REGISTERS) &&
+                         ((addr == INFO_BLOCK_REG_ADDRESS) || (addr == DATA_BLOCK_REG_ADDRESS));
+
+    if ((dev->mode == MODE_FIRMWARE) && !componentWrite) {
+        if ((function == MODBUS_FC_WRITE_SINGLE_REGISTER) &&
+            ((addr == HOLD_REG_JUMP_TO_BOOT_STANDARD_BAUD) || (addr == HOLD_REG_JUMP_TO_BOOT_CURRENT_BAUD)))
+        {
+            dev->mode = MODE_BOOTLOADER;
+            dev->listenBaudrate = (addr == HOLD_REG_JUMP_TO_BOOT_STANDARD_BAUD) ? 9600 : dev->firmwareBaudrate;
+            dev->rebootAfterReply = 1;
+        } else if ((function == MODBUS_FC_WRITE_MULTIPLE_REGISTERS) || (addr >= 1000 && addr <= 1005)) {
+            return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+        }
+        return 0;
+    }
+
+    if ((function == MODBUS_FC_WRITE_MULTIPLE_REGISTERS) && (addr == INFO_BLOCK_REG_ADDRESS)) {
+        if (dev->dataBlocksInSession) {
+            stats->sessions++;
+        }
+        dev->dataBlocksInSession = 0;
+        dev->sessionBytes = 0;
+        dev->sessionOpen = 1;
+        stats->infoBlocks++;
+        *writing = 1;
+    } else if ((function == MODBUS_FC_WRITE_MULTIPLE_REGISTERS) && (addr == DATA_BLOCK_REG_ADDRESS) && !dev->sessionOpen) {
+        return MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;   // nowhere to write without info block
+    } else if ((function == MODBUS_FC_WRITE_MULTIPLE_REGISTERS) && (addr == DATA_BLOCK_REG_ADDRESS) &&
+               (largeBlocks ? (byteCount > options->maxBlockSize) : (byteCount != DATA_BLOCK_SIZE)))
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    } else if ((function == MODBUS_FC_WRITE_MULTIPLE_REGISTERS) && (addr == DATA_BLOCK_REG_ADDRESS)) {
+        dev->dataBlockRequests++;
+        if (dev->faulty && options->dropEvery && (dev->dataBlockRequests % options->dropEvery == 0)) {
+            stats->dropped++;
+            return -1;
+        }
+        if (dev->faulty && options->busyEvery && (dev->dataBlockRequests % options->busyEvery == 0)) {
+            stats->busy++;
+            return MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY;
+        }
+        stats->dataBlocks++;
+        stats->dataBytes += byteCount;
+        dev->dataBlocksInSession++;
+        dev->sessionBytes += byteCount;
+        *writing = 1;
+        if ((dev->mode == MODE_BOOTLOADER) && options->imageBytes && (dev->sessionBytes >= options->imageBytes)) {
+            dev->mode = MODE_FIRMWARE;      // whole image is written, bootloader starts it
+            dev->listenBaudrate = dev->firmwareBaudrate;
+            dev->rebootAfterReply = 1;
+        }
+    } else if ((function == MODBUS_FC_WRITE_SINGLE_REGISTER) && (addr == HOLD_REG_CMD_JUMP_TO_FIRMWARE)) {
+        dev->mode = MODE_FIRMWARE;
+        dev->listenBaudrate = dev->firmwareBaudrate;
+        dev->rebootAfterReply = 1;
+    } else if ((function == MODBUS_FC_WRITE_SINGLE_REGISTER) && (addr == HOLD_REG_CMD_UART_SETTINGS_RESET)) {
+        dev->firmwareBaudrate = 9600;
+        dev->rebootAfterReply = 1;
+    } else if ((function == MODBUS_FC_WRITE_SINGLE_REGISTER) &&
+               ((addr == HOLD_REG_CMD_EEPROM_ERASE) || (addr == HOLD_REG_CMD_FLASHFS_ERASE_SETTINGS) ||
+                (addr == HOLD_REG_CMD_FLASHFS_FULL_ERASE)))
+    {
+        dev->rebootAfterReply = 1;
+    } else if ((function == MODBUS_FC_WRITE_SINGLE_REGISTER) || (function == MODBUS_FC_READ_DISCRETE_INPUTS) ||
+               ((function == MODBUS_FC_READ_HOLDING_REGISTERS) && (addr == HOLD_REG_FIRMWARE_VERSION)) ||
+               ((function == MODBUS_FC_READ_HOLDING_REGISTERS) && (addr == HOLD_REG_DATA_BLOCK_SIZE_MAX) && !largeBlocks))
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;   // no firmware registers in bootloader
+    }
+    return 0;
+}
+
+static void printStats(const struct EmulatorStats *stats) {
+    printf("frames=%u ignored=%u info_blocks=%u data_blocks=%u data_bytes=%u dropped=%u busy=%u sessions=%u last_session_bytes=%u reordered=%u\n",
+           stats->frames, stats->ignoredFrames, stats->infoBlocks, stats->dataBlocks, stats->dataBytes,
+           stats->dropped, stats->busy, stats->sessions, stats->lastSessionBytes, stats->reordered);
+    fflush(stdout);
+}
+
+static void usage(const char *name) {
+    printf("Wiren Board bootloader emulator on a pseudo-terminal or behind a loopback TCP gateway.\n\n");
+    printf("Usage: %s [options]\n\n", name);
+    printf("Param  Description                                         Default value\n\n");
+    printf("-l     Path to link the pty to, use it as flasher's -d        " DEFAULT_LINK "\n");
+    printf("-a     Modbus ID (slave addr)                                 1\n");
+    printf("-n     Devices at -a and the addresses after it (up to %d)    1\n", DEVICES_MAX);
+    printf("-b     Firmware baudrate                                      9600\n");
+    printf("-m     Start in firmware (fw) or bootloader (bl) mode         bl\n");
+    printf("-S     Device signature                                       wbemu\n");
+    printf("-V     Bootloader version                                     1.5.0\n");
+    printf("-F     Firmware version                                       1.0.0\n");
+    printf("-w     Flash write time per block, ms                         0\n");
+    printf("-r     Reboot time after jump or command, ms                  300\n");
+    printf("-I     Image data size, bytes: bootloader starts firmware     0 (never)\n");
+    printf("       after a session received that much\n");
+    printf("-x     Drop every n-th data block (no reply, not written)     0\n");
+    printf("-y     Answer every n-th data block with busy exception       0\n");
+    printf("       (-x and -y apply to the first device only)\n");
+    printf("-c     Component firmwares (0..%d)                             0\n", COMP_FW_MAX_COUNT);
+    printf("       (firmware takes their images at 0x1000 and 0x2000)\n");
+    printf("-B     Largest data block accepted, bytes (up to %d)         %d\n", MODBUS_MAX_WRITE_REGISTERS * 2, DATA_BLOCK_SIZE);
+    printf("-t     Serve Modbus TCP on 127.0.0.1:<port>, not the pty      -\n");
+    printf("       (line behind the gateway runs at -b)\n");
+    printf("-R     RTU frames on the -t port, as rtu-over-tcp:// sends    -\n");
+    printf("-o     Answer pipelined data blocks out of order (with -t)    -\n");
+    printf("-D     Debug mode                                             -\n\n");
+    printf("Counters are printed on exit (SIGINT or SIGTERM).\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct EmulatorOptions options = {
+        .link = DEFAULT_LINK,
+        .slaveAddr = 1,
+        .firmwareBaudrate = 9600,
+        .signature = "wbemu",
+        .bootloaderVersion = "1.5.0",
+        .firmwareVersion = "1.0.0",
+        .startMode = MODE_BOOTLOADER,
+        .rebootDelaySec = 0.3,
+        .maxBlockSize = DATA_BLOCK_SIZE,
+        .deviceCount = 1
+    };
+    double ms;
+    int rtuOverTcp = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "l:a:n:b:m:S:V:F:w:r:I:x:y:c:B:t:RoDh")) != -1) {
+        switch (c) {
+        case 'l':
+            options.link = optarg;
+            break;
+        case 'a':
+            sscanf(optarg, "%d", &options.slaveAddr);
+            break;
+        case 'n':
+            sscanf(optarg, "%d", &options.deviceCount);
+            if ((options.deviceCount < 1) || (options.deviceCount > DEVICES_MAX)) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b':
+            sscanf(optarg, "%d", &options.firmwareBaudrate);
+            break;
+        case 'm':
+            options.startMode = (strcmp(optarg, "fw") == 0) ? MODE_FIRMWARE : MODE_BOOTLOADER;
+            break;
+        case 'S':
+            options.signature = optarg;
+            break;
+        case 'V':
+            options.bootloaderVersion = optarg;
+            break;
+        case 'F':
+            options.firmwareVersion = optarg;
+            break;
+        case 'w':
+            sscanf(optarg, "%lf", &ms);
+            options.blockDelaySec = ms / 1000;
+            break;
+        case 'r':
+            sscanf(optarg, "%lf", &ms);
+            options.rebootDelaySec = ms / 1000;
+            break;
+        case 'I':
+            sscanf(optarg, "%u", &options.imageBytes);
+            break;
+        case 'x':
+            sscanf(optarg, "%d", &options.dropEvery);
+            break;
+        case 'y':
+            sscanf(optarg, "%d", &options.busyEvery);
+            break;
+        case 'c':
+            sscanf(optarg, "%d", &options.components);
+            if ((options.components < 0) || (options.components > COMP_FW_MAX_COUNT)) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'B':
+            sscanf(optarg, "%d", &options.maxBlockSize);
+            if ((options.maxBlockSize < DATA_BLOCK_SIZE) || (options.maxBlockSize > MODBUS_MAX_WRITE_REGISTERS * 2)) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            sscanf(optarg, "%d", &options.tcpPort);
+            if ((options.tcpPort < 1) || (options.tcpPort > 65535)) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'R':
+            rtuOverTcp = 1;
+            break;
+        case 'o':
+            options.reorderReplies = 1;
+            break;
+        case 'D':
+            options.debug = 1;
+            break;
+        default:
+            usage(argv[0]);
+            exit((c == 'h') ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    options.framing = (options.tcpPort && !rtuOverTcp) ? FRAMING_MBAP : FRAMING_RTU;
+
+    int master = -1;
+    int slave = -1;
+    char *slaveName = NULL;
+    int listener = -1;
+    if (options.tcpPort) {
+        listener = listenTcp(options.tcpPort);
+        if (listener < 0) {
+            fprintf(stderr, "Can't listen on 127.0.0.1:%d: %s\n", options.tcpPort, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        signal(SIGPIPE, SIG_IGN);  // client gone before its reply
+    } else {
+        master = posix_openpt(O_RDWR | O_NOCTTY);
+        if ((master < 0) || (grantpt(master) != 0) || (unlockpt(master) != 0)) {
+            fprintf(stderr, "Can't create pty: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        slaveName = ptsname(master);
+
+        // Keep the slave side open: otherwise reads fail with EIO whenever the flasher closes the port,
+        // and its termios tells the baudrate the flasher uses
+        slave = open(slaveName, O_RDWR | O_NOCTTY);
+        if (slave < 0) {
+            fprintf(stderr, "Can't open %s: %s\n", slaveName, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        unlink(options.link);
+        if (symlink(slaveName, options.link) != 0) {
+            fprintf(stderr, "Can't link %s to %s: %s\n", options.link, slaveName, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Replies framed by libmodbus on the pty master or the client socket; the context is never connected,
+    // it only gets the descriptor
+    modbus_t *ctx = (options.framing == FRAMING_MBAP) ? modbus_new_tcp("127.0.0.1", options.tcpPort)
+                                                      : modbus_new_rtu(slaveName ? slaveName : "tcp", 9600, 'N', 8, 2);
+    modbus_mapping_t *mapping = modbus_mapping_new(0, REGISTER_SPACE, REGISTER_SPACE, REGISTER_SPACE);
+    if ((ctx == NULL) || (mapping == NULL)) {
+        fprintf(stderr, "Unknown error.\n");
+        if (!options.tcpPort) {
+            unlink(options.link);
+        }
+        exit(EXIT_FAILURE);
+    }
+    modbus_set_socket(ctx, master);
+    modbus_set_slave(ctx, options.slaveAddr);
+
+    putString(mapping->tab_registers, HOLD_REG_FIRMWARE_SIGNATURE, FW_SIG_LEN, options.signature);
+    putString(mapping->tab_registers, HOLD_REG_BOOTLOADER_VERSION, BOOTLOADER_VERSION_LEN, options.bootloaderVersion);
+    putString(mapping->tab_registers, HOLD_REG_FIRMWARE_VERSION, FW_VERSION_LEN, options.firmwareVersion);
+    mapping->tab_registers[HOLD_REG_FLASHFS_MAX_BLOCKS] = 0xFFFF;
+    mapping->tab_registers[HOLD_REG_DATA_BLOCK_SIZE_MAX] = options.maxBlockSize;
+    for (int i = 0; i < options.components; i++) {
+        char buf[COMP_FW_MODEL_LEN + 1];
+        int base = COMP_FW_BASE_REG + i * COMP_FW_INFO_STRIDE;
+        mapping->tab_input_bits[COMP_FW_FLAGS_REG + i] = 1;
+        snprintf(buf, sizeof(buf), "WB-EMU-COMP%d", i + 1);
+        putString(mapping->tab_registers, base, COMP_FW_MODEL_LEN, buf);
+        snprintf(buf, sizeof(buf), "wbcomp%d", i + 1);
+        putString(mapping->tab_registers, base + COMP_FW_SIGNATURE_OFFSET, COMP_FW_SIGNATURE_LEN, buf);
+        snprintf(buf, sizeof(buf), "1.0.%d", i + 1);
+        putString(mapping->tab_registers, base + COMP_FW_VERSION_OFFSET, COMP_FW_VERSION_LEN, buf);
+    }
+
+    struct sigaction sa = {
+        .sa_handler = onSignal      // no SA_RESTART: a signal must break the wait for a frame
+    };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    char where[512];
+    if (options.tcpPort) {
+        snprintf(where, sizeof(where), "127.0.0.1:%d (%s)", options.tcpPort,
+                 (options.framing == FRAMING_MBAP) ? "Modbus TCP" : "RTU over TCP");
+    } else {
+        snprintf(where, sizeof(where), "%s -> %s", options.link, slaveName);
+    }
+    if (options.deviceCount > 1) {
+        printf("Emulating devices %d-%d (%s) on %s\n", options.slaveAddr, options.slaveAddr + options.deviceCount - 1,
+               options.signature, where);
+    } else {
+        printf("Emulating device %d (%s) on %s\n", options.slaveAddr, options.signature, where);
+    }
+    fflush(stdout);
+
+    struct EmulatedDevice devices[DEVICES_MAX];
+    for (int i = 0; i < options.deviceCount; i++) {
+        initDevice(&devices[i], &options, options.slaveAddr + i);
+    }
+    devices[0].faulty = 1;
+    struct EmulatorStats stats = {0};
+    uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+    int headerLen = modbus_get_header_length(ctx);
+    struct FrameReader reader = {.len = 0};
+    int client = -1;
+    uint8_t heldReply[MODBUS_TCP_MAX_ADU_LENGTH];     // -o: data block reply waiting for the next one
+    int heldReplyLen = 0;
+
+    while (!stopRequested) {
+        if (options.tcpPort && (client < 0)) {
+            client = acceptClient(listener);
+            modbus_set_socket(ctx, client);
+            reader.len = 0;
+            heldReplyLen = 0;
+            continue;
+        }
+        int rc = receiveFrame(options.tcpPort ? client : master, &reader, options.framing, query, options.debug);
+        if (rc < 0) {
+            close(client);
+            client = -1;
+            continue;
+        }
+        if (rc == 0) {
+            if (heldReplyLen) {
+                send(client, heldReply, heldReplyLen, MSG_NOSIGNAL);    // nothing to swap it with
+                heldReplyLen = 0;
+            }
+            continue;
+        }
+        stats.frames++;
+
+        int function = query[headerLen];
+        int addr = (query[headerLen + 1] << 8) | query[headerLen + 2];
+        int value = (query[headerLen + 3] << 8) | query[headerLen + 4];
+        int byteCount = query[headerLen + 5];   // of write multiple registers
+        int slaveAddr = query[headerLen - 1];
+        int broadcast = (slaveAddr == MODBUS_BROADCAST_ADDRESS);
+
+        // Request is already here, reply goes back on the same wire; nobody replies to broadcast
+        int replyLen = 0;
+        if (!broadcast) {
+            replyLen = 8;
+            if ((function == MODBUS_FC_READ_HOLDING_REGISTERS) || (function == MODBUS_FC_READ_INPUT_REGISTERS)) {
+                replyLen = 5 + 2 * value;
+            } else if (function == MODBUS_FC_READ_DISCRETE_INPUTS) {
+                replyLen = 5 + (value + 7) / 8;
+            }
+        }
+
+        // Gateway keeps its line at -b whatever the client asks for
+        int lineBaudrate = options.tcpPort ? options.firmwareBaudrate : baudrateFromTermios(slave);
+        struct EmulatedDevice *replying = NULL;
+        int exception = 0;
+        int listened = 0;
+        int writing = 0;
+        for (int i = 0; i < options.deviceCount; i++) {
+            struct EmulatedDevice *dev = &devices[i];
+            if (!broadcast && (slaveAddr != dev->slaveAddr)) {
+                continue;
+            }
+            if (dev->anyBaudrate && lineBaudrate) {
+                dev->listenBaudrate = lineBaudrate;
+                dev->anyBaudrate = 0;
+            }
+            if ((now() < dev->deafUntil) || (!options.tcpPort && (lineBaudrate != dev->listenBaudrate))) {
+                continue;       // would be garbage or nothing at all on a real line
+            }
+            listened = 1;
+            int result = handleRequest(dev, &options, &stats, function, addr, byteCount, &writing);
+            if (!broadcast && (result >= 0)) {
+                replying = dev;
+                exception = result;
+            }
+        }
+        if (!listened) {
+            stats.ignoredFrames++;
+            continue;
+        }
+
+        // On the gateway's line the request goes as RTU: unit, PDU and CRC instead of the MBAP header
+        int lineRequestLen = (options.framing == FRAMING_MBAP) ? rc - MBAP_HEADER_LEN + 3 : rc;
+        sleepSeconds((double)(lineRequestLen + (replying ? replyLen : 0)) * BITS_PER_CHAR / lineBaudrate);
+        if (writing) {
+            sleepSeconds(options.blockDelaySec);    // devices write blocks in parallel
+        }
+        if (replying && options.reorderReplies && (options.framing == FRAMING_MBAP) &&
+            (function == MODBUS_FC_WRITE_MULTIPLE_REGISTERS) && (addr == DATA_BLOCK_REG_ADDRESS)) {
+            uint8_t reply[MODBUS_TCP_MAX_ADU_LENGTH];
+            int len = buildBlockReply(query, exception, reply);
+            if (heldReplyLen) {
+                send(client, reply, len, MSG_NOSIGNAL);
+                send(client, heldReply, heldReplyLen, MSG_NOSIGNAL);
+                heldReplyLen = 0;
+                stats.reordered++;
+            } else if (!requestPending(client, &reader)) {
+                send(client, reply, len, MSG_NOSIGNAL);
+            } else {
+                memcpy(heldReply, reply, len);
+                heldReplyLen = len;
+            }
+            replying = NULL;
+        }
+        if (replying && heldReplyLen) {
+            send(client, heldReply, heldReplyLen, MSG_NOSIGNAL);
+            heldReplyLen = 0;
+        }
+        if (replying) {
+            if (exception) {
+                modbus_reply_exception(ctx, query, exception);
+            } else {
+                modbus_reply(ctx, query, rc, mapping);
+            }
+        }
+        for (int i = 0; i < options.deviceCount; i++) {
+            if (devices[i].rebootAfterReply) {
+                devices[i].deafUntil = now() + options.rebootDelaySec;
+                devices[i].sessionOpen = 0;
+                devices[i].rebootAfterReply = 0;
+            }
+        }
+    }
+
+    for (int i = 0; i < options.deviceCount; i++) {
+        if (devices[i].dataBlocksInSession) {
+            stats.sessions++;
+        }
+    }
+    stats.lastSessionBytes = devices[0].sessionBytes;
+    printStats(&stats);
+
+    modbus_mapping_free(mapping);
+    modbus_free(ctx);
+    if (options.tcpPort) {
+        if (client >= 0) {
+            close(client);
+        }
+        close(listener);
+    } else {
+        unlink(options.link);
+        close(slave);
+        close(master);
+    }
+    return 0;
+}
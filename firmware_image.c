@@ -0,0 +1,214 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+#include "firmware_image.h"
+
+#define FIRMWARE_MAX_SIZE           (16 * 1024 * 1024)     // far above any MCU flash, guards size arithmetic
+
+static int checkImageSize(const char *fileName, unsigned int size, char *error, size_t errorSize) {
+    if (size < INFO_BLOCK_SIZE + DATA_BLOCK_SIZE) {
+        snprintf(error, errorSize, "Firmware file %s is too short (%u bytes): should have %d bytes info block and at least one %d bytes data block",
+                fileName, size, INFO_BLOCK_SIZE, DATA_BLOCK_SIZE);
+        return -1;
+    }
+    if ((size - INFO_BLOCK_SIZE) % DATA_BLOCK_SIZE) {
+        snprintf(error, errorSize, "Firmware file %s is truncated or corrupt: %u bytes is not %d bytes info block plus whole %d bytes data blocks",
+                fileName, size, INFO_BLOCK_SIZE, DATA_BLOCK_SIZE);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+Release files are named after the version, e.g. fw/by-signature/wbmr6c/main/1.17.3.wbfw.
+Anything not looking like a version (renamed or local builds) leaves it unknown.
+*/
+static void versionFromFileName(const char *fileName, char *version) {
+    const char *name = fileName;
+    for (const char *p = fileName; *p; p++) {
+        if ((*p == '/') || (*p == '\\')) {
+            name = p + 1;
+        }
+    }
+    version[0] = '\0';
+
+    const char *ext = strrchr(name, '.');
+    size_t len = ext ? (size_t)(ext - name) : 0;
+    if ((ext == NULL) || (strcmp(ext, ".wbfw") != 0) || (len == 0) || (len >= FIRMWARE_VERSION_MAX)) {
+        return;
+    }
+    if (!isdigit((unsigned char)name[0]) || (memchr(name, '.', len) == NULL)) {
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && (strchr(".-+~", name[i]) == NULL)) {
+            return;
+        }
+    }
+    memcpy(version, name, len);
+    version[len] = '\0';
+}
+
+#if defined(_WIN32)
+static const uint8_t *readImage(int fd, unsigned int size, int *mapped) {
+    uint8_t *buf = malloc(size);
+    unsigned int done = 0;
+    while (buf && (done < size)) {
+        int rc = read(fd, buf + done, size - done);
+        if (rc <= 0) {
+            if (rc == 0) {
+                errno = EIO;    // file got shorter
+            }
+            free(buf);
+            return NULL;
+        }
+        done += rc;
+    }
+    *mapped = 0;
+    return buf;
+}
+#else
+static const uint8_t *readImage(int fd, unsigned int size, int *mapped) {
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+    *mapped = 1;
+    return map;
+}
+#endif
+
+int loadFirmware(const char *fileName, struct FirmwareImage *firmware, char *error, size_t errorSize) {
+#if defined(_WIN32)
+    int fd = open(fileName, O_RDONLY | O_BINARY);
+#else
+    int fd = open(fileName, O_RDONLY);
+#endif
+    if (fd < 0) {
+        snprintf(error, errorSize, "Error while opening firmware file %s: %s", fileName, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        snprintf(error, errorSize, "Error while opening firmware file %s: %s", fileName, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        snprintf(error, errorSize, "Firmware file %s is not a regular file", fileName);
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > FIRMWARE_MAX_SIZE) {
+        snprintf(error, errorSize, "Firmware file %s is too big (%lld bytes)", fileName, (long long)st.st_size);
+        close(fd);
+        return -1;
+    }
+    if (checkImageSize(fileName, st.st_size, error, errorSize) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    unsigned int size = st.st_size;
+    int mapped = 0;
+    const uint8_t *bytes = readImage(fd, size, &mapped);
+    if (bytes == NULL) {
+        snprintf(error, errorSize, "Error while reading firmware file %s: %s", fileName, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    firmware->fileName = (char *)fileName;
+    firmware->size = size;
+    firmware->dataBlockCount = (size - INFO_BLOCK_SIZE) / DATA_BLOCK_SIZE;
+    firmware->bytes = bytes;
+    firmware->mapped = mapped;
+    versionFromFileName(fileName, firmware->version);
+    return 0;
+}
+
+void freeFirmware(struct FirmwareImage *firmware) {
+    if (firmware->bytes) {
+#if !defined(_WIN32)
+        if (firmware->mapped) {
+            munmap((void *)firmware->bytes, firmware->size);
+        } else
+#endif
+        {
+            free((void *)firmware->bytes);
+        }
+    }
+    firmware->bytes = NULL;
+    firmware->size = 0;
+    firmware->dataBlockCount = 0;
+}
+
+const uint8_t *firmwareInfoBlock(const struct FirmwareImage *firmware) {
+    return firmware->bytes;
+}
+
+unsigned int firmwareBlockCount(const struct FirmwareImage *firmware, unsigned int blockSize) {
+    return (firmware->size - INFO_BLOCK_SIZE + blockSize - 1) / blockSize;
+}
+
+const uint8_t *firmwareDataBlock(const struct FirmwareImage *firmware, unsigned int block, unsigned int blockSize, unsigned int *size) {
+    unsigned int offset = INFO_BLOCK_SIZE + block * blockSize;
+    *size = (firmware->size - offset < blockSize) ? firmware->size - offset : blockSize;
+    return firmware->bytes + offset;
+}
+
+static int startsWord(const uint8_t *info, size_t pos) {
+    return (pos == 0) || !isgraph(info[pos - 1]);
+}
+
+int firmwareHasSignature(const struct FirmwareImage *firmware, const char *signature) {
+    const uint8_t *info = firmwareInfoBlock(firmware);
+    size_t len = strlen(signature);
+    if ((len == 0) || (len > INFO_BLOCK_SIZE / 2)) {
+        return 0;
+    }
+
+    for (size_t pos = 0; pos + len <= INFO_BLOCK_SIZE; pos++) {
+        if ((memcmp(info + pos, signature, len) == 0) && startsWord(info, pos) && ((pos + len == INFO_BLOCK_SIZE) || (info[pos + len] == '\0'))) {
+            return 1;
+        }
+    }
+    for (size_t pos = 0; pos + 2 * len <= INFO_BLOCK_SIZE; pos += 2) {
+        size_t i = 0;
+        while ((i < len) && (info[pos + 2 * i] == 0) && (info[pos + 2 * i + 1] == (uint8_t)signature[i])) {
+            i++;
+        }
+        if ((i == len) && startsWord(info, pos) && ((pos + 2 * len == INFO_BLOCK_SIZE) || (info[pos + 2 * len + 1] == '\0'))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint64_t firmwareHash(const struct FirmwareImage *firmware) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned int i = 0; i < firmware->size; i++) {
+        hash = (hash ^ firmware->bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+void blockToRegisters(const uint8_t *block, unsigned int size, uint16_t *regs) {
+    for (unsigned int i = 0; i < size / 2; i++) {
+        regs[i] = (block[2 * i] << 8) | block[2 * i + 1];
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef FIRMWARE_IMAGE_H
+#define FIRMWARE_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define INFO_BLOCK_SIZE             32
+#define DATA_BLOCK_SIZE             136
+#define FIRMWARE_VERSION_MAX        32
+#define FIRMWARE_ERROR_MAX          512     // loadFirmware() reason, a longer one is cut
+
+/*
+.wbfw file: info block followed by whole data blocks, registers are
+big-endian, exactly as they go to the wire. The file is mapped read-only
+(read into memory on Windows), checked once and then shared by everyone
+flashing it: blocks are views into the mapping, nothing is copied.
+*/
+struct FirmwareImage {
+    char *fileName;
+    unsigned int size;
+    unsigned int dataBlockCount;
+    const uint8_t *bytes;
+    int mapped;             // bytes is a mapping, not a heap buffer
+    char version[FIRMWARE_VERSION_MAX];     // from release file name "<version>.wbfw", empty if unknown
+};
+
+// Maps and validates the file. Returns -1 with the reason in error if it can't be flashed.
+int loadFirmware(const char *fileName, struct FirmwareImage *firmware, char *error, size_t errorSize);
+
+void freeFirmware(struct FirmwareImage *firmware);
+
+const uint8_t *firmwareInfoBlock(const struct FirmwareImage *firmware);
+
+/*
+Data blocks as they are sent: the image's data cut into blockSize pieces,
+counted from 0. With DATA_BLOCK_SIZE these are the file's blocks, a larger
+size negotiated with the bootloader leaves the last one shorter.
+*/
+unsigned int firmwareBlockCount(const struct FirmwareImage *firmware, unsigned int blockSize);
+const uint8_t *firmwareDataBlock(const struct FirmwareImage *firmware, unsigned int block, unsigned int blockSize, unsigned int *size);
+
+/*
+Info block has the signature of devices the image is for, but not its
+version. Signature is looked up both as packed text and one character per
+register, and must be the whole string, not a prefix of a longer one.
+*/
+int firmwareHasSignature(const struct FirmwareImage *firmware, const char *signature);
+
+// FNV-1a of the whole file, tells images apart in saved progress
+uint64_t firmwareHash(const struct FirmwareImage *firmware);
+
+// Big-endian block bytes to registers for modbus_write_registers()
+void blockToRegisters(const uint8_t *block, unsigned int size, uint16_t *regs);
+
+#endif
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <modbus.h>
@@ -6,86 +8,221 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/time.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#if !defined(_WIN32)
+#include <stdint.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "wbflasher.h"
+#include "firmware_image.h"
+#include "checkpoint.h"
+#include "uart_cache.h"
+
+#define BOOTLOADER_JUMP_WINDOW_SEC     120     // bootloader waits for firmware after jump
+#define JUMP_AHEAD_MARGIN_SEC          30      // keep out of the window end when jumping ahead
+#define BL_BLOCK_PROCESSING_SEC        0.05    // flash write time per data block, estimate
 
-#define INFO_BLOCK_SIZE             32
-#define INFO_BLOCK_REG_ADDRESS      0x1000
-
-#define DATA_BLOCK_SIZE             136
-#define DATA_BLOCK_REG_ADDRESS      0x2000
-
-#define MAX_ERROR_COUNT             3
-
-#define HOLD_REG_JUMP_TO_BOOT_STANDARD_BAUD 129
-#define HOLD_REG_JUMP_TO_BOOT_CURRENT_BAUD  131
-#define HOLD_REG_CMD_UART_SETTINGS_RESET    1000
-#define HOLD_REG_CMD_EEPROM_ERASE           1001
-#define HOLD_REG_CMD_FLASHFS_ERASE_SETTINGS 1002
-#define HOLD_REG_CMD_FLASHFS_FULL_ERASE     1005
-
-#define HOLD_REG_BOOTLOADER_VERSION 330
-#define BOOTLOADER_VERSION_LEN      8
-#define HOLD_REG_FIRMWARE_SIGNATURE 290
-#define FW_SIG_LEN                  12
-#define HOLD_REG_FIRMWARE_VERSION   250
-#define FW_VERSION_LEN              15
-
-#define BL_MINIMAL_RESPONSE_TIMEOUT    5.0
-
-// Component firmware registers
-#define COMP_FW_FLAGS_REG               0xFE80
-#define COMP_FW_BASE_REG                0xFD00
-#define COMP_FW_INFO_STRIDE             48
-#define COMP_FW_MODEL_OFFSET            0
-#define COMP_FW_MODEL_LEN               20
-#define COMP_FW_SIGNATURE_OFFSET        0x14
-#define COMP_FW_SIGNATURE_LEN           12
-#define COMP_FW_VERSION_OFFSET          0x20
-#define COMP_FW_VERSION_LEN             16
-#define COMP_FW_MAX_COUNT               8
+#define SCAN_FIRST_ADDRESS             1
+#define SCAN_LAST_ADDRESS              247
+#define SCAN_TURNAROUND_SEC            0.03    // initial allowance for device's reply delay while scanning
+#define SCAN_TURNAROUND_FACTOR         3       // allowance grows to this many times the slowest reply delay seen
+
+#define SERVICE_REQUEST_TIMEOUT_SEC     10      // --daemon client should send its request within
+
+#define MANIFEST_LINE_MAX               1024
+#define LOG_LINE_MAX                    256
+#define MAX_PORTS                       16
+#define MAX_IMAGES                      (2 + COMP_FW_MAX_COUNT)    // bootloader, main firmware and components
+#define TRACED_PORTS_MAX                64      // ports whose frames --trace writes, the daemon may serve many
 
 #define xstr(a) str(a)
 #define str(a) #a
 
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
 const char flashingExample[] = "-d <port> -f <firmware.wbfw>";
 const char casualUsageExample[] = "-d <port> -a <modbus_addr> -j -f <firmware.wbfw>";
 
-struct UartSettings {
-    int baudrate;
-    char parity;
-    int databits;
-    int stopbits;
-    int stopbitsAreForced;
-} UartSettings;
+// Options without a short form
+enum long_option {
+    OPT_MANIFEST = 0x100,
+    OPT_JUMP_AHEAD,
+    OPT_READY_TIMEOUT,
+    OPT_AUTO_BAUD,
+    OPT_WINDOW,
+    OPT_STATS,
+    OPT_SCAN,
+    OPT_IMAGE_VERSION,
+    OPT_RESUME,
+    OPT_RETRIES,
+    OPT_RETRY_BACKOFF,
+    OPT_DAEMON,
+    OPT_BROADCAST,
+    OPT_UART_CACHE,
+    OPT_TRACE,
+    OPT_LOCK_TIMEOUT
+};
+
+// Commands bootloader executes and reboots, -u, -e, -w and -W
+enum bootloader_command {
+    BL_COMMAND_UART_RESET,
+    BL_COMMAND_EEPROM_ERASE,
+    BL_COMMAND_FLASHFS_ERASE_SETTINGS,
+    BL_COMMAND_FLASHFS_FULL_ERASE,
+    BL_COMMAND_COUNT
+};
+
+struct BlockStat {
+    unsigned int block;     // 0 is the info block, data blocks are counted from 1
+    unsigned int size;
+    float rttSec;           // last attempt round trip, negative if never acknowledged
+    int retries;
+    int lastErrno;          // error of the last failed attempt, 0 if none
+};
+
+struct FlashStats {
+    double phaseSec[PHASE_COUNT];
+    enum flash_phase phase;
+    struct timeval phaseStart;
+    struct BlockStat *blocks;
+    unsigned int blockCount;
+    unsigned int blockCapacity;
+};
 
-enum stopbits_mode {
-    STOPBITS_FROM_PARAMS,
-    STOPBITS_FORCE_TWO
+// What the command line tool keeps per port besides the session, in its user pointer
+struct PortOutput {
+    const char *logPrefix;          // set when several ports are served at once
+    char logLine[LOG_LINE_MAX];
+    size_t logLineLen;
+    struct FlashStats *stats;       // stats of the device being flashed, NULL without --stats
+    struct Checkpoint *checkpoint;  // progress saved for --resume, NULL without it
+    FILE *client;                   // --daemon client of the device being served, gets the output too
+    unsigned int traceSaved;        // frames the port had recorded when --trace got them last time
 };
 
-const int allowedBaudrates[] = {1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400};
-const int allowedStopBits[] = {1, 2};
-const char allowedParity[] = {'N', 'E', 'O'};
+enum image_kind {
+    IMAGE_MAIN,             // bootloader writes it and starts it
+    IMAGE_BOOTLOADER,       // bootloader writes it and restarts into the new bootloader
+    IMAGE_COMPONENT,        // *.compfw, the running main firmware writes it
+    IMAGE_KIND_COUNT
+};
+
+// One of several -f flashed in one session
+struct SessionImage {
+    char *fileName;
+    enum image_kind kind;
+    struct FirmwareImage firmware;
+};
+
+struct ManifestEntry {
+    int line;
+    char *device;
+    int modbusID;
+    char *fileName;
+    enum jump_mode jumpMode;
+    int autoBaud;
+    struct UartSettings deviceParams;
+    struct UartSettings bootloaderParams;
+    struct FirmwareImage *firmware;
+    char *imageVersion;         // overrides the version from the file name, NULL if not given
+    const char *status;
+    double elapsedSec;
+    int jumpSent;
+    struct timeval jumpTime;
+    struct FlashStats stats;
+    FILE *client;               // --daemon client that asked for it, NULL otherwise
+};
+
+// Device found by --scan
+struct ScanResult {
+    const char *device;
+    int modbusID;
+    enum transport transport;
+    struct UartSettings params;     // meaningless behind a gateway
+    float replySec;
+    char *signature;
+    char *firmwareVersion;      // NULL in bootloader
+    char *bootloaderVersion;
+};
+
+// Batch run settings shared by all ports
+struct BatchOptions {
+    int debug;
+    float responseTimeout;
+    double readyTimeout;
+    int jumpAhead;          // how many next devices are sent to bootloader while current one is flashed
+    int window;
+    int collectStats;
+    int preflight;          // check devices before sending them to bootloader
+    int retries;
+    double retryBackoffSec;
+    int broadcast;          // entries of a port are one image for a group of devices, see broadcastQueue()
+    int lowLatency;
+    double lockTimeoutSec;
+};
 
 int ensureIntIn(int param, const int array[], unsigned int arrayLen);
 int ensureCharIn(char param, const char array[], unsigned int arrayLen);
 
-modbus_t *initModbus(char *device, struct UartSettings deviceParams, int slaveAddr, int debug, float responseTimeout, enum stopbits_mode stopbitsMode);
+void initCliPort(struct PortConnection *port, struct PortOutput *output, char *device);
+
+int printDeviceInfo(struct PortConnection *port);
+
+int sendBootloaderCommand(struct PortConnection *port, enum bootloader_command command);
+
+enum image_kind parseImageKind(char **fileName);
+int openFirmware(const char *fileName, struct FirmwareImage *firmware);
+int loadImageSet(char *fileNames[], int count, struct SessionImage *images);
+int flashImageSet(struct PortConnection *port, struct SessionImage *images, int count, int modbusID, enum jump_mode jumpMode,
+                  struct UartSettings deviceParams, struct UartSettings bootloaderParams, float responseTimeout);
 
-void deinitModbus(modbus_t *modbusConnection);
+int printComponentFirmwares(struct PortConnection *port);
 
-char *mbReadString(modbus_t *ctx, int startAddr, int len);
+int parseManifest(const char *fileName, const struct ManifestEntry *defaults, struct ManifestEntry **entries);
 
-int probeConnection(modbus_t *ctx);
+int runManifest(struct ManifestEntry *entries, int count, const struct BatchOptions *options);
 
-int printDeviceInfo(modbus_t *ctx);
+int buildPortEntries(char *devices[], int deviceCount, const char *fileName, const struct ManifestEntry *defaults, struct ManifestEntry **entries);
 
-int printComponentFirmwares(modbus_t *ctx);
+int parseAddressList(const char *list, int *addrs, int maxCount);
+int buildGroupEntries(const int *addrs, int count, const char *fileName, const struct ManifestEntry *defaults, struct ManifestEntry **entries);
 
-struct timeval parseResponseTimeout(float timeoutSec);
+void freeManifest(struct ManifestEntry *entries, int count);
 
-void setResponseTimeout(struct timeval timeoutStruct, modbus_t *modbusContext);
+void statsEnterPhase(struct PortConnection *port, enum flash_phase phase);
+void statsAddBlock(struct PortConnection *port, const struct BlockEvent *event);
+int writeStatsReport(const char *fileName, struct ManifestEntry *entries, int count, double totalSec);
+int writeSingleReport(const char *fileName, struct ManifestEntry *report, const struct timeval *start, const char *status);
+void freeStats(struct FlashStats *stats);
 
-void interFrameDelay(void);
+int parseScanParams(const char *list, struct UartSettings defaults, struct UartSettings *params, int maxCount);
+int scanBus(struct PortConnection *port, const struct UartSettings *params, int paramsCount, float responseTimeout, FILE *log, struct ScanResult **results, int *count);
+void printScanResults(FILE *f, const struct ScanResult *results, int count, int json);
+void freeScanResults(struct ScanResult *results, int count);
+
+int runService(const char *socketPath, const struct ManifestEntry *defaults, const struct BatchOptions *options);
+
+int openTraceFile(const char *fileName);
+void traceFrames(struct PortConnection *port);
+void saveFrameTrace(struct PortConnection *port, int forget);
+void saveAllFrameTraces(void);
+
+#if !defined(_WIN32)
+// Before the flasher dies on a signal --trace gets the last frames, --low-latency ports their settings back and lock files go
+static void cleanUpAndDie(int signum) {
+    saveAllFrameTraces();
+    restoreSerialPorts();
+    removePortLockFiles();
+    signal(signum, SIG_DFL);
+    raise(signum);
+}
+#endif
 
 int main(int argc, char *argv[])
 {
@@ -96,13 +233,16 @@ int main(int argc, char *argv[])
 
         printf("Param  Description                                         Default value\n\n");
 #if defined(_WIN32)
-        printf("-d     Serial port (\"COMxx\", e.g. COM12)                         -\n");
+        printf("-d     Serial port (\"COMxx\", e.g. COM12), may be repeated      -\n");
+        printf("         or Modbus TCP gateway: tcp://<host>[:port]\n");
         printf("-s     Stopbits (2/1)                                              2\n");
 #else
-        printf("-d     Serial port (e.g. \"/dev/ttyRS485-1\")                      -\n");
+        printf("-d     Serial port (e.g. \"/dev/ttyRS485-1\"), may be repeated     -\n");
+        printf("         or gateway: tcp://<host>[:port] (Modbus TCP), rtu-over-tcp://<host>[:port]\n");
         printf("-s     Stopbits used to communicate with firmware (2/1)   auto: (2sb->, ->1sb)\n");
 #endif
-        printf("-f     Firmware file                                             -\n");
+        printf("-f     Firmware file, may be repeated to flash several in one session  -\n");
+        printf("         [bootloader=|component=]<file>, *.compfw are component firmwares\n");
         printf("-a     Modbus ID (slave addr)                                    1\n");
         printf("-j     Jump to bootloader using reg 129                          -\n");
         printf("         uses 9600N2 for communicate with bootloader (can be changed with -B key)\n");
@@ -115,6 +255,30 @@ int main(int argc, char *argv[])
         printf("-B     Baudrate used to communicate with bootloader              9600\n");
         printf("-p     Parity                                                    N\n");
         printf("-t     Slave response timeout (in seconds)                       10.0\n");
+        printf("--manifest <file>  Flash several devices on one port, see below  -\n");
+        printf("--jump-ahead <n>   Devices jumped to bootloader while previous one is flashed  1\n");
+        printf("--ready-timeout <sec>  Max wait for device after jump or reset/erase command  " xstr(READY_TIMEOUT_SEC) "\n");
+        printf("--lock-timeout <sec>   Max wait for serial port locked by another program  " xstr(PORT_LOCK_TIMEOUT_SEC) "\n");
+        printf("--auto-baud        Use the fastest baudrate bootloader answers on instead of -B  -\n");
+        printf("                   with -j tries reg 131 first to keep faster firmware baudrate\n");
+        printf("--window <n>       Data blocks in flight on tcp:// gateway (1..%d)  1\n", WINDOW_MAX);
+        printf("--stats=<file>     Write per-block timings and summary, JSON or CSV (*.csv)  -\n");
+        printf("--scan[=<list>]    Find devices on addresses %d..%d and print their signatures and versions  -\n", SCAN_FIRST_ADDRESS, SCAN_LAST_ADDRESS);
+        printf("                   at -b/-p/-s, or at each of comma-separated settings (e.g. 115200N2,9600E1), \"all\" for every baudrate and parity\n");
+        printf("--json             Print --scan inventory as JSON                            -\n");
+        printf("--preflight        Before flashing check device signature against the image, skip devices already running its version  -\n");
+        printf("--image-version <v>  Image version for --preflight and --broadcast  from file name <version>.wbfw\n");
+        printf("--resume <file>    Save progress to file, continue interrupted flashing from it  -\n");
+        printf("--retries <n>      Retries of a data block before flashing fails                  %d\n", DATA_BLOCK_RETRIES);
+        printf("--retry-backoff <sec>  Pause before the first retry, doubled on every next one  %.2f\n", RETRY_BACKOFF_SEC);
+        printf("--broadcast <list> Flash identical devices at once on broadcast address, e.g. 10,11,20-25  -\n");
+        printf("--detect-uart      Find baudrate, parity and stop bits the device answers on, -b/-p/-s are tried first  -\n");
+        printf("--uart-cache <file>  Where --detect-uart remembers found settings  " UART_CACHE_DEFAULT_FILE "\n");
+        printf("--trace <file>     Write last %d Modbus frames of a port when a device fails and at exit  -\n", FRAME_TRACE_SIZE);
+#if !defined(_WIN32)
+        printf("--low-latency      Tune serial ports for short round trips: low latency, kernel RS-485 mode, read thresholds  -\n");
+        printf("--daemon <socket>  Keep ports open and serve flash/info/erase requests on a Unix socket, see below  -\n");
+#endif
 
         printf("\nExamples:\n\n");
 
@@ -130,11 +294,45 @@ int main(int argc, char *argv[])
 
         printf("Flashing running device using custom baudrate:\n");
         printf("    %s -d <port> -a <modbus_addr> -b115200 -J -f <firmware.wbfw>\n", argv[0]);
-        printf("    useful for flashing device behind Modbus-TCP gateway\n\n");
+        printf("    useful for flashing device behind Modbus-TCP gateway:\n");
+        printf("    %s -d tcp://<gateway>:502 -a <modbus_addr> -b115200 -J -f <firmware.wbfw>\n\n", argv[0]);
 
         printf("Only read device info (no flashing):\n");
         printf("    %s -d <port> -a10 --get-device-info\n\n", argv[0]);
 
+        printf("Flashing several devices on one port:\n");
+        printf("    %s -d <port> -j --manifest <devices.txt>\n", argv[0]);
+        printf("    each manifest line is \"<modbus_addr> <firmware.wbfw> [jump=j|J|none] [baud=N] [parity=N|E|O] [stopbits=N] [bl-baud=N] [port=<port>] [auto-baud] [version=<version>]\",\n");
+        printf("    missing fields are taken from the command line keys, devices on different ports are flashed in parallel\n\n");
+
+        printf("Updating bootloader, firmware and a component firmware at once:\n");
+        printf("    %s -d <port> -a <modbus_addr> -j -f bootloader=<bootloader.wbfw> -f <firmware.wbfw> -f <component.compfw>\n", argv[0]);
+        printf("    images are flashed in the given order, device is sent to bootloader and back only when the next image needs it\n\n");
+
+        printf("Flashing the same device on several ports in parallel:\n");
+        printf("    %s -d <port1> -d <port2> -a <modbus_addr> -j -f <firmware.wbfw>\n\n", argv[0]);
+
+        printf("Flashing identical devices on one bus at once:\n");
+        printf("    %s -d <port> -j --broadcast 10-15,20 -f <firmware.wbfw>\n", argv[0]);
+        printf("    the image is sent once, devices that didn't start it are flashed one by one after that\n\n");
+
+        printf("Flashing device with unknown UART settings:\n");
+        printf("    %s -d <port> -a <modbus_addr> --detect-uart -j -f <firmware.wbfw>\n", argv[0]);
+        printf("    settings found are remembered, next time the device is connected on the first try\n\n");
+
+        printf("Finding devices on the bus:\n");
+        printf("    %s -d <port> -b115200 --scan\n", argv[0]);
+        printf("    %s -d <port> --scan=all --json\n\n", argv[0]);
+
+#if !defined(_WIN32)
+        printf("Serving requests of other programs:\n");
+        printf("    %s -d <port> -j --daemon /run/wb-mcu-fw-flasher.sock\n", argv[0]);
+        printf("    request is a line \"flash <modbus_addr> <firmware.wbfw> [options]\", \"info <modbus_addr> [options]\"\n");
+        printf("    or \"erase <modbus_addr> uart|eeprom|settings|all [options]\" with manifest options, keys are the defaults;\n");
+        printf("    the reply is the output followed by \"STATUS <result>\" line, e.g.\n");
+        printf("    echo \"flash 10 firmware.wbfw\" | socat - UNIX-CONNECT:/run/wb-mcu-fw-flasher.sock\n\n");
+#endif
+
         return 0;
     };
 
@@ -155,7 +353,11 @@ int main(int argc, char *argv[])
 
     // Default values
     char *device   = NULL;
+    char *devices[MAX_PORTS];
+    int   deviceCount = 0;
     char *fileName = NULL;
+    char *fileNames[MAX_IMAGES];
+    int   imageCount = 0;
     int   modbusID = 1;
     int   jumpCmdStandardBaud = 0;
     int   jumpCmdCurrentBaud = 0;
@@ -167,9 +369,51 @@ int main(int argc, char *argv[])
     int   debug    = 0;
     int   inBootloader = 0;
     float responseTimeout = 10.0f; // Seconds
+    char *manifestFileName = NULL;
+    int   jumpAhead = 1;
+    float readyTimeout = READY_TIMEOUT_SEC;
+    float lockTimeout = PORT_LOCK_TIMEOUT_SEC;
+    int   autoBaud = 0;
+    int   window = 1;
+    char *statsFileName = NULL;
+    int   scan = 0;
+    char *scanList = NULL;
+    int   json = 0;
+    int   preflight = 0;
+    char *imageVersion = NULL;
+    char *resumeFileName = NULL;
+    int   retries = DATA_BLOCK_RETRIES;
+    float retryBackoff = RETRY_BACKOFF_SEC;
+    char *socketPath = NULL;
+    char *broadcastList = NULL;
+    int   detectUart = 0;
+    int   uartGiven = 0;
+    char *uartCacheFileName = UART_CACHE_DEFAULT_FILE;
+    int   lowLatency = 0;
+    char *traceFileName = NULL;
 
     const struct option longOptions[] = {
 		{ "get-device-info", no_argument, &onlyReadInfo, 1 },
+		{ "manifest", required_argument, NULL, OPT_MANIFEST },
+		{ "jump-ahead", required_argument, NULL, OPT_JUMP_AHEAD },
+		{ "ready-timeout", required_argument, NULL, OPT_READY_TIMEOUT },
+		{ "lock-timeout", required_argument, NULL, OPT_LOCK_TIMEOUT },
+		{ "auto-baud", no_argument, &autoBaud, 1 },
+		{ "window", required_argument, NULL, OPT_WINDOW },
+		{ "stats", required_argument, NULL, OPT_STATS },
+		{ "scan", optional_argument, NULL, OPT_SCAN },
+		{ "json", no_argument, &json, 1 },
+		{ "preflight", no_argument, &preflight, 1 },
+		{ "image-version", required_argument, NULL, OPT_IMAGE_VERSION },
+		{ "resume", required_argument, NULL, OPT_RESUME },
+		{ "retries", required_argument, NULL, OPT_RETRIES },
+		{ "retry-backoff", required_argument, NULL, OPT_RETRY_BACKOFF },
+		{ "daemon", required_argument, NULL, OPT_DAEMON },
+		{ "broadcast", required_argument, NULL, OPT_BROADCAST },
+		{ "detect-uart", no_argument, &detectUart, 1 },
+		{ "uart-cache", required_argument, NULL, OPT_UART_CACHE },
+		{ "low-latency", no_argument, &lowLatency, 1 },
+		{ "trace", required_argument, NULL, OPT_TRACE },
 		{ NULL, 0, NULL, 0}
 	};
 
@@ -178,10 +422,19 @@ int main(int argc, char *argv[])
     while ((c = getopt_long(argc, argv, "d:f:a:t:jJuewWDb:p:s:B:", longOptions, NULL)) != -1) {
         switch (c) {
         case 'd':
-            device = optarg;
+            if (deviceCount == MAX_PORTS) {
+                printf("Too many ports, at most %d are supported!\n", MAX_PORTS);
+                exit(EXIT_FAILURE);
+            }
+            devices[deviceCount++] = optarg;
             break;
         case 'f':
-            fileName = optarg;
+            if (imageCount == MAX_IMAGES) {
+                printf("Too many images, at most %d are supported!\n", MAX_IMAGES);
+                exit(EXIT_FAILURE);
+            }
+            fileNames[imageCount++] = optarg;
+            fileName = fileNames[0];
             break;
         case 'a':
             sscanf(optarg, "%d", &modbusID);
@@ -216,8 +469,9 @@ int main(int argc, char *argv[])
             debug = 1;
             break;
         case 'b':
+            uartGiven = 1;
             sscanf(optarg, "%d", &deviceParams.baudrate);
-            if (ensureIntIn(deviceParams.baudrate, allowedBaudrates, sizeof(allowedBaudrates))) {
+            if (ensureIntIn(deviceParams.baudrate, allowedBaudrates, ARRAY_SIZE(allowedBaudrates))) {
                 break;
             } else {
                 printf("Baudrate (-b <%d>) is not supported!\n", deviceParams.baudrate);
@@ -225,15 +479,16 @@ int main(int argc, char *argv[])
             };
         case 'B':
             sscanf(optarg, "%d", &bootloaderParams.baudrate);
-            if (ensureIntIn(bootloaderParams.baudrate, allowedBaudrates, sizeof(allowedBaudrates))) {
+            if (ensureIntIn(bootloaderParams.baudrate, allowedBaudrates, ARRAY_SIZE(allowedBaudrates))) {
                 break;
             } else {
                 printf("Baudrate (-B <%d>) is not supported!\n", bootloaderParams.baudrate);
                 exit(EXIT_FAILURE);
             };
         case 'p':
+            uartGiven = 1;
             sscanf(optarg, "%c", &deviceParams.parity);
-            if (ensureCharIn(deviceParams.parity, allowedParity, sizeof(allowedParity))) {
+            if (ensureCharIn(deviceParams.parity, allowedParity, ARRAY_SIZE(allowedParity))) {
                 break;
             } else {
                 printf("Parity (-p <%c>) is not supported!\n", deviceParams.parity);
@@ -247,8 +502,9 @@ int main(int argc, char *argv[])
             WIN32 - 2sb
             Posix - auto stopbits (2sb->, ->1sb)
         */
+            uartGiven = 1;
             sscanf(optarg, "%d", &stopbits);
-            if (ensureIntIn(stopbits, allowedStopBits, sizeof(allowedStopBits))) {
+            if (ensureIntIn(stopbits, allowedStopBits, ARRAY_SIZE(allowedStopBits))) {
                 deviceParams.stopbitsAreForced = 1;
                 deviceParams.stopbits = stopbits;
                 break;
@@ -256,6 +512,81 @@ int main(int argc, char *argv[])
                 printf ("Stopbits (-s <%d>) are not supported!\n", stopbits);
                 exit(EXIT_FAILURE);
             };
+        case OPT_MANIFEST:
+            manifestFileName = optarg;
+            break;
+        case OPT_JUMP_AHEAD:
+            if ((sscanf(optarg, "%d", &jumpAhead) == 1) && (jumpAhead >= 0)) {
+                break;
+            } else {
+                printf("Jump ahead count (--jump-ahead <%s>) should be a non-negative number!\n", optarg);
+                exit(EXIT_FAILURE);
+            };
+        case OPT_READY_TIMEOUT:
+            if ((sscanf(optarg, "%f", &readyTimeout) == 1) && (readyTimeout >= 0)) {
+                break;
+            } else {
+                printf("Ready timeout (--ready-timeout <%s>) could not be less zero!\n", optarg);
+                exit(EXIT_FAILURE);
+            };
+        case OPT_LOCK_TIMEOUT:
+            if ((sscanf(optarg, "%f", &lockTimeout) == 1) && (lockTimeout >= 0)) {
+                break;
+            } else {
+                printf("Lock timeout (--lock-timeout <%s>) could not be less zero!\n", optarg);
+                exit(EXIT_FAILURE);
+            };
+        case OPT_WINDOW:
+            if ((sscanf(optarg, "%d", &window) == 1) && (window >= 1) && (window <= WINDOW_MAX)) {
+                break;
+            } else {
+                printf("Window (--window <%s>) should be from 1 to %d!\n", optarg, WINDOW_MAX);
+                exit(EXIT_FAILURE);
+            };
+        case OPT_STATS:
+            statsFileName = optarg;
+            break;
+        case OPT_SCAN:
+            scan = 1;
+            scanList = optarg;
+            break;
+        case OPT_IMAGE_VERSION:
+            if ((optarg[0] != '\0') && (strlen(optarg) < FIRMWARE_VERSION_MAX)) {
+                imageVersion = optarg;
+                break;
+            } else {
+                printf("Image version (--image-version <%s>) should be 1 to %d characters!\n", optarg, FIRMWARE_VERSION_MAX - 1);
+                exit(EXIT_FAILURE);
+            };
+        case OPT_RESUME:
+            resumeFileName = optarg;
+            break;
+        case OPT_RETRIES:
+            if ((sscanf(optarg, "%d", &retries) == 1) && (retries >= 0)) {
+                break;
+            } else {
+                printf("Retries (--retries <%s>) should be a non-negative number!\n", optarg);
+                exit(EXIT_FAILURE);
+            };
+        case OPT_RETRY_BACKOFF:
+            if ((sscanf(optarg, "%f", &retryBackoff) == 1) && (retryBackoff >= 0) && (retryBackoff <= RETRY_BACKOFF_MAX_SEC)) {
+                break;
+            } else {
+                printf("Retry backoff (--retry-backoff <%s>) should be from 0 to %.1f s!\n", optarg, RETRY_BACKOFF_MAX_SEC);
+                exit(EXIT_FAILURE);
+            };
+        case OPT_DAEMON:
+            socketPath = optarg;
+            break;
+        case OPT_BROADCAST:
+            broadcastList = optarg;
+            break;
+        case OPT_TRACE:
+            traceFileName = optarg;
+            break;
+        case OPT_UART_CACHE:
+            uartCacheFileName = optarg;
+            break;
         case '?':
             printf("Parameters error.\n");
             break;
@@ -268,156 +599,457 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-#if defined(_WIN32)
-    // We expect device in a form of "COMxx". So strip leading "." and "\", and trailing ":".
-    if (device) {
-        size_t startPos = 0, endPos = strlen(device);
+    enum jump_mode jumpMode = JUMP_NONE;
+    if (jumpCmdStandardBaud) {
+        jumpMode = autoBaud ? JUMP_FASTEST : JUMP_STANDARD_BAUD;
+    } else if (jumpCmdCurrentBaud) {
+        jumpMode = JUMP_CURRENT_BAUD;
+    }
 
-        for (startPos=0;
-            (startPos < strlen(device)) && ((device[startPos] == '.') || (device[startPos] == '\\'));
-            ++startPos) {};
+    if (manifestFileName && (fileName || onlyReadInfo || uartResetCmd || eepromFormatCmd || flashFsEraseSettingsCmd || flashFsFullEraseCmd)) {
+        printf("Parameters error.\n");
+        printf("--manifest can't be combined with -f, -u, -e, -w, -W and --get-device-info.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((preflight || imageVersion) && (((fileName == NULL) && (manifestFileName == NULL) && (socketPath == NULL)) || uartResetCmd || eepromFormatCmd || flashFsEraseSettingsCmd || flashFsFullEraseCmd)) {
+        printf("Parameters error.\n");
+        printf("--preflight and --image-version need -f, --manifest or --daemon and can't be combined with -u, -e, -w and -W.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (resumeFileName && ((fileName == NULL) || manifestFileName || (deviceCount > 1) || onlyReadInfo || uartResetCmd || eepromFormatCmd || flashFsEraseSettingsCmd || flashFsFullEraseCmd)) {
+        printf("Parameters error.\n");
+        printf("--resume flashes one device with -f and can't be combined with several -d, --manifest, -u, -e, -w, -W and --get-device-info.\n");
+        exit(EXIT_FAILURE);
+    }
 
-        for (endPos=strlen(device) - 1;
-            (endPos >=0) && (device[endPos] == ':');
-            --endPos) {};
+    if ((imageCount > 1) && (manifestFileName || broadcastList || resumeFileName || preflight || imageVersion || statsFileName || (deviceCount > 1) ||
+                             onlyReadInfo || uartResetCmd || eepromFormatCmd || flashFsEraseSettingsCmd || flashFsFullEraseCmd)) {
+        printf("Parameters error.\n");
+        printf("Several -f are flashed to one device in one session and can't be combined with several -d, --manifest, --broadcast, --resume, --preflight, --image-version, --stats, -u, -e, -w, -W and --get-device-info.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (imageCount == 1) {
+        parseImageKind(&fileName);  // a single image is flashed as it always was, whatever it is
+    }
 
-        char deviceStripped[32] = {};
-        strncpy(deviceStripped, device + startPos, min(sizeof(deviceStripped) - 1, endPos - startPos + 1));
+    if (detectUart && (manifestFileName || broadcastList || socketPath || scan || (deviceCount > 1) || ((jumpMode == JUMP_NONE) && !onlyReadInfo))) {
+        printf("Parameters error.\n");
+        printf("--detect-uart finds settings of one running device for -j, -J or --get-device-info and can't be combined with several -d, --manifest, --broadcast, --scan and --daemon.\n");
+        exit(EXIT_FAILURE);
+    }
 
-        char buffer[40] = "\\\\.\\";
-        strncpy(buffer + strlen(buffer), deviceStripped, sizeof(buffer) - strlen(buffer));
+    if (traceFileName) {
+        if (openTraceFile(traceFileName) < 0) {
+            printf("Can't open %s: %s\n", traceFileName, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        atexit(saveAllFrameTraces);
+    }
+    if (lowLatency) {
+#if defined(_WIN32)
+        printf("--low-latency is not supported on Windows\n");
+        exit(EXIT_FAILURE);
+#else
+        // Tuned ports get their settings back however the flasher ends
+        atexit(restoreSerialPorts);
+#endif
+    }
+#if !defined(_WIN32)
+    // Ports locked when the flasher exits without closing them don't stay locked for others
+    atexit(removePortLockFiles);
+    struct sigaction cleanUp = {.sa_handler = cleanUpAndDie};
+    sigemptyset(&cleanUp.sa_mask);
+    sigaction(SIGINT, &cleanUp, NULL);
+    sigaction(SIGTERM, &cleanUp, NULL);
+    sigaction(SIGHUP, &cleanUp, NULL);
+#endif
 
-        device = buffer;
+    for (int i = 0; i < deviceCount; i++) {
+        devices[i] = normalizePortName(devices[i]);
+    }
+    if (deviceCount) {
+        device = devices[0];
     }
+
+    if (socketPath) {
+        if (fileName || manifestFileName || scan || statsFileName || resumeFileName || onlyReadInfo || (deviceCount > 1) ||
+            uartResetCmd || eepromFormatCmd || flashFsEraseSettingsCmd || flashFsFullEraseCmd) {
+            printf("Parameters error.\n");
+            printf("--daemon takes jobs from requests and can't be combined with several -d, -f, -u, -e, -w, -W, --manifest, --scan, --stats, --resume and --get-device-info.\n");
+            exit(EXIT_FAILURE);
+        }
+#if defined(_WIN32)
+        printf("--daemon is not supported on Windows\n");
+        exit(EXIT_FAILURE);
+#else
+        // Command line keys are the defaults for every request, -d is the default port
+        struct ManifestEntry defaults = {
+            .device = device,
+            .modbusID = modbusID,
+            .jumpMode = jumpMode,
+            .autoBaud = autoBaud,
+            .deviceParams = deviceParams,
+            .bootloaderParams = bootloaderParams,
+            .imageVersion = imageVersion
+        };
+        struct BatchOptions options = {
+            .debug = debug,
+            .responseTimeout = responseTimeout,
+            .readyTimeout = readyTimeout,
+            .jumpAhead = jumpAhead,
+            .window = window,
+            .preflight = preflight,
+            .retries = retries,
+            .retryBackoffSec = retryBackoff,
+            .lowLatency = lowLatency,
+            .lockTimeoutSec = lockTimeout
+        };
+        exit((runService(socketPath, &defaults, &options) < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
 #endif
+    }
 
     if (device == NULL) {
         printf("A port should be specified!\n%s -d <port>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    //Connecting on device's params
-    modbus_t *deviceParamsConnection = initModbus(device, deviceParams, modbusID, debug, responseTimeout, STOPBITS_FROM_PARAMS);
+    if (scan) {
+        if (fileName || manifestFileName || onlyReadInfo || (jumpMode != JUMP_NONE) || uartResetCmd || eepromFormatCmd || flashFsEraseSettingsCmd || flashFsFullEraseCmd) {
+            printf("Parameters error.\n");
+            printf("--scan can't be combined with -f, -j, -J, -u, -e, -w, -W, --manifest and --get-device-info.\n");
+            exit(EXIT_FAILURE);
+        }
+        struct UartSettings scanParams[ARRAY_SIZE(allowedBaudrates) * ARRAY_SIZE(allowedParity)];
+        int scanParamsCount = 1;
+        scanParams[0] = deviceParams;
+        if (scanList) {
+            scanParamsCount = parseScanParams(scanList, deviceParams, scanParams, ARRAY_SIZE(scanParams));
+            if (scanParamsCount <= 0) {
+                exit(EXIT_FAILURE);
+            }
+        }
+        FILE *log = json ? stderr : stdout;
+        struct ScanResult *results = NULL;
+        int count = 0;
+        int failed = 0;
+        struct timeval scanStart;
+        gettimeofday(&scanStart, NULL);
+        for (int i = 0; i < deviceCount; i++) {
+            struct PortConnection port;
+            struct PortOutput output;
+            initCliPort(&port, &output, devices[i]);
+            port.debug = debug;
+            port.lowLatency = lowLatency;
+            port.lockTimeoutSec = lockTimeout;
+            if (scanBus(&port, scanParams, scanParamsCount, responseTimeout, log, &results, &count) < 0) {
+                failed++;
+            }
+            closePortConnection(&port);
+        }
+        fprintf(log, "%d device(s) found in %.1f s\n", count, secondsSince(&scanStart));
+        printScanResults(stdout, results, count, json);
+        freeScanResults(results, count);
+        exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
 
-    printf("%s opened successfully.\n", device);
+    if (broadcastList) {
+        if ((fileName == NULL) || manifestFileName || (deviceCount > 1) || autoBaud || statsFileName || resumeFileName || onlyReadInfo ||
+            uartResetCmd || eepromFormatCmd || flashFsEraseSettingsCmd || flashFsFullEraseCmd) {
+            printf("Parameters error.\n");
+            printf("--broadcast flashes -f on one port and can't be combined with several -d, --manifest, --auto-baud, --stats, --resume, -u, -e, -w, -W and --get-device-info.\n");
+            exit(EXIT_FAILURE);
+        }
+        int addrs[SCAN_LAST_ADDRESS];
+        int count = parseAddressList(broadcastList, addrs, ARRAY_SIZE(addrs));
+        if (count <= 0) {
+            exit(EXIT_FAILURE);
+        }
+        struct ManifestEntry defaults = {
+            .device = device,
+            .jumpMode = jumpMode,
+            .deviceParams = deviceParams,
+            .bootloaderParams = bootloaderParams,
+            .imageVersion = imageVersion
+        };
+        struct ManifestEntry *entries = NULL;
+        count = buildGroupEntries(addrs, count, fileName, &defaults, &entries);
+        if (count <= 0) {
+            exit(EXIT_FAILURE);
+        }
+        struct BatchOptions options = {
+            .debug = debug,
+            .responseTimeout = responseTimeout,
+            .readyTimeout = readyTimeout,
+            .preflight = preflight,
+            .retries = retries,
+            .retryBackoffSec = retryBackoff,
+            .broadcast = 1,
+            .lowLatency = lowLatency,
+            .lockTimeoutSec = lockTimeout
+        };
+        int failed = runManifest(entries, count, &options);
+        freeManifest(entries, count);
+        exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
 
-    if (jumpCmdStandardBaud) {
-        printf("Send jump to bootloader command and wait 2 seconds...\n");
-        if (modbus_write_register(deviceParamsConnection, HOLD_REG_JUMP_TO_BOOT_STANDARD_BAUD, 1) == 1) {
-            printf("Ok, device will jump to bootloader.\n");
-            inBootloader = 1;
+    if (manifestFileName || (deviceCount > 1)) {
+        // Command line keys are the defaults for every manifest entry
+        struct ManifestEntry defaults = {
+            .device = device,
+            .modbusID = modbusID,
+            .jumpMode = jumpMode,
+            .autoBaud = autoBaud,
+            .deviceParams = deviceParams,
+            .bootloaderParams = bootloaderParams,
+            .imageVersion = imageVersion
+        };
+        struct ManifestEntry *entries = NULL;
+        int count;
+        if (manifestFileName) {
+            count = parseManifest(manifestFileName, &defaults, &entries);
         } else {
-            printf("Error: %s.\n", modbus_strerror(errno));
-            if ((errno == EMBXILADD) ||
-                (errno == EMBXILVAL))  // some of ours fw report illegal data value on nonexistent register
-            {
-                fprintf(stderr, "Device probably doesn't support in-field firmware upgrade\n");
-                deinitModbus(deviceParamsConnection);
+            if ((fileName == NULL) || onlyReadInfo || uartResetCmd || eepromFormatCmd || flashFsEraseSettingsCmd || flashFsFullEraseCmd) {
+                printf("Parameters error.\n");
+                printf("Several ports can only be used for flashing (-f or --manifest).\n");
                 exit(EXIT_FAILURE);
             }
-            //Devices firmwares have bug: writing to  HOLD_REG_JUMP_TO_BOOTLOADER at low BDs causes modbus timeout error.
-            //"1" in HOLD_REG_JUMP_TO_BOOTLOADER causes reboot to bootloader, and device have ~5ms to send a responce
-            printf("May be device already in bootloader, check status led\n");
+            count = buildPortEntries(devices, deviceCount, fileName, &defaults, &entries);
         }
-        sleep(2);    // wait 2 seconds
-    } else if (jumpCmdCurrentBaud) {
-        printf("Try to jump to bootloader using current baudrate...\n");
-        if (modbus_write_register(deviceParamsConnection, HOLD_REG_JUMP_TO_BOOT_CURRENT_BAUD, 1) == 1) {
-            printf("Ok, device supports this. Baudrate %d will be used for flashing.\n", deviceParams.baudrate);
-            inBootloader = 1;
+        if (count <= 0) {
+            exit(EXIT_FAILURE);
+        }
+        struct BatchOptions options = {
+            .debug = debug,
+            .responseTimeout = responseTimeout,
+            .readyTimeout = readyTimeout,
+            .jumpAhead = jumpAhead,
+            .window = window,
+            .collectStats = (statsFileName != NULL),
+            .preflight = preflight,
+            .retries = retries,
+            .retryBackoffSec = retryBackoff,
+            .lowLatency = lowLatency,
+            .lockTimeoutSec = lockTimeout
+        };
+        struct timeval batchStart;
+        gettimeofday(&batchStart, NULL);
+        int failed = runManifest(entries, count, &options);
+        if (statsFileName && (writeStatsReport(statsFileName, entries, count, secondsSince(&batchStart)) < 0)) {
+            failed++;
+        }
+        freeManifest(entries, count);
+        exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    struct PortConnection port;
+    struct PortOutput output;
+    initCliPort(&port, &output, device);
+    port.debug = debug;
+    port.readyTimeout = readyTimeout;
+    port.autoBaud = autoBaud;
+    port.window = window;
+    port.retries = retries;
+    port.retryBackoffSec = retryBackoff;
+    port.lowLatency = lowLatency;
+    port.lockTimeoutSec = lockTimeout;
+    traceFrames(&port);
+    port.minBaudrate = (deviceParams.baudrate < bootloaderParams.baudrate) ? deviceParams.baudrate : bootloaderParams.baudrate;
+    struct timeval jumpTime = {0, 0};
+
+    // The device's record for --stats
+    struct ManifestEntry report = {
+        .device = device,
+        .modbusID = modbusID,
+        .fileName = fileName,
+        .firmware = NULL
+    };
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    if (statsFileName) {
+        output.stats = &report.stats;
+    }
+
+    // A broken file must fail before the device is sent to bootloader
+    struct FirmwareImage firmware = {0};
+    struct SessionImage images[MAX_IMAGES];
+    if (imageCount > 1) {
+        if (loadImageSet(fileNames, imageCount, images) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    } else if (fileName && (openFirmware(fileName, &firmware) < 0)) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Interrupted transfer of the same image to the same device goes on where it stopped
+    struct Checkpoint checkpoint;
+    if (resumeFileName) {
+        uint64_t hash = firmwareHash(&firmware);
+        if (loadCheckpoint(resumeFileName, &checkpoint) == 0) {
+            port.resume = (strcmp(checkpoint.device, device) == 0) && (checkpoint.modbusID == modbusID) &&
+                          (checkpoint.imageHash == hash) && (checkpoint.imageSize == firmware.size) &&
+                          (checkpoint.acked < firmwareBlockCount(&firmware, checkpoint.blockSize ? checkpoint.blockSize : DATA_BLOCK_SIZE));
+            if (!port.resume) {
+                printf("Checkpoint %s is for another device or image, flashing from the start\n", resumeFileName);
+            }
+        }
+        if (port.resume) {
+            printf("Resuming: %u of %u data blocks were written, device is in bootloader at %d%c2\n",
+                   checkpoint.acked, firmwareBlockCount(&firmware, checkpoint.blockSize ? checkpoint.blockSize : DATA_BLOCK_SIZE),
+                   checkpoint.baudrate, checkpoint.parity);
+            jumpMode = JUMP_NONE;
+            autoBaud = 0;
+            bootloaderParams.baudrate = checkpoint.baudrate;
+            bootloaderParams.parity = checkpoint.parity;
         } else {
-            fprintf(stderr, "Error while writing register %d: %s.\n", HOLD_REG_JUMP_TO_BOOT_CURRENT_BAUD, modbus_strerror(errno));
-            if (errno == EMBXILADD) {
-                fprintf(stderr, "Firmware and/or bootloader doesn't support this command. Please upgrade firmware and/or bootloader.\n");
-                fprintf(stderr, "Alternatively, you can use -j option to jump to bootloader using standard baudrate.\n");
-            } else {
-                fprintf(stderr, "Other error, check device connection parameters.\n");
+            memset(&checkpoint, 0, sizeof(checkpoint));
+            checkpoint.fileName = resumeFileName;
+            snprintf(checkpoint.device, sizeof(checkpoint.device), "%s", device);
+            checkpoint.modbusID = modbusID;
+            checkpoint.imageHash = hash;
+            checkpoint.imageSize = firmware.size;
+        }
+        port.resumeAcked = checkpoint.acked;
+        port.blockSize = checkpoint.blockSize;
+        output.checkpoint = &checkpoint;
+    }
+    statsEnterPhase(&port, PHASE_PORT_SETUP);
+
+    //Connecting on device's params
+    if (detectUart) {
+        // Keys given on the command line are the best guess, then the settings the device was found on last time
+        struct UartSettings guesses[2];
+        struct UartSettings cached;
+        int guessCount = 0;
+        int isCached = (loadUartSettings(uartCacheFileName, device, modbusID, &cached) == 0);
+        if (uartGiven) {
+            guesses[guessCount++] = deviceParams;
+        }
+        if (isCached) {
+            guesses[guessCount++] = cached;
+        }
+        if (guessCount == 0) {
+            guesses[guessCount++] = deviceParams;
+        }
+        struct UartSettings found;
+        if (detectUartSettings(&port, modbusID, guesses, guessCount, responseTimeout, &found) == 0) {
+            deviceParams = found;
+            port.minBaudrate = (deviceParams.baudrate < bootloaderParams.baudrate) ? deviceParams.baudrate : bootloaderParams.baudrate;
+            if ((!isCached || (cached.baudrate != found.baudrate) || (cached.parity != found.parity) || (cached.stopbits != found.stopbits)) &&
+                (saveUartSettings(uartCacheFileName, device, modbusID, found) < 0)) {
+                printf("Can't remember UART settings in %s: %s\n", uartCacheFileName, strerror(errno));
             }
-            deinitModbus(deviceParamsConnection);
+        }
+        if (port.ctx == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    } else if (openPortConnection(&port, deviceParams, modbusID, responseTimeout, STOPBITS_FROM_PARAMS) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%s opened successfully.\n", device);
+
+    if (imageCount > 1) {
+        int rc = flashImageSet(&port, images, imageCount, modbusID, jumpMode, deviceParams, bootloaderParams, responseTimeout);
+        closePortConnection(&port);
+        for (int i = 0; i < imageCount; i++) {
+            freeFirmware(&images[i].firmware);
+        }
+        if (rc < 0) {
+            exit(EXIT_FAILURE);
+        }
+        printf("\nAll done!\n");
+        exit(EXIT_SUCCESS);
+    }
+
+    if (imageVersion == NULL) {
+        imageVersion = firmware.version;
+    }
+    if (preflight && (jumpMode != JUMP_NONE)) {
+        enum preflight_result check = preflightCheck(&port, &firmware, imageVersion);
+        if (check != PREFLIGHT_FLASH) {
+            statsEnterPhase(&port, PHASE_OTHER);
+            closePortConnection(&port);
+            freeFirmware(&firmware);
+            int rc = writeSingleReport(statsFileName, &report, &start, (check == PREFLIGHT_CURRENT) ? "CURRENT" : "WRONG SIG");
+            exit(((rc < 0) || (check != PREFLIGHT_CURRENT)) ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+    }
+
+    if (jumpMode != JUMP_NONE) {
+        statsEnterPhase(&port, PHASE_JUMP);
+        int rc = jumpToBootloader(&port, &jumpMode, deviceParams.baudrate);
+        if (rc < 0) {
+            closePortConnection(&port);
             exit(EXIT_FAILURE);
         }
-        sleep(2);
+        inBootloader = rc;
+        gettimeofday(&jumpTime, NULL);
     }
-    deinitModbus(deviceParamsConnection);
 
     float blResponseTimeout = (BL_MINIMAL_RESPONSE_TIMEOUT > responseTimeout) ? BL_MINIMAL_RESPONSE_TIMEOUT : responseTimeout;
 
     if (onlyReadInfo) {
         modbus_t *readInfoConnection;
         if (inBootloader) {
-            struct UartSettings params = (jumpCmdCurrentBaud) ? deviceParams : bootloaderParams;
-            readInfoConnection = initModbus(device, params, modbusID, debug, blResponseTimeout, STOPBITS_FORCE_TWO);
-            if (probeConnection(readInfoConnection) < 0) {
+            struct UartSettings params = (jumpMode == JUMP_CURRENT_BAUD) ? deviceParams : bootloaderParams;
+            readInfoConnection = openPortConnection(&port, params, modbusID, blResponseTimeout, STOPBITS_FORCE_TWO);
+            if (readInfoConnection) {
+                waitDeviceReady(&port, &jumpTime, JUMP_REBOOT_DELAY_SEC);
+            }
+            if ((readInfoConnection == NULL) || (probeDevice(&port) < 0)) {
                 fprintf(stderr, "Failed to connect (%d %s): %s\n", modbusID, device, modbus_strerror(errno));
-                deinitModbus(readInfoConnection);
+                closePortConnection(&port);
                 exit(EXIT_FAILURE);
             }
         } else {  // We do not know actual device's state
-            readInfoConnection = initModbus(device, deviceParams, modbusID, debug, responseTimeout, STOPBITS_FROM_PARAMS);
-            if (probeConnection(readInfoConnection) < 0) {
+            if (jumpMode != JUMP_NONE) {
+                // Can't poll for readiness: we don't know which settings the device will answer on
+                sleepSeconds(JUMP_REBOOT_DELAY_SEC);
+            }
+            readInfoConnection = port.ctx;
+            if (probeDevice(&port) < 0) {
                 printf("Trying to probe (%d %s) at bootloader params...\n", modbusID, device);
-                deinitModbus(readInfoConnection);
-                readInfoConnection = initModbus(device, bootloaderParams, modbusID, debug, blResponseTimeout, STOPBITS_FORCE_TWO);
-                if (probeConnection(readInfoConnection) < 0) {
+                readInfoConnection = openPortConnection(&port, bootloaderParams, modbusID, blResponseTimeout, STOPBITS_FORCE_TWO);
+                if ((readInfoConnection == NULL) || (probeDevice(&port) < 0)) {
                     fprintf(stderr, "Failed to connect (%d %s) at bootloader settings: %s\n", modbusID, device, modbus_strerror(errno));
-                    deinitModbus(readInfoConnection);
+                    closePortConnection(&port);
                     exit(EXIT_FAILURE);
                 }
             }
         }
-        int rc = printDeviceInfo(readInfoConnection);
-        deinitModbus(readInfoConnection);
+        int rc = printDeviceInfo(&port);
+        closePortConnection(&port);
         if (rc < 0) {
             exit(EXIT_FAILURE);
         }
         exit(EXIT_SUCCESS);
     }
 
-    struct UartSettings params = (jumpCmdCurrentBaud) ? deviceParams : bootloaderParams;
-    modbus_t *bootloaderParamsConnection = initModbus(device, params, modbusID, debug, blResponseTimeout, STOPBITS_FORCE_TWO);
-
-    if (uartResetCmd) {
-        printf("Send reset UART settings and modbus address command...\n");
-        if (modbus_write_register(bootloaderParamsConnection, HOLD_REG_CMD_UART_SETTINGS_RESET, 1) == 1) {
-            printf("Ok.\n");
-            inBootloader = 1;
-        } else {
-            printf("Error: %s.\n", modbus_strerror(errno));
-        }
-        sleep(1);    // wait 1 second
-    }
-
-    if (eepromFormatCmd) {
-        printf("Send format EEPROM command...\n");
-        if (modbus_write_register(bootloaderParamsConnection, HOLD_REG_CMD_EEPROM_ERASE, 1) == 1) {
-            printf("Ok.\n");
-            inBootloader = 1;
-        } else {
-            printf("Error: %s.\n", modbus_strerror(errno));
-        }
-        sleep(1);    // wait 1 second
+    struct UartSettings params = (jumpMode == JUMP_CURRENT_BAUD) ? deviceParams : bootloaderParams;
+    statsEnterPhase(&port, PHASE_WAIT);
+    if (autoBaud) {
+        // Try the fastest rates first, device may be in bootloader on any of them
+        detectBootloaderBaudrate(&port, modbusID, params, blResponseTimeout, allowedBaudrates[ARRAY_SIZE(allowedBaudrates) - 1],
+                                 (jumpMode != JUMP_NONE) ? &jumpTime : NULL);
+    } else if (openPortConnection(&port, params, modbusID, blResponseTimeout, STOPBITS_FORCE_TWO) && (jumpMode != JUMP_NONE)) {
+        waitDeviceReady(&port, &jumpTime, JUMP_REBOOT_DELAY_SEC);
     }
-
-    if (flashFsEraseSettingsCmd) {
-        printf("Send FlashFS erase settings command...\n");
-        if (modbus_write_register(bootloaderParamsConnection, HOLD_REG_CMD_FLASHFS_ERASE_SETTINGS, 1) == 1) {
-            printf("Ok.\n");
-            inBootloader = 1;
-        } else {
-            printf("Error: %s.\n", modbus_strerror(errno));
-        }
-        sleep(1);    // wait 1 second
+    if (port.ctx == NULL) {
+        exit(EXIT_FAILURE);
     }
 
-    if (flashFsFullEraseCmd) {
-        printf("Send FlashFS full erase command...\n");
-        if (modbus_write_register(bootloaderParamsConnection, HOLD_REG_CMD_FLASHFS_FULL_ERASE, 1) == 1) {
-            printf("Ok. All device settings, communication settings and calibration data was erased.\n");
+    const int commandKeys[BL_COMMAND_COUNT] = {
+        [BL_COMMAND_UART_RESET] = uartResetCmd,
+        [BL_COMMAND_EEPROM_ERASE] = eepromFormatCmd,
+        [BL_COMMAND_FLASHFS_ERASE_SETTINGS] = flashFsEraseSettingsCmd,
+        [BL_COMMAND_FLASHFS_FULL_ERASE] = flashFsFullEraseCmd
+    };
+    for (int i = 0; i < BL_COMMAND_COUNT; i++) {
+        if (commandKeys[i] && (sendBootloaderCommand(&port, i) == 0)) {
             inBootloader = 1;
-        } else {
-            printf("Error: %s.\n", modbus_strerror(errno));
         }
-        sleep(1);    // wait 1 second
     }
 
     if (fileName == NULL) {
@@ -426,98 +1058,37 @@ int main(int argc, char *argv[])
         } else {
             printf("To flash FW on running device, run\n%s %s\n", argv[0], casualUsageExample);
         }
-        return 0;
-    }
-
-    FILE *file = fopen(fileName, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Error while opening firmware file: %s\n", strerror(errno));
-        deinitModbus(bootloaderParamsConnection);
-        exit(EXIT_FAILURE);
+        closePortConnection(&port);
+        exit(EXIT_SUCCESS);     // not return: --trace reads the port at exit
     }
 
-    fseek(file, 0L, SEEK_END);
-    unsigned int filesize = ftell(file);
-    printf("%s opened successfully, size %d bytes\n", fileName, filesize);
-    rewind(file);
-
-    uint16_t *data = malloc(filesize);
-    if (fread(data, 1, filesize, file) != filesize) {
-        fprintf(stderr, "Error while reading firmware file: %s\n", strerror(errno));
+    // Without a jump the device is checked here, in bootloader only its signature is known
+    if (preflight && (jumpMode == JUMP_NONE)) {
+        enum preflight_result check = preflightCheck(&port, &firmware, imageVersion);
+        if (check != PREFLIGHT_FLASH) {
+            statsEnterPhase(&port, PHASE_OTHER);
+            closePortConnection(&port);
+            freeFirmware(&firmware);
+            int rc = writeSingleReport(statsFileName, &report, &start, (check == PREFLIGHT_CURRENT) ? "CURRENT" : "WRONG SIG");
+            exit(((rc < 0) || (check != PREFLIGHT_CURRENT)) ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
     }
 
-    for (unsigned int i = 0; i < filesize / 2; i++) {
-        data[i] = ((data[i] & 0xFF) << 8) | ((data[i] & 0xFF00) >> 8);
-    }
+    int rc = flashFirmware(&port, &firmware);
+    statsEnterPhase(&port, PHASE_OTHER);
 
-    int errorCount = 0;
-    unsigned int filePointer = 0;
+    closePortConnection(&port);
+    freeFirmware(&firmware);
 
-    printf("\nSending info block...");
-    while (errorCount < MAX_ERROR_COUNT) {
-        if (modbus_write_registers(bootloaderParamsConnection, INFO_BLOCK_REG_ADDRESS, INFO_BLOCK_SIZE / 2, &data[filePointer / 2]) == (INFO_BLOCK_SIZE / 2)) {
-            printf(" OK\n"); fflush(stdout);
-            filePointer += INFO_BLOCK_SIZE;
-            interFrameDelay();
-            break;
-        }
-        printf("\n"); fflush(stdout);
-        fprintf(stderr, "Error while sending info block: %s\n", modbus_strerror(errno));
-        if (errno == EMBXSFAIL) {
-            fprintf(stderr, "Data format is invalid or firmware signature doesn't match the device\n");
-            deinitModbus(bootloaderParamsConnection);
-            exit(EXIT_FAILURE);
-        } else if ((errno == EMBXILADD) ||
-                   (errno == EMBXILVAL))  // some of our fws report illegal data value on nonexistent register
-        {
-            fprintf(stderr, "Not in bootloader mode? Try repeating with -j\n");
-            deinitModbus(bootloaderParamsConnection);
-            exit(EXIT_FAILURE);
-        }
-        fflush(stderr);
-        sleep(3);
-        errorCount++;
-        if (errorCount == MAX_ERROR_COUNT) {
-            fprintf(stderr, "Error while sending info block.\n");
-            fprintf(stderr, "Check connection, jump to bootloader and try again.\n");
-            fflush(stderr);
-            deinitModbus(bootloaderParamsConnection);
-            exit(EXIT_FAILURE);
-        }
+    if (writeSingleReport(statsFileName, &report, &start, (rc < 0) ? "FAILED" : "OK") < 0) {
+        rc = -1;
     }
 
-    printf("\n");
-    while (filePointer < filesize) {
-        fflush(stdout);
-        printf("\rSending data block %u of %u...",
-               (filePointer - INFO_BLOCK_SIZE) / DATA_BLOCK_SIZE + 1,
-               (filesize - INFO_BLOCK_SIZE) / DATA_BLOCK_SIZE); fflush(stdout);
-        if (modbus_write_registers(bootloaderParamsConnection, DATA_BLOCK_REG_ADDRESS, DATA_BLOCK_SIZE / 2, &data[filePointer / 2]) == (DATA_BLOCK_SIZE / 2)) {
-            filePointer += DATA_BLOCK_SIZE;
-            errorCount = 0;
-            interFrameDelay();
-        } else {
-            printf("\n"); fflush(stdout);
-            fprintf(stderr, "Error while sending data block: %s\n", modbus_strerror(errno));
-            fflush(stderr);
-            if (errorCount == MAX_ERROR_COUNT) {
-                filePointer += DATA_BLOCK_SIZE;
-            }
-            if (errorCount >= MAX_ERROR_COUNT * 2) {
-                deinitModbus(bootloaderParamsConnection);
-                exit(EXIT_FAILURE);
-            }
-            errorCount++;
-        }
+    if (rc < 0) {
+        exit(EXIT_FAILURE);
     }
 
-    printf(" OK.\n\nAll done!\n");
-
-    deinitModbus(bootloaderParamsConnection);
-
-    fclose(file);
-    free(data);
-
+    printf("\nAll done!\n");
     exit(EXIT_SUCCESS);
 }
 
@@ -544,189 +1115,1952 @@ int ensureCharIn(char param, const char array[], unsigned int arrayLen) {
     return valueIsIn;
 }
 
-modbus_t *initModbus(char *device, struct UartSettings deviceParams, int slaveAddr, int debug, float responseTimeout, enum stopbits_mode stopbitsMode){
-    if (stopbitsMode == STOPBITS_FORCE_TWO) {
-        deviceParams.stopbits = 2;
-        deviceParams.stopbitsAreForced = 1;
-    }
-#if defined(_WIN32)  // different stopbits for receiving & transmitting are supported only in posix
-    modbus_t *mbConnection = modbus_new_rtu(device, deviceParams.baudrate, deviceParams.parity, deviceParams.databits, deviceParams.stopbits);
-#else
-    int stopbitsReceiving = (deviceParams.stopbitsAreForced == 0) ? 1 : deviceParams.stopbits;
-    modbus_t *mbConnection = modbus_new_rtu_different_stopbits(device, deviceParams.baudrate, deviceParams.parity, deviceParams.databits, deviceParams.stopbits, stopbitsReceiving);
-#endif
-
-    if (mbConnection == NULL) {
-        fprintf(stderr, "Unknown error.\n");
-        exit(EXIT_FAILURE);
-    }
-
-    if (modbus_connect(mbConnection) != 0) {
-        fprintf(stderr, "Connection failed: %s\n", modbus_strerror(errno));
-        modbus_free(mbConnection);
-        exit(EXIT_FAILURE);
-    }
-
-    modbus_set_error_recovery(mbConnection, MODBUS_ERROR_RECOVERY_PROTOCOL);
-
-    if (modbus_set_slave(mbConnection, slaveAddr) != 0) {
-        if (errno == EINVAL) {
-            fprintf(stderr, "Invalid slave id!\nChoose from 0 to 247\n");
-        } else {
-            fprintf(stderr, "Unknown error on setting slave id.\n");
-        }
-        modbus_free(mbConnection);
-        exit(EXIT_FAILURE);
-    };
-
-    struct timeval timeout = parseResponseTimeout(responseTimeout);
-    setResponseTimeout(timeout, mbConnection);
-
-    modbus_flush(mbConnection);
-    modbus_set_debug(mbConnection, debug);
-    return mbConnection;
-}
-
-void deinitModbus(modbus_t *modbusConnection){
-    modbus_close(modbusConnection);
-    modbus_free(modbusConnection);
-}
-
-char *mbReadString(modbus_t *ctx, int startAddr, int len){
-    uint16_t vals[len];
-    int rc = modbus_read_registers(ctx, startAddr, len, vals);
-    if (rc >= 0) {
-        char *buf = malloc(len + 1);
-        for (int i=0; i < rc; i++) {
-            buf[i] = (char)vals[i];
-        }
-        buf[rc] = '\0';
-        return buf;
-    }
-    return NULL;
-}
-
-int probeConnection(modbus_t *ctx){
-    uint16_t firmwareSignature[FW_SIG_LEN];  // reading fw-sig is supported both in firmware and bootloader
-    return modbus_read_registers(ctx, HOLD_REG_FIRMWARE_SIGNATURE, FW_SIG_LEN, firmwareSignature);
-}
-
-int printDeviceInfo(modbus_t *ctx){
+int printDeviceInfo(struct PortConnection *port){
     int rc = 0;
 
-    char *bootloaderVersion = mbReadString(ctx, HOLD_REG_BOOTLOADER_VERSION, BOOTLOADER_VERSION_LEN);
+    const char *bootloaderVersion = readInfoString(port, INFO_BOOTLOADER_VERSION);
     if (bootloaderVersion == NULL){
-        printf("Bootloader version read error: %s\n", modbus_strerror(errno));
+        portLog(port, LOG_LEVEL_INFO, "Bootloader version read error: %s\n", modbus_strerror(errno));
         rc = errno;
     } else {
-        printf("Bootloader version: %s\n", bootloaderVersion);
+        portLog(port, LOG_LEVEL_INFO, "Bootloader version: %s\n", bootloaderVersion);
     }
-    free(bootloaderVersion);
 
-    char *firmwareVersion = mbReadString(ctx, HOLD_REG_FIRMWARE_VERSION, FW_VERSION_LEN);
+    const char *firmwareVersion = readInfoString(port, INFO_FIRMWARE_VERSION);
     if (firmwareVersion == NULL){
-        printf("Firmware version read error: %s; Maybe device is in bootloader?\n", modbus_strerror(errno));
+        portLog(port, LOG_LEVEL_INFO, "Firmware version read error: %s; Maybe device is in bootloader?\n", modbus_strerror(errno));
         // do not set rc: bootloader cannot read fw-version
     } else {
-        printf("Firmware version: %s\n", firmwareVersion);
+        portLog(port, LOG_LEVEL_INFO, "Firmware version: %s\n", firmwareVersion);
     }
-    free(firmwareVersion);
 
-    char *firmwareSignature = mbReadString(ctx, HOLD_REG_FIRMWARE_SIGNATURE, FW_SIG_LEN);
+    const char *firmwareSignature = readInfoString(port, INFO_FIRMWARE_SIGNATURE);
     if (firmwareSignature == NULL){
-        printf("Firmware signature (fw-sig) read error: %s\n", modbus_strerror(errno));
+        portLog(port, LOG_LEVEL_INFO, "Firmware signature (fw-sig) read error: %s\n", modbus_strerror(errno));
         rc = errno;
     } else {
-        printf("Firmware signature (fw-sig): %s\nDownload firmwares: https://fw-releases.wirenboard.com/?prefix=fw/by-signature/%s/\n", firmwareSignature, firmwareSignature);
+        portLog(port, LOG_LEVEL_INFO, "Firmware signature (fw-sig): %s\nDownload firmwares: https://fw-releases.wirenboard.com/?prefix=fw/by-signature/%s/\n", firmwareSignature, firmwareSignature);
     }
-    free(firmwareSignature);
 
     // Try to read component firmware info (only when not in bootloader)
     if (firmwareVersion != NULL) {
-        rc = printComponentFirmwares(ctx);
+        rc = printComponentFirmwares(port);
     }
 
     return rc;
 }
 
-int printComponentFirmwares(modbus_t *ctx){
-    uint8_t componentFlags[COMP_FW_MAX_COUNT] = {0};
-
+int printComponentFirmwares(struct PortConnection *port){
     // Try to read component firmware flags
-    int rc = modbus_read_input_bits(ctx, COMP_FW_FLAGS_REG, COMP_FW_MAX_COUNT, componentFlags);
-    if (rc < 0) {
+    if (readComponentFirmwares(port) < 0) {
         // Silently ignore if component firmware is not supported
         if (errno == EMBXILADD) {
             return 0;  // Component firmware not supported
         }
-        printf("Component firmware flags read error: %s\n", modbus_strerror(errno));
-        return rc;
+        portLog(port, LOG_LEVEL_INFO, "Component firmware flags read error: %s\n", modbus_strerror(errno));
+        return -1;
     }
 
     int foundComponents = 0;
     for (int i = 0; i < COMP_FW_MAX_COUNT; i++) {
-        if (componentFlags[i]) {
+        if (port->info.componentFlags[i]) {
             if (!foundComponents) {
-                printf("\nComponent firmwares:\n");
+                portLog(port, LOG_LEVEL_INFO, "\nComponent firmwares:\n");
                 foundComponents = 1;
             }
 
-            int baseAddr = COMP_FW_BASE_REG + i * COMP_FW_INFO_STRIDE;
+            const struct ComponentInfo *component = &port->info.components[i];
+
+            portLog(port, LOG_LEVEL_INFO, "  Component %d:\n", i + 1);
+            if (component->model) {
+                portLog(port, LOG_LEVEL_INFO, "    Model: %s\n", component->model);
+            } else {
+                portLog(port, LOG_LEVEL_INFO, "    Model: <read error>\n");
+            }
+            if (component->version) {
+                portLog(port, LOG_LEVEL_INFO, "    Version: %s\n", component->version);
+            } else {
+                portLog(port, LOG_LEVEL_INFO, "    Version: <read error>\n");
+            }
+            if (component->signature) {
+                portLog(port, LOG_LEVEL_INFO, "    Signature: %s\n", component->signature);
+                portLog(port, LOG_LEVEL_INFO, "    Download: https://fw-releases.wirenboard.com/?prefix=fw/by-signature/%s/\n", component->signature);
+            } else {
+                portLog(port, LOG_LEVEL_INFO, "    Signature: <read error>\n");
+            }
+        }
+    }
+
+    return 0;
+}
+
+static const struct {
+    int reg;
+    const char *name;           // in --daemon requests
+    const char *request;
+    const char *done;
+} bootloaderCommands[BL_COMMAND_COUNT] = {
+    [BL_COMMAND_UART_RESET] = {HOLD_REG_CMD_UART_SETTINGS_RESET, "uart",
+        "Send reset UART settings and modbus address command...\n", "Ok.\n"},
+    [BL_COMMAND_EEPROM_ERASE] = {HOLD_REG_CMD_EEPROM_ERASE, "eeprom",
+        "Send format EEPROM command...\n", "Ok.\n"},
+    [BL_COMMAND_FLASHFS_ERASE_SETTINGS] = {HOLD_REG_CMD_FLASHFS_ERASE_SETTINGS, "settings",
+        "Send FlashFS erase settings command...\n", "Ok.\n"},
+    [BL_COMMAND_FLASHFS_FULL_ERASE] = {HOLD_REG_CMD_FLASHFS_FULL_ERASE, "all",
+        "Send FlashFS full erase command...\n", "Ok. All device settings, communication settings and calibration data was erased.\n"}
+};
+
+/*
+Sends the command to the bootloader the port is connected to and waits
+until the device is back. Returns 0 if the device accepted it.
+*/
+int sendBootloaderCommand(struct PortConnection *port, enum bootloader_command command) {
+    int rc = 0;
+    portLog(port, LOG_LEVEL_INFO, "%s", bootloaderCommands[command].request);
+    if (writeHoldingRegister(port, bootloaderCommands[command].reg, 1) == 1) {
+        portLog(port, LOG_LEVEL_INFO, "%s", bootloaderCommands[command].done);
+    } else {
+        portLog(port, LOG_LEVEL_INFO, "Error: %s.\n", modbus_strerror(errno));
+        rc = -1;
+    }
+    waitDeviceReady(port, NULL, COMMAND_DELAY_SEC);
+    return rc;
+}
+
+static const char *imageKindNames[IMAGE_KIND_COUNT] = {
+    [IMAGE_MAIN] = "main",
+    [IMAGE_BOOTLOADER] = "bootloader",
+    [IMAGE_COMPONENT] = "component"
+};
+
+/*
+-f takes "[main=|bootloader=|component=]<file>". Without the prefix *.compfw
+files are component firmwares and the rest are main ones: a bootloader update
+looks like any other image. Strips the prefix.
+*/
+enum image_kind parseImageKind(char **fileName) {
+    for (int kind = 0; kind < IMAGE_KIND_COUNT; kind++) {
+        size_t len = strlen(imageKindNames[kind]);
+        if ((strncmp(*fileName, imageKindNames[kind], len) == 0) && ((*fileName)[len] == '=')) {
+            *fileName += len + 1;
+            return kind;
+        }
+    }
+    const char *ext = strrchr(*fileName, '.');
+    return (ext && (strcmp(ext, ".compfw") == 0)) ? IMAGE_COMPONENT : IMAGE_MAIN;
+}
+
+// Loads the image, telling the user what came of it
+int openFirmware(const char *fileName, struct FirmwareImage *firmware) {
+    char error[FIRMWARE_ERROR_MAX];
+    if (loadFirmware(fileName, firmware, error, sizeof(error)) < 0) {
+        fprintf(stderr, "%s\n", error);
+        return -1;
+    }
+    printf("%s opened successfully, size %u bytes\n", fileName, firmware->size);
+    return 0;
+}
+
+int loadImageSet(char *fileNames[], int count, struct SessionImage *images) {
+    int mainCount = 0;
+    for (int i = 0; i < count; i++) {
+        images[i].fileName = fileNames[i];
+        images[i].kind = parseImageKind(&images[i].fileName);
+        mainCount += (images[i].kind == IMAGE_MAIN);
+    }
+    if (mainCount > 1) {
+        printf("Only one main firmware can be flashed at once, mark bootloader updates with bootloader=<file>\n");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (openFirmware(images[i].fileName, &images[i].firmware) < 0) {
+            while (i--) {
+                freeFirmware(&images[i].firmware);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Device was restarted at *since: it's talked to only after it answers again
+static void waitRestart(struct PortConnection *port, int *restarted, const struct timeval *since) {
+    if (*restarted) {
+        waitDeviceReady(port, since, JUMP_REBOOT_DELAY_SEC);
+        *restarted = 0;
+    }
+}
+
+/*
+Flashes the images one after another in the given order. Device is sent
+to bootloader only when the next image is written by bootloader and the
+device runs the firmware, and started from bootloader only when the next
+one is a component firmware and no main firmware was written to start it.
+Restarts are waited for by polling, not with fixed delays.
+The port is open on deviceParams; with jumpMode JUMP_NONE the device is in
+bootloader already, otherwise it runs the firmware.
+Returns -1 on the first image that failed, the rest are not flashed.
+*/
+int flashImageSet(struct PortConnection *port, struct SessionImage *images, int count, int modbusID, enum jump_mode jumpMode,
+                  struct UartSettings deviceParams, struct UartSettings bootloaderParams, float responseTimeout)
+{
+    float blResponseTimeout = (BL_MINIMAL_RESPONSE_TIMEOUT > responseTimeout) ? BL_MINIMAL_RESPONSE_TIMEOUT : responseTimeout;
+    int inFirmware = (jumpMode != JUMP_NONE);
+    int restarted = 0;
+    struct timeval restartTime;
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    if (jumpMode == JUMP_NONE) {
+        jumpMode = JUMP_STANDARD_BAUD;  // if the device has to go back to bootloader later
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct SessionImage *image = &images[i];
+        portLog(port, LOG_LEVEL_INFO, "\n[%d/%d] Flashing %s image %s\n", i + 1, count, imageKindNames[image->kind], image->fileName);
+
+        struct UartSettings blParams = (jumpMode == JUMP_CURRENT_BAUD) ? deviceParams : bootloaderParams;
+        if (image->kind == IMAGE_COMPONENT) {
+            if (!inFirmware) {
+                if (openPortConnection(port, blParams, modbusID, blResponseTimeout, STOPBITS_FORCE_TWO) == NULL) {
+                    return -1;
+                }
+                waitRestart(port, &restarted, &restartTime);
+                if (jumpToFirmware(port) < 0) {
+                    return -1;
+                }
+                gettimeofday(&restartTime, NULL);
+                restarted = 1;
+                inFirmware = 1;
+            }
+            // Running firmware writes components, it's talked to at its own settings
+            if (openPortConnection(port, deviceParams, modbusID, blResponseTimeout, STOPBITS_FROM_PARAMS) == NULL) {
+                return -1;
+            }
+            waitRestart(port, &restarted, &restartTime);
+        } else {
+            if (inFirmware) {
+                if (openPortConnection(port, deviceParams, modbusID, responseTimeout, STOPBITS_FROM_PARAMS) == NULL) {
+                    return -1;
+                }
+                waitRestart(port, &restarted, &restartTime);
+                if (jumpToBootloader(port, &jumpMode, deviceParams.baudrate) < 0) {
+                    return -1;
+                }
+                gettimeofday(&restartTime, NULL);
+                restarted = 1;
+                inFirmware = 0;
+                blParams = (jumpMode == JUMP_CURRENT_BAUD) ? deviceParams : bootloaderParams;
+            }
+            if (port->autoBaud) {
+                detectBootloaderBaudrate(port, modbusID, blParams, blResponseTimeout, allowedBaudrates[ARRAY_SIZE(allowedBaudrates) - 1],
+                                         restarted ? &restartTime : NULL);
+                restarted = 0;
+                if (port->ctx == NULL) {
+                    return -1;
+                }
+            } else if (openPortConnection(port, blParams, modbusID, blResponseTimeout, STOPBITS_FORCE_TWO) == NULL) {
+                return -1;
+            }
+            waitRestart(port, &restarted, &restartTime);
+        }
+
+        if (flashFirmware(port, &image->firmware) < 0) {
+            return -1;
+        }
+        if (image->kind != IMAGE_COMPONENT) {
+            // Bootloader starts the new firmware or restarts into the new bootloader by itself
+            gettimeofday(&restartTime, NULL);
+            restarted = 1;
+            inFirmware = (image->kind == IMAGE_MAIN);
+        }
+    }
+
+    portLog(port, LOG_LEVEL_INFO, "\n%d images flashed in %.1f s\n", count, secondsSince(&start));
+    return 0;
+}
+
+// Keeps the --resume checkpoint in step with the bootloader session
+static void saveProgress(struct PortConnection *port, int acked, unsigned int blockCount) {
+    struct PortOutput *output = port->user;
+    struct Checkpoint *checkpoint = output->checkpoint;
+    if (checkpoint == NULL) {
+        return;
+    }
+    if ((acked < 0) || ((unsigned int)acked == blockCount)) {
+        // Session is void or firmware is written, nothing to resume
+        removeCheckpoint(checkpoint);
+        if (acked >= 0) {
+            output->checkpoint = NULL;
+        }
+        return;
+    }
+    checkpoint->baudrate = port->params.baudrate;
+    checkpoint->parity = port->params.parity;
+    checkpoint->acked = acked;
+    checkpoint->blockSize = port->blockSize;
+    if (saveCheckpoint(checkpoint) < 0) {
+        portLog(port, LOG_LEVEL_ERROR, "Can't save progress to %s: %s, flashing can't be resumed\n", checkpoint->fileName, strerror(errno));
+        output->checkpoint = NULL;
+    }
+}
+
+static pthread_mutex_t outputMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+Prints a message on behalf of a port. Without logPrefix this is plain
+printf with flush. With logPrefix (several ports at once) output is
+collected into whole lines, each line is printed with the prefix, and
+progress lines overwritten with '\r' are dropped, so messages of
+parallel workers don't interleave.
+*/
+static void printPortLog(struct PortConnection *port, enum log_level level, const char *message) {
+    struct PortOutput *output = port->user;
+    FILE *stream = (level == LOG_LEVEL_ERROR) ? stderr : stdout;
+    if (output->client) {
+        fputs(message, output->client);
+        fflush(output->client);
+    }
+    if (output->logPrefix == NULL) {
+        fputs(message, stream);
+        fflush(stream);
+        return;
+    }
+
+    pthread_mutex_lock(&outputMutex);
+    for (const char *c = message; *c; c++) {
+        if (*c == '\r') {
+            output->logLineLen = 0;
+        } else if (*c == '\n') {
+            if (output->logLineLen) {
+                fprintf(stream, "[%s] %.*s\n", output->logPrefix, (int)output->logLineLen, output->logLine);
+                fflush(stream);
+            }
+            output->logLineLen = 0;
+        } else if (output->logLineLen < sizeof(output->logLine) - 1) {
+            output->logLine[output->logLineLen++] = *c;
+        }
+    }
+    pthread_mutex_unlock(&outputMutex);
+}
+
+/*
+--trace file, -1 without it. Slots of tracedPorts[] are changed under
+outputMutex and read atomically without it by saveAllFrameTraces(); a port
+is dropped before its memory goes away.
+*/
+static int traceFd = -1;
+static struct PortConnection *tracedPorts[TRACED_PORTS_MAX];
+
+int openTraceFile(const char *fileName) {
+    traceFd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return (traceFd < 0) ? -1 : 0;
+}
+
+// Appends the port's last frames unless nothing was recorded since the last time
+static void writeTrace(struct PortConnection *port) {
+    struct PortOutput *output = port->user;
+    unsigned int recorded = __atomic_load_n(&port->trace.recorded, __ATOMIC_ACQUIRE);
+    if (recorded == output->traceSaved) {
+        return;
+    }
+    output->traceSaved = recorded;
+    writeFrameTrace(port, traceFd);
+}
+
+// Adds the port to those --trace writes at exit
+void traceFrames(struct PortConnection *port) {
+    if (traceFd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&outputMutex);
+    for (int i = 0; i < TRACED_PORTS_MAX; i++) {
+        if (tracedPorts[i] == NULL) {
+            __atomic_store_n(&tracedPorts[i], port, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&outputMutex);
+}
+
+// Writes the port's last frames to --trace file; with forget the port is dropped, its memory is going away
+void saveFrameTrace(struct PortConnection *port, int forget) {
+    if (traceFd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&outputMutex);
+    for (int i = 0; i < TRACED_PORTS_MAX; i++) {
+        if (tracedPorts[i] == port) {
+            writeTrace(port);
+            if (forget) {
+                __atomic_store_n(&tracedPorts[i], NULL, __ATOMIC_RELEASE);
+            }
+        }
+    }
+    pthread_mutex_unlock(&outputMutex);
+}
+
+/*
+At exit and on a fatal signal, so without the lock: the signal may come while
+it's held. Only async-signal-safe calls, worker threads may still be recording.
+*/
+void saveAllFrameTraces(void) {
+    for (int i = 0; i < TRACED_PORTS_MAX; i++) {
+        struct PortConnection *port = __atomic_load_n(&tracedPorts[i], __ATOMIC_ACQUIRE);
+        if (port) {
+            writeTrace(port);
+        }
+    }
+}
+
+// Session whose output, stats and checkpoint go through the port's PortOutput
+void initCliPort(struct PortConnection *port, struct PortOutput *output, char *device) {
+    initPortConnection(port, device);
+    memset(output, 0, sizeof(*output));
+    port->user = output;
+    port->callbacks.log = printPortLog;
+    port->callbacks.phase = statsEnterPhase;
+    port->callbacks.block = statsAddBlock;
+    port->callbacks.progress = saveProgress;
+}
+
+static int parseManifestOption(const char *option, struct ManifestEntry *entry) {
+    int value;
+    char parity;
+
+    if (strcmp(option, "jump=j") == 0) {
+        entry->jumpMode = entry->autoBaud ? JUMP_FASTEST : JUMP_STANDARD_BAUD;
+    } else if (strcmp(option, "jump=J") == 0) {
+        entry->jumpMode = JUMP_CURRENT_BAUD;
+    } else if (strcmp(option, "jump=none") == 0) {
+        entry->jumpMode = JUMP_NONE;
+    } else if (strcmp(option, "auto-baud") == 0) {
+        entry->autoBaud = 1;
+        if (entry->jumpMode == JUMP_STANDARD_BAUD) {
+            entry->jumpMode = JUMP_FASTEST;
+        }
+    } else if (sscanf(option, "baud=%d", &value) == 1) {
+        if (!ensureIntIn(value, allowedBaudrates, ARRAY_SIZE(allowedBaudrates))) {
+            return -1;
+        }
+        entry->deviceParams.baudrate = value;
+    } else if (sscanf(option, "bl-baud=%d", &value) == 1) {
+        if (!ensureIntIn(value, allowedBaudrates, ARRAY_SIZE(allowedBaudrates))) {
+            return -1;
+        }
+        entry->bootloaderParams.baudrate = value;
+    } else if (sscanf(option, "parity=%c", &parity) == 1) {
+        if (!ensureCharIn(parity, allowedParity, ARRAY_SIZE(allowedParity))) {
+            return -1;
+        }
+        entry->deviceParams.parity = parity;
+    } else if (strncmp(option, "port=", 5) == 0) {
+        if (option[5] == '\0') {
+            return -1;
+        }
+        entry->device = (char *)option + 5;
+    } else if (strncmp(option, "version=", 8) == 0) {
+        if ((option[8] == '\0') || (strlen(option + 8) >= FIRMWARE_VERSION_MAX)) {
+            return -1;
+        }
+        entry->imageVersion = (char *)option + 8;
+    } else if (sscanf(option, "stopbits=%d", &value) == 1) {
+        if (!ensureIntIn(value, allowedStopBits, ARRAY_SIZE(allowedStopBits))) {
+            return -1;
+        }
+        entry->deviceParams.stopbits = value;
+        entry->deviceParams.stopbitsAreForced = 1;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+Manifest is a text file, one device per line:
+    <modbus_addr> <firmware.wbfw> [jump=j|J|none] [baud=N] [parity=N|E|O] [stopbits=N] [bl-baud=N] [port=<port>] [auto-baud] [version=<version>]
+Empty lines and everything after '#' are ignored.
+Returns number of entries or -1 on error. All firmware files are loaded here,
+so broken manifest is reported before any bus activity.
+*/
+int parseManifest(const char *fileName, const struct ManifestEntry *defaults, struct ManifestEntry **entries) {
+    FILE *file = fopen(fileName, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error while opening manifest %s: %s\n", fileName, strerror(errno));
+        return -1;
+    }
+
+    struct ManifestEntry *list = NULL;
+    int count = 0;
+    int lineNumber = 0;
+    int rc = 0;
+    char line[MANIFEST_LINE_MAX];
+
+    while ((rc == 0) && fgets(line, sizeof(line), file)) {
+        lineNumber++;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+
+        char *token = strtok(line, " \t\r\n");
+        if (token == NULL) {
+            continue;
+        }
+
+        struct ManifestEntry entry = *defaults;
+        entry.line = lineNumber;
+
+        char *end;
+        long addr = strtol(token, &end, 0);
+        if ((*end != '\0') || (addr < 0) || (addr > 247)) {
+            fprintf(stderr, "%s:%d: invalid modbus address \"%s\"\n", fileName, lineNumber, token);
+            rc = -1;
+            break;
+        }
+        entry.modbusID = (int)addr;
+
+        token = strtok(NULL, " \t\r\n");
+        if (token == NULL) {
+            fprintf(stderr, "%s:%d: firmware file is missing\n", fileName, lineNumber);
+            rc = -1;
+            break;
+        }
+        entry.fileName = token;
+
+        while ((token = strtok(NULL, " \t\r\n")) != NULL) {
+            if (parseManifestOption(token, &entry) < 0) {
+                fprintf(stderr, "%s:%d: invalid option \"%s\"\n", fileName, lineNumber, token);
+                rc = -1;
+                break;
+            }
+        }
+        if (rc < 0) {
+            break;
+        }
+
+        // Each firmware file is read once and shared between entries
+        entry.firmware = NULL;
+        for (int i = 0; i < count; i++) {
+            if (strcmp(list[i].fileName, entry.fileName) == 0) {
+                entry.firmware = list[i].firmware;
+                break;
+            }
+        }
+        entry.fileName = duplicateString(entry.fileName);
+        entry.device = normalizePortName(entry.device);
+        entry.imageVersion = entry.imageVersion ? duplicateString(entry.imageVersion) : NULL;
+        if (entry.firmware == NULL) {
+            entry.firmware = calloc(1, sizeof(struct FirmwareImage));
+            if (openFirmware(entry.fileName, entry.firmware) < 0) {
+                free(entry.firmware);
+                free(entry.fileName);
+                free(entry.device);
+                free(entry.imageVersion);
+                rc = -1;
+                break;
+            }
+        }
+
+        list = realloc(list, (count + 1) * sizeof(struct ManifestEntry));
+        list[count++] = entry;
+    }
+    fclose(file);
+
+    if (rc < 0) {
+        freeManifest(list, count);
+        return -1;
+    }
+    if (count == 0) {
+        fprintf(stderr, "Manifest %s has no devices\n", fileName);
+        free(list);
+        return -1;
+    }
+
+    *entries = list;
+    return count;
+}
+
+void freeManifest(struct ManifestEntry *entries, int count) {
+    for (int i = 0; i < count; i++) {
+        // Firmware images are shared: free each one at its first user
+        int firstUser = 1;
+        for (int j = 0; j < i; j++) {
+            if (entries[j].firmware == entries[i].firmware) {
+                firstUser = 0;
+                break;
+            }
+        }
+        if (firstUser) {
+            freeFirmware(entries[i].firmware);
+            free(entries[i].firmware);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        free(entries[i].fileName);
+        free(entries[i].device);
+        free(entries[i].imageVersion);
+        freeStats(&entries[i].stats);
+    }
+    free(entries);
+}
+
+/*
+Same device and firmware on each of the ports, from command line keys.
+*/
+int buildPortEntries(char *devices[], int deviceCount, const char *fileName, const struct ManifestEntry *defaults, struct ManifestEntry **entries) {
+    struct FirmwareImage *firmware = calloc(1, sizeof(struct FirmwareImage));
+    if (openFirmware(fileName, firmware) < 0) {
+        free(firmware);
+        return -1;
+    }
+
+    struct ManifestEntry *list = calloc(deviceCount, sizeof(struct ManifestEntry));
+    for (int i = 0; i < deviceCount; i++) {
+        list[i] = *defaults;
+        list[i].device = normalizePortName(devices[i]);
+        list[i].fileName = duplicateString(fileName);
+        list[i].imageVersion = defaults->imageVersion ? duplicateString(defaults->imageVersion) : NULL;
+        list[i].firmware = firmware;
+    }
+    *entries = list;
+    return deviceCount;
+}
+
+/*
+Addresses for --broadcast: comma-separated numbers and ranges, e.g. 10,11,20-25.
+Returns their count, or -1 after printing what's wrong.
+*/
+int parseAddressList(const char *list, int *addrs, int maxCount) {
+    int count = 0;
+    const char *p = list;
+    while (*p) {
+        int first, last, len;
+        if (sscanf(p, "%d-%d%n", &first, &last, &len) == 2) {
+            p += len;
+        } else if (sscanf(p, "%d%n", &first, &len) == 1) {
+            last = first;
+            p += len;
+        } else {
+            break;
+        }
+        if ((first < 1) || (last > SCAN_LAST_ADDRESS) || (first > last)) {
+            printf("Address range %d-%d in --broadcast should be within 1..%d!\n", first, last, SCAN_LAST_ADDRESS);
+            return -1;
+        }
+        for (int addr = first; addr <= last; addr++) {
+            for (int i = 0; i < count; i++) {
+                if (addrs[i] == addr) {
+                    printf("Address %d is listed twice in --broadcast!\n", addr);
+                    return -1;
+                }
+            }
+            if (count == maxCount) {
+                printf("Too many addresses in --broadcast, at most %d are supported!\n", maxCount);
+                return -1;
+            }
+            addrs[count++] = addr;
+        }
+        if (*p == ',') {
+            p++;
+        } else {
+            break;
+        }
+    }
+    if ((*p != '\0') || (count == 0)) {
+        printf("Can't parse --broadcast list \"%s\", expected e.g. 10,11,20-25\n", list);
+        return -1;
+    }
+    return count;
+}
+
+/*
+One firmware for a group of devices on the same port, from command line keys.
+*/
+int buildGroupEntries(const int *addrs, int count, const char *fileName, const struct ManifestEntry *defaults, struct ManifestEntry **entries) {
+    struct FirmwareImage *firmware = calloc(1, sizeof(struct FirmwareImage));
+    if (openFirmware(fileName, firmware) < 0) {
+        free(firmware);
+        return -1;
+    }
+
+    struct ManifestEntry *list = calloc(count, sizeof(struct ManifestEntry));
+    for (int i = 0; i < count; i++) {
+        list[i] = *defaults;
+        list[i].device = duplicateString(defaults->device);
+        list[i].modbusID = addrs[i];
+        list[i].fileName = duplicateString(fileName);
+        list[i].imageVersion = defaults->imageVersion ? duplicateString(defaults->imageVersion) : NULL;
+        list[i].firmware = firmware;
+    }
+    *entries = list;
+    return count;
+}
 
-            char *model = mbReadString(ctx, baseAddr + COMP_FW_MODEL_OFFSET, COMP_FW_MODEL_LEN);
-            char *signature = mbReadString(ctx, baseAddr + COMP_FW_SIGNATURE_OFFSET, COMP_FW_SIGNATURE_LEN);
-            char *version = mbReadString(ctx, baseAddr + COMP_FW_VERSION_OFFSET, COMP_FW_VERSION_LEN);
+struct PortWorker {
+    struct PortConnection port;
+    struct PortOutput output;
+    struct ManifestEntry **queue;   // entries of this port in manifest order
+    int count;
+    const struct BatchOptions *options;
+    int failed;
+    pthread_t thread;
+};
 
-            printf("  Component %d:\n", i + 1);
-            if (model) {
-                printf("    Model: %s\n", model);
+static struct UartSettings flashingParams(const struct ManifestEntry *entry) {
+    return (entry->jumpMode == JUMP_CURRENT_BAUD) ? entry->deviceParams : entry->bootloaderParams;
+}
+
+/*
+Rough time to transfer the entry's firmware: write multiple registers request
+and reply for every block, 11 bits per character, plus block processing.
+*/
+static double estimateFlashTime(const struct ManifestEntry *entry) {
+    unsigned int blocks = entry->firmware->dataBlockCount + 1;
+    double frameBytes = (9 + DATA_BLOCK_SIZE) + 8;
+    int baudrate = flashingParams(entry).baudrate;
+    if ((entry->jumpMode == JUMP_FASTEST) && (entry->bootloaderParams.baudrate < baudrate)) {
+        baudrate = entry->bootloaderParams.baudrate;    // not known yet, expect the slower one
+    }
+    return blocks * (frameBytes * 11 / baudrate + BL_BLOCK_PROCESSING_SEC);
+}
+
+static const char *entryImageVersion(const struct ManifestEntry *entry) {
+    return entry->imageVersion ? entry->imageVersion : entry->firmware->version;
+}
+
+// Records a failed check in the entry status, so the device is neither jumped nor flashed
+static int checkEntry(struct PortWorker *worker, struct ManifestEntry *entry) {
+    if (!worker->options->preflight || (entry->firmware == NULL)) {
+        return 0;     // nothing to check against for commands
+    }
+    enum preflight_result check = preflightCheck(&worker->port, entry->firmware, entryImageVersion(entry));
+    if (check == PREFLIGHT_CURRENT) {
+        entry->status = "CURRENT";
+    } else if (check == PREFLIGHT_WRONG_SIGNATURE) {
+        entry->status = "WRONG SIG";
+    }
+    return (check == PREFLIGHT_FLASH) ? 0 : -1;
+}
+
+static int sendEntryJump(struct PortWorker *worker, struct ManifestEntry *entry) {
+    struct PortConnection *port = &worker->port;
+    struct FlashStats *currentStats = worker->output.stats;
+    FILE *currentClient = worker->output.client;
+    int rc = 0;
+
+    // Charge the jump to the jumped device even if it's done ahead
+    statsEnterPhase(port, PHASE_OTHER);
+    if (worker->options->collectStats) {
+        worker->output.stats = &entry->stats;
+    }
+    worker->output.client = entry->client;
+    entry->jumpSent = 1;
+    statsEnterPhase(port, PHASE_PORT_SETUP);
+    if (openPortConnection(port, entry->deviceParams, entry->modbusID, worker->options->responseTimeout, STOPBITS_FROM_PARAMS) == NULL) {
+        rc = -1;
+    } else if (checkEntry(worker, entry) < 0) {
+        rc = -1;
+    } else {
+        statsEnterPhase(port, PHASE_JUMP);
+        rc = (jumpToBootloader(port, &entry->jumpMode, entry->deviceParams.baudrate) < 0) ? -1 : 0;
+    }
+    if (rc < 0) {
+        if (entry->status == NULL) {
+            entry->status = "JUMP FAILED";
+        }
+    } else {
+        gettimeofday(&entry->jumpTime, NULL);
+    }
+    statsEnterPhase(port, PHASE_OTHER);
+    worker->output.stats = currentStats;
+    worker->output.client = currentClient;
+    return rc;
+}
+
+/*
+Sends the jump command to the current entry and up to jumpAhead next ones,
+so they reboot while the current one is flashed. A device is jumped ahead
+only if it is expected to be reached well within the bootloader window,
+and only if the same address isn't flashed before it (e.g. the same device
+listed twice).
+*/
+static void scheduleJumps(struct PortWorker *worker, int current) {
+    struct ManifestEntry **queue = worker->queue;
+    double startsIn = 0;
+
+    for (int i = current; (i < worker->count) && (i <= current + worker->options->jumpAhead); i++) {
+        struct ManifestEntry *entry = queue[i];
+        if (i > current) {
+            int sameAddressBefore = 0;
+            for (int j = current; j < i; j++) {
+                if (queue[j]->modbusID == entry->modbusID) {
+                    sameAddressBefore = 1;
+                }
+            }
+            if (sameAddressBefore || (startsIn > BOOTLOADER_JUMP_WINDOW_SEC - JUMP_AHEAD_MARGIN_SEC)) {
+                break;
+            }
+        }
+        if ((entry->jumpMode != JUMP_NONE) && !entry->jumpSent) {
+            if (i > current) {
+                portLog(&worker->port, LOG_LEVEL_INFO, "Jump device %d to bootloader ahead\n", entry->modbusID);
+            }
+            sendEntryJump(worker, entry);
+        }
+        startsIn += estimateFlashTime(entry);
+    }
+}
+
+static void initPortWorker(struct PortWorker *worker, char *device, const struct BatchOptions *options) {
+    memset(worker, 0, sizeof(*worker));
+    initCliPort(&worker->port, &worker->output, device);
+    worker->port.debug = options->debug;
+    worker->port.readyTimeout = options->readyTimeout;
+    worker->port.window = options->window;
+    worker->port.retries = options->retries;
+    worker->port.retryBackoffSec = options->retryBackoffSec;
+    worker->port.lowLatency = options->lowLatency;
+    worker->port.lockTimeoutSec = options->lockTimeoutSec;
+    worker->options = options;
+}
+
+// Opens the port on the entry's bootloader settings, after a jump waits for the device to come up
+static int connectBootloader(struct PortWorker *worker, struct ManifestEntry *entry) {
+    struct PortConnection *port = &worker->port;
+    float responseTimeout = worker->options->responseTimeout;
+    float blResponseTimeout = (BL_MINIMAL_RESPONSE_TIMEOUT > responseTimeout) ? BL_MINIMAL_RESPONSE_TIMEOUT : responseTimeout;
+
+    statsEnterPhase(port, PHASE_WAIT);
+    port->autoBaud = entry->autoBaud;
+    port->minBaudrate = (entry->deviceParams.baudrate < entry->bootloaderParams.baudrate) ? entry->deviceParams.baudrate : entry->bootloaderParams.baudrate;
+    if (entry->autoBaud) {
+        detectBootloaderBaudrate(port, entry->modbusID, flashingParams(entry), blResponseTimeout,
+                                 allowedBaudrates[ARRAY_SIZE(allowedBaudrates) - 1], entry->jumpSent ? &entry->jumpTime : NULL);
+    } else if (openPortConnection(port, flashingParams(entry), entry->modbusID, blResponseTimeout, STOPBITS_FORCE_TWO) && entry->jumpSent) {
+        waitDeviceReady(port, &entry->jumpTime, JUMP_REBOOT_DELAY_SEC);
+    }
+    return (port->ctx == NULL) ? -1 : 0;
+}
+
+/*
+Flashes queued entries one by one keeping the port open.
+Never exits the process: every failure is recorded in the entry status.
+*/
+static void flashQueue(struct PortWorker *worker) {
+    struct PortConnection *port = &worker->port;
+
+    for (int i = 0; i < worker->count; i++) {
+        struct ManifestEntry *entry = worker->queue[i];
+        struct timeval start;
+        gettimeofday(&start, NULL);
+
+        worker->output.client = entry->client;
+        portLog(port, LOG_LEVEL_INFO, "\n[%d/%d] Flashing device %d with %s\n", i + 1, worker->count, entry->modbusID, entry->fileName);
+
+        worker->output.stats = worker->options->collectStats ? &entry->stats : NULL;
+        scheduleJumps(worker, i);
+
+        if (entry->status == NULL) {
+            if (connectBootloader(worker, entry) < 0) {
+                entry->status = "FAILED";
+            } else if (entry->jumpSent || (checkEntry(worker, entry) == 0)) {
+                // Without a jump the device is checked here, in bootloader only its signature is known
+                if (flashFirmware(port, entry->firmware) < 0) {
+                    entry->status = "FAILED";
+                }
+            }
+        }
+
+        if (entry->status == NULL) {
+            entry->status = "OK";
+        } else if (strcmp(entry->status, "CURRENT") != 0) {
+            worker->failed++;
+            saveFrameTrace(port, 0);
+        }
+        statsEnterPhase(port, PHASE_OTHER);
+        worker->output.stats = NULL;
+        worker->output.client = NULL;
+        entry->elapsedSec = secondsSince(&start);
+    }
+}
+
+// After a broadcast transfer the device should have checked the image and started it
+static int runsNewFirmware(struct PortWorker *worker, struct ManifestEntry *entry, const struct timeval *since) {
+    struct PortConnection *port = &worker->port;
+    if ((openPortConnection(port, entry->deviceParams, entry->modbusID, worker->options->responseTimeout, STOPBITS_FROM_PARAMS) == NULL) ||
+        (waitDeviceReady(port, since, JUMP_REBOOT_DELAY_SEC) < 0)) {
+        return 0;
+    }
+    clearDeviceInfo(&port->info);
+    const char *version = readInfoString(port, INFO_FIRMWARE_VERSION);     // bootloader has no such register
+    return (version != NULL) && (strcmp(version, entryImageVersion(entry)) == 0);
+}
+
+/*
+Flashes queued entries, one image for all of them, at once: jumps every
+device to bootloader, streams the image on the broadcast address, then asks
+each device by its own address whether it runs the new firmware and flashes
+the ones that don't one by one. Devices must share line settings, which they
+do being on one bus and flashed with the same keys. Without the image's
+version a device that missed a block and went back to its old firmware
+would pass the check, so such an image is flashed one device at a time.
+*/
+static void broadcastQueue(struct PortWorker *worker) {
+    struct PortConnection *port = &worker->port;
+    if (entryImageVersion(worker->queue[0])[0] == '\0') {
+        portLog(port, LOG_LEVEL_ERROR, "Version of %s is unknown, devices can't be checked after broadcast: flashing them one by one (see --image-version)\n",
+                worker->queue[0]->fileName);
+        flashQueue(worker);
+        return;
+    }
+    int *group = malloc(worker->count * sizeof(int));
+    int groupCount = 0;
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
+    for (int i = 0; i < worker->count; i++) {
+        struct ManifestEntry *entry = worker->queue[i];
+        if (entry->jumpMode != JUMP_NONE) {
+            portLog(port, LOG_LEVEL_INFO, "\n[%d/%d] Jump device %d to bootloader\n", i + 1, worker->count, entry->modbusID);
+            sendEntryJump(worker, entry);
+        }
+    }
+    for (int i = 0; i < worker->count; i++) {
+        struct ManifestEntry *entry = worker->queue[i];
+        // Without a jump the device is checked here, in bootloader only its signature is known
+        if ((entry->status == NULL) && (connectBootloader(worker, entry) == 0) && (entry->jumpSent || (checkEntry(worker, entry) == 0))) {
+            group[groupCount++] = entry->modbusID;
+        }
+    }
+
+    struct timeval broadcastEnd;
+    if (groupCount) {
+        struct ManifestEntry *first = worker->queue[0];
+        float responseTimeout = worker->options->responseTimeout;
+        float blResponseTimeout = (BL_MINIMAL_RESPONSE_TIMEOUT > responseTimeout) ? BL_MINIMAL_RESPONSE_TIMEOUT : responseTimeout;
+        portLog(port, LOG_LEVEL_INFO, "\nFlashing %d devices at once with %s\n", groupCount, first->fileName);
+        if (openPortConnection(port, flashingParams(first), MODBUS_BROADCAST_ADDRESS, blResponseTimeout, STOPBITS_FORCE_TWO)) {
+            broadcastFirmware(port, first->firmware, group, groupCount);
+        }
+        statsEnterPhase(port, PHASE_OTHER);
+    }
+    gettimeofday(&broadcastEnd, NULL);
+    free(group);
+
+    for (int i = 0; i < worker->count; i++) {
+        struct ManifestEntry *entry = worker->queue[i];
+        if (entry->status == NULL) {
+            portLog(port, LOG_LEVEL_INFO, "\n[%d/%d] Checking device %d\n", i + 1, worker->count, entry->modbusID);
+            if (runsNewFirmware(worker, entry, &broadcastEnd)) {
+                portLog(port, LOG_LEVEL_INFO, "Device %d runs the new firmware\n", entry->modbusID);
+                entry->status = "OK";
             } else {
-                printf("    Model: <read error>\n");
+                portLog(port, LOG_LEVEL_INFO, "Device %d didn't start the new firmware, flashing it alone\n", entry->modbusID);
+                entry->jumpSent = 0;    // it's in bootloader already, or won't answer there either
+                if ((connectBootloader(worker, entry) < 0) || (flashFirmware(port, entry->firmware) < 0)) {
+                    entry->status = "FAILED";
+                } else {
+                    entry->status = "OK";
+                }
+                statsEnterPhase(port, PHASE_OTHER);
+            }
+        }
+        if ((strcmp(entry->status, "OK") != 0) && (strcmp(entry->status, "CURRENT") != 0)) {
+            worker->failed++;
+            saveFrameTrace(port, 0);
+        }
+        entry->elapsedSec = secondsSince(&start);
+    }
+}
+
+// The port is traced only while it runs: a worker that never starts leaves nothing for the exit handler
+static void *runPortWorker(void *arg) {
+    struct PortWorker *worker = arg;
+    traceFrames(&worker->port);
+    if (worker->options->broadcast) {
+        broadcastQueue(worker);
+    } else {
+        flashQueue(worker);
+    }
+    closePortConnection(&worker->port);
+    saveFrameTrace(&worker->port, 1);
+    return NULL;
+}
+
+/*
+Flashes all entries. Every port is served by its own thread, entries of
+one port go one after another in manifest order.
+Returns number of failed entries.
+*/
+int runManifest(struct ManifestEntry *entries, int count, const struct BatchOptions *options) {
+    struct PortWorker workers[MAX_PORTS];
+    int workerCount = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct PortWorker *worker = NULL;
+        for (int w = 0; w < workerCount; w++) {
+            if (strcmp(workers[w].port.device, entries[i].device) == 0) {
+                worker = &workers[w];
+                break;
+            }
+        }
+        if (worker == NULL) {
+            if (workerCount == MAX_PORTS) {
+                fprintf(stderr, "Too many ports, at most %d are supported!\n", MAX_PORTS);
+                for (int w = 0; w < workerCount; w++) {
+                    free(workers[w].queue);
+                }
+                return count;
+            }
+            worker = &workers[workerCount++];
+            initPortWorker(worker, entries[i].device, options);
+            worker->queue = malloc(count * sizeof(struct ManifestEntry *));
+        }
+        worker->queue[worker->count++] = &entries[i];
+    }
+
+    struct timeval batchStart;
+    gettimeofday(&batchStart, NULL);
+
+    if (workerCount == 1) {
+        runPortWorker(&workers[0]);
+    } else {
+        for (int w = 0; w < workerCount; w++) {
+            workers[w].output.logPrefix = workers[w].port.device;
+            if (pthread_create(&workers[w].thread, NULL, runPortWorker, &workers[w]) != 0) {
+                fprintf(stderr, "Can't start worker for %s\n", workers[w].port.device);
+                workerCount = w;
+                break;
             }
-            if (version) {
-                printf("    Version: %s\n", version);
+        }
+        for (int w = 0; w < workerCount; w++) {
+            pthread_join(workers[w].thread, NULL);
+        }
+    }
+    for (int w = 0; w < workerCount; w++) {
+        free(workers[w].queue);
+    }
+
+    int failed = 0;
+    int current = 0;
+    for (int i = 0; i < count; i++) {
+        if (entries[i].status == NULL) {
+            entries[i].status = "NOT STARTED";
+        }
+        if (strcmp(entries[i].status, "CURRENT") == 0) {
+            current++;
+        } else if (strcmp(entries[i].status, "OK") != 0) {
+            failed++;
+        }
+    }
+
+    if (workerCount == 1) {
+        printf("\nSummary for %s:\n\n", entries[0].device);
+        printf("  #  Addr  Result       Time, s  Firmware\n");
+        for (int i = 0; i < count; i++) {
+            printf("%3d  %4d  %-11s  %7.1f  %s\n", i + 1, entries[i].modbusID, entries[i].status, entries[i].elapsedSec, entries[i].fileName);
+        }
+    } else {
+        printf("\nSummary:\n\n");
+        printf("  #  Port                  Addr  Result       Time, s  Firmware\n");
+        for (int i = 0; i < count; i++) {
+            printf("%3d  %-20s  %4d  %-11s  %7.1f  %s\n", i + 1, entries[i].device, entries[i].modbusID, entries[i].status, entries[i].elapsedSec, entries[i].fileName);
+        }
+    }
+    if (current) {
+        printf("\n%d of %d devices flashed successfully, %d already current, in %.1f s\n", count - failed - current, count, current, secondsSince(&batchStart));
+    } else {
+        printf("\n%d of %d devices flashed successfully in %.1f s\n", count - failed, count, secondsSince(&batchStart));
+    }
+
+    return failed;
+}
+
+#if !defined(_WIN32)
+enum job_kind {
+    JOB_FLASH,
+    JOB_INFO,
+    JOB_COMMAND
+};
+
+// Request of a --daemon client, answered by the worker of its port
+struct ServiceJob {
+    enum job_kind kind;
+    struct ManifestEntry entry;         // port, address, settings and firmware
+    enum bootloader_command command;    // for JOB_COMMAND
+    struct ServiceJob *next;
+};
+
+// Port served by --daemon: the connection stays open between jobs
+struct ServicePort {
+    struct PortWorker worker;
+    struct ServiceJob *jobs;            // queued, in arrival order
+    pthread_cond_t wakeup;
+};
+
+struct Service {
+    struct ManifestEntry defaults;      // command line keys, requests override them
+    const struct BatchOptions *options;
+    pthread_mutex_t lock;               // guards ports and their job queues
+    struct ServicePort *ports[MAX_PORTS];
+    int portCount;
+    int stopping;
+};
+
+static struct Service service = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static volatile sig_atomic_t serviceStopRequested = 0;
+
+static void requestServiceStop(int signum) {
+    (void)signum;
+    serviceStopRequested = 1;
+}
+
+/*
+Threads leave SIGINT and SIGTERM to the main thread, so they interrupt accept().
+Without a place for the thread id the thread is detached.
+*/
+static int startServiceThread(void *(*routine)(void *), void *arg, pthread_t *thread) {
+    sigset_t blocked, previous;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    pthread_t detached;
+    int rc = pthread_create(thread ? thread : &detached, NULL, routine, arg);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if ((rc == 0) && (thread == NULL)) {
+        pthread_detach(detached);
+    }
+    return rc;
+}
+
+static void finishJob(struct ServiceJob *job) {
+    struct ManifestEntry *entry = &job->entry;
+    fprintf(entry->client, "STATUS %s\n", entry->status ? entry->status : "FAILED");
+    fclose(entry->client);
+    if (entry->firmware) {
+        freeFirmware(entry->firmware);
+        free(entry->firmware);
+    }
+    free(entry->fileName);
+    free(entry->device);
+    free(entry->imageVersion);
+    free(job);
+}
+
+/*
+Flash jobs from the head of the queue go as one batch, so next devices are
+jumped to bootloader while the current one is flashed. Jobs with the same
+bootloader settings are put next to each other in it: the port isn't
+reopened between them, unless that would overtake an earlier job for the
+same address. Other jobs are taken one at a time.
+*/
+static struct ServiceJob *takeJobs(struct ServicePort *servicePort) {
+    struct ServiceJob *batch = servicePort->jobs;
+    struct ServiceJob *last = batch;
+    if (batch->kind == JOB_FLASH) {
+        while (last->next && (last->next->kind == JOB_FLASH)) {
+            last = last->next;
+        }
+    }
+    servicePort->jobs = last->next;
+    last->next = NULL;
+
+    struct ServiceJob *grouped = NULL;
+    struct ServiceJob **tail = &grouped;
+    while (batch) {
+        struct UartSettings params = flashingParams(&batch->entry);
+        unsigned char passed[SCAN_LAST_ADDRESS + 1] = {0};  // addresses of jobs left behind
+        struct ServiceJob **link = &batch;
+        while (*link) {
+            struct ServiceJob *job = *link;
+            struct UartSettings jobParams = flashingParams(&job->entry);
+            if ((jobParams.baudrate == params.baudrate) && (jobParams.parity == params.parity) && !passed[job->entry.modbusID]) {
+                *link = job->next;
+                job->next = NULL;
+                *tail = job;
+                tail = &job->next;
             } else {
-                printf("    Version: <read error>\n");
+                passed[job->entry.modbusID] = 1;
+                link = &job->next;
+            }
+        }
+    }
+    return grouped;
+}
+
+static void runInfoJob(struct PortWorker *worker, struct ManifestEntry *entry) {
+    struct PortConnection *port = &worker->port;
+    float responseTimeout = worker->options->responseTimeout;
+    float blResponseTimeout = (BL_MINIMAL_RESPONSE_TIMEOUT > responseTimeout) ? BL_MINIMAL_RESPONSE_TIMEOUT : responseTimeout;
+
+    if ((openPortConnection(port, entry->deviceParams, entry->modbusID, responseTimeout, STOPBITS_FROM_PARAMS) == NULL) || (probeDevice(port) < 0)) {
+        portLog(port, LOG_LEVEL_INFO, "Trying to probe (%d %s) at bootloader params...\n", entry->modbusID, entry->device);
+        if ((openPortConnection(port, entry->bootloaderParams, entry->modbusID, blResponseTimeout, STOPBITS_FORCE_TWO) == NULL) || (probeDevice(port) < 0)) {
+            portLog(port, LOG_LEVEL_ERROR, "Failed to connect (%d %s): %s\n", entry->modbusID, entry->device, modbus_strerror(errno));
+            entry->status = "FAILED";
+            return;
+        }
+    }
+    entry->status = (printDeviceInfo(port) < 0) ? "FAILED" : "OK";
+}
+
+static void runCommandJob(struct PortWorker *worker, struct ManifestEntry *entry, enum bootloader_command command) {
+    struct PortConnection *port = &worker->port;
+
+    if (entry->jumpMode != JUMP_NONE) {
+        if (sendEntryJump(worker, entry) < 0) {
+            return;
+        }
+    }
+    if (connectBootloader(worker, entry) < 0) {
+        entry->status = "FAILED";
+        return;
+    }
+    entry->status = (sendBootloaderCommand(port, command) < 0) ? "FAILED" : "OK";
+}
+
+static void runJobs(struct ServicePort *servicePort, struct ServiceJob *jobs) {
+    struct PortWorker *worker = &servicePort->worker;
+    int failed = 0;
+
+    if (jobs->kind == JOB_FLASH) {
+        int count = 0;
+        for (struct ServiceJob *job = jobs; job; job = job->next) {
+            count++;
+        }
+        worker->queue = malloc(count * sizeof(struct ManifestEntry *));
+        worker->count = 0;
+        for (struct ServiceJob *job = jobs; job; job = job->next) {
+            worker->queue[worker->count++] = &job->entry;
+        }
+        worker->failed = 0;
+        flashQueue(worker);
+        failed = worker->failed;
+        free(worker->queue);
+        worker->queue = NULL;
+    } else {
+        worker->output.client = jobs->entry.client;
+        if (jobs->kind == JOB_INFO) {
+            runInfoJob(worker, &jobs->entry);
+        } else {
+            runCommandJob(worker, &jobs->entry, jobs->command);
+        }
+        worker->output.client = NULL;
+        failed = (strcmp(jobs->entry.status, "OK") != 0);
+        if (failed) {
+            saveFrameTrace(&worker->port, 0);
+        }
+    }
+
+    if (failed) {
+        // Adapter may be gone or the line stuck: next job starts from a fresh connection
+        closePortConnection(&worker->port);
+    }
+    while (jobs) {
+        struct ServiceJob *next = jobs->next;
+        finishJob(jobs);
+        jobs = next;
+    }
+}
+
+static void *runServicePort(void *arg) {
+    struct ServicePort *servicePort = arg;
+    traceFrames(&servicePort->worker.port);
+
+    pthread_mutex_lock(&service.lock);
+    while (1) {
+        while ((servicePort->jobs == NULL) && !service.stopping) {
+            pthread_cond_wait(&servicePort->wakeup, &service.lock);
+        }
+        if (servicePort->jobs == NULL) {
+            break;
+        }
+        struct ServiceJob *jobs = takeJobs(servicePort);
+        pthread_mutex_unlock(&service.lock);
+        runJobs(servicePort, jobs);
+        pthread_mutex_lock(&service.lock);
+    }
+    pthread_mutex_unlock(&service.lock);
+
+    closePortConnection(&servicePort->worker.port);
+    saveFrameTrace(&servicePort->worker.port, 1);
+    return NULL;
+}
+
+// Queues the job on its port's worker, starting the worker for a new port
+static int queueJob(struct ServiceJob *job) {
+    pthread_mutex_lock(&service.lock);
+    struct ServicePort *servicePort = NULL;
+    for (int i = 0; i < service.portCount; i++) {
+        if (strcmp(service.ports[i]->worker.port.device, job->entry.device) == 0) {
+            servicePort = service.ports[i];
+            break;
+        }
+    }
+    if ((servicePort == NULL) && !service.stopping && (service.portCount < MAX_PORTS)) {
+        servicePort = calloc(1, sizeof(struct ServicePort));
+        initPortWorker(&servicePort->worker, duplicateString(job->entry.device), service.options);
+        servicePort->worker.output.logPrefix = servicePort->worker.port.device;
+        pthread_cond_init(&servicePort->wakeup, NULL);
+        if (startServiceThread(runServicePort, servicePort, &servicePort->worker.thread) != 0) {
+            free(servicePort->worker.port.device);
+            free(servicePort);
+            servicePort = NULL;
+        } else {
+            service.ports[service.portCount++] = servicePort;
+        }
+    }
+    if ((servicePort == NULL) || service.stopping) {
+        pthread_mutex_unlock(&service.lock);
+        return -1;
+    }
+
+    struct ServiceJob **tail = &servicePort->jobs;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = job;
+    pthread_cond_signal(&servicePort->wakeup);
+    pthread_mutex_unlock(&service.lock);
+    return 0;
+}
+
+/*
+Request is one line:
+    flash <modbus_addr> <firmware.wbfw> [manifest options]
+    info <modbus_addr> [manifest options]
+    erase <modbus_addr> uart|eeprom|settings|all [manifest options]
+Missing fields are taken from the command line keys. Returns the job, or
+NULL having told the client what's wrong.
+*/
+static struct ServiceJob *parseRequest(char *line, FILE *client) {
+    struct ServiceJob *job = calloc(1, sizeof(struct ServiceJob));
+    struct ManifestEntry *entry = &job->entry;
+    *entry = service.defaults;
+    entry->client = client;
+
+    char *verb = strtok(line, " \t\r\n");
+    char *token = strtok(NULL, " \t\r\n");
+    char *end = NULL;
+    long addr = token ? strtol(token, &end, 0) : -1;
+    if ((verb == NULL) || (token == NULL) || (*end != '\0') || (addr < 0) || (addr > 247)) {
+        fprintf(client, "Invalid request: expected \"flash|info|erase <modbus_addr> ...\"\n");
+        free(job);
+        return NULL;
+    }
+    entry->modbusID = (int)addr;
+
+    if (strcmp(verb, "flash") == 0) {
+        job->kind = JOB_FLASH;
+        entry->fileName = strtok(NULL, " \t\r\n");
+    } else if (strcmp(verb, "info") == 0) {
+        job->kind = JOB_INFO;
+    } else if (strcmp(verb, "erase") == 0) {
+        job->kind = JOB_COMMAND;
+        token = strtok(NULL, " \t\r\n");
+        job->command = BL_COMMAND_COUNT;
+        for (int i = 0; token && (i < BL_COMMAND_COUNT); i++) {
+            if (strcmp(token, bootloaderCommands[i].name) == 0) {
+                job->command = i;
+            }
+        }
+        if (job->command == BL_COMMAND_COUNT) {
+            fprintf(client, "Invalid request: erase needs uart, eeprom, settings or all\n");
+            free(job);
+            return NULL;
+        }
+    } else {
+        fprintf(client, "Invalid request: unknown command \"%s\"\n", verb);
+        free(job);
+        return NULL;
+    }
+    if ((job->kind == JOB_FLASH) && (entry->fileName == NULL)) {
+        fprintf(client, "Invalid request: firmware file is missing\n");
+        free(job);
+        return NULL;
+    }
+
+    while ((token = strtok(NULL, " \t\r\n")) != NULL) {
+        if (parseManifestOption(token, entry) < 0) {
+            fprintf(client, "Invalid request: invalid option \"%s\"\n", token);
+            free(job);
+            return NULL;
+        }
+    }
+    if (entry->device == NULL) {
+        fprintf(client, "Invalid request: no port=<port> and no -d default\n");
+        free(job);
+        return NULL;
+    }
+
+    entry->device = normalizePortName(entry->device);
+    entry->fileName = entry->fileName ? duplicateString(entry->fileName) : NULL;
+    entry->imageVersion = entry->imageVersion ? duplicateString(entry->imageVersion) : NULL;
+    if (job->kind == JOB_FLASH) {
+        entry->firmware = calloc(1, sizeof(struct FirmwareImage));
+        char error[FIRMWARE_ERROR_MAX];
+        if (loadFirmware(entry->fileName, entry->firmware, error, sizeof(error)) < 0) {
+            fprintf(client, "%s\n", error);
+            free(entry->firmware);
+            free(entry->fileName);
+            free(entry->device);
+            free(entry->imageVersion);
+            free(job);
+            return NULL;
+        }
+    }
+    return job;
+}
+
+// Reads the client's request and queues it, the port's worker answers and closes the connection
+static void *serveClient(void *arg) {
+    int s = (int)(intptr_t)arg;
+    struct timeval timeout = {SERVICE_REQUEST_TIMEOUT_SEC, 0};
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char line[MANIFEST_LINE_MAX];
+    size_t len = 0;
+    while ((len < sizeof(line) - 1) && ((len == 0) || (line[len - 1] != '\n'))) {
+        ssize_t rc = recv(s, line + len, sizeof(line) - 1 - len, 0);
+        if (rc <= 0) {
+            break;
+        }
+        len += rc;
+    }
+    line[len] = '\0';
+    shutdown(s, SHUT_RD);
+
+    FILE *client = fdopen(s, "w");
+    if (client == NULL) {
+        close(s);
+        return NULL;
+    }
+    struct ServiceJob *job = parseRequest(line, client);
+    if (job == NULL) {
+        fprintf(client, "STATUS INVALID\n");
+        fclose(client);
+        return NULL;
+    }
+    if (queueJob(job) < 0) {
+        fprintf(client, "Service is stopping or serves too many ports (at most %d)\n", MAX_PORTS);
+        job->entry.status = "REJECTED";
+        finishJob(job);
+    }
+    return NULL;
+}
+
+/*
+Serves flash, info and erase requests on a Unix socket until SIGINT or
+SIGTERM. Every port has its own worker keeping the port open, jobs of one
+port go one after another, different ports are served in parallel.
+Returns -1 if the socket can't be set up.
+*/
+int runService(const char *socketPath, const struct ManifestEntry *defaults, const struct BatchOptions *options) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", socketPath);
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        fprintf(stderr, "Can't create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    unlink(socketPath);     // left by a previous run
+    if ((bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0) || (listen(listener, SOMAXCONN) != 0)) {
+        fprintf(stderr, "Can't listen on %s: %s\n", socketPath, strerror(errno));
+        close(listener);
+        return -1;
+    }
+
+    service.defaults = *defaults;
+    service.options = options;
+
+    struct sigaction stop = {.sa_handler = requestServiceStop};     // no SA_RESTART: accept() must return
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    signal(SIGPIPE, SIG_IGN);       // a client may go away while its job runs
+
+    printf("Waiting for requests on %s\n", socketPath);
+    fflush(stdout);
+    while (!serviceStopRequested) {
+        int s = accept(listener, NULL, NULL);
+        if (s < 0) {
+            if ((errno != EINTR) && (errno != ECONNABORTED)) {
+                fprintf(stderr, "Error while accepting request: %s\n", strerror(errno));
+                sleepSeconds(1);
             }
-            if (signature) {
-                printf("    Signature: %s\n", signature);
-                printf("    Download: https://fw-releases.wirenboard.com/?prefix=fw/by-signature/%s/\n", signature);
+            continue;
+        }
+        if (startServiceThread(serveClient, (void *)(intptr_t)s, NULL) != 0) {
+            close(s);
+        }
+    }
+
+    close(listener);
+    unlink(socketPath);
+    printf("Stopping: finishing queued jobs\n");
+    fflush(stdout);
+
+    pthread_mutex_lock(&service.lock);
+    service.stopping = 1;
+    int portCount = service.portCount;
+    for (int i = 0; i < portCount; i++) {
+        pthread_cond_signal(&service.ports[i]->wakeup);
+    }
+    pthread_mutex_unlock(&service.lock);
+    for (int i = 0; i < portCount; i++) {
+        pthread_join(service.ports[i]->worker.thread, NULL);
+    }
+    return 0;
+}
+#endif
+
+/*
+Charges the time since the previous switch to the current phase and starts
+the given one.
+*/
+void statsEnterPhase(struct PortConnection *port, enum flash_phase phase) {
+    struct FlashStats *stats = ((struct PortOutput *)port->user)->stats;
+    if (stats == NULL) {
+        return;
+    }
+    if (stats->phaseStart.tv_sec) {
+        stats->phaseSec[stats->phase] += secondsSince(&stats->phaseStart);
+    }
+    gettimeofday(&stats->phaseStart, NULL);
+    stats->phase = phase;
+}
+
+void statsAddBlock(struct PortConnection *port, const struct BlockEvent *event) {
+    struct FlashStats *stats = ((struct PortOutput *)port->user)->stats;
+    if (stats == NULL) {
+        return;
+    }
+    if (stats->blockCount == stats->blockCapacity) {
+        unsigned int capacity = stats->blockCapacity ? stats->blockCapacity * 2 : 256;
+        struct BlockStat *blocks = realloc(stats->blocks, capacity * sizeof(struct BlockStat));
+        if (blocks == NULL) {
+            return;
+        }
+        stats->blocks = blocks;
+        stats->blockCapacity = capacity;
+    }
+    stats->blocks[stats->blockCount++] = (struct BlockStat) {
+        .block = event->block,
+        .size = event->size,
+        .rttSec = event->rttSec,
+        .retries = event->retries,
+        .lastErrno = event->lastErrno
+    };
+}
+
+void freeStats(struct FlashStats *stats) {
+    free(stats->blocks);
+    stats->blocks = NULL;
+    stats->blockCount = stats->blockCapacity = 0;
+}
+
+static const char *phaseNames[PHASE_COUNT] = {
+    [PHASE_OTHER] = "other",
+    [PHASE_PORT_SETUP] = "port_setup",
+    [PHASE_JUMP] = "jump",
+    [PHASE_WAIT] = "wait",
+    [PHASE_INFO_BLOCK] = "info_block",
+    [PHASE_DATA_BLOCKS] = "data_blocks"
+};
+
+struct StatsSummary {
+    unsigned int dataBlocks;        // acknowledged
+    unsigned int dataBytes;         // in them
+    unsigned int failedBlocks;      // never acknowledged
+    unsigned int retries;
+    double p50, p90, p99, max, mean;    // data block round trip, seconds
+    double bytesPerSec;
+};
+
+static int compareFloats(const void *a, const void *b) {
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+static void summarizeStats(const struct FlashStats *stats, struct StatsSummary *summary) {
+    memset(summary, 0, sizeof(*summary));
+    float *rtts = malloc((stats->blockCount + 1) * sizeof(float));
+    if (rtts == NULL) {
+        return;
+    }
+    double sum = 0;
+    for (unsigned int i = 0; i < stats->blockCount; i++) {
+        const struct BlockStat *b = &stats->blocks[i];
+        if (b->block == 0) {
+            continue;
+        }
+        summary->retries += b->retries;
+        if (b->rttSec < 0) {
+            summary->failedBlocks++;
+            continue;
+        }
+        rtts[summary->dataBlocks++] = b->rttSec;
+        summary->dataBytes += b->size;
+        sum += b->rttSec;
+    }
+    if (summary->dataBlocks) {
+        unsigned int n = summary->dataBlocks;
+        qsort(rtts, n, sizeof(float), compareFloats);
+        // nearest-rank percentiles
+        summary->p50 = rtts[(n * 50 + 99) / 100 - 1];
+        summary->p90 = rtts[(n * 90 + 99) / 100 - 1];
+        summary->p99 = rtts[(n * 99 + 99) / 100 - 1];
+        summary->max = rtts[n - 1];
+        summary->mean = sum / n;
+    }
+    if (stats->phaseSec[PHASE_DATA_BLOCKS] > 0) {
+        summary->bytesPerSec = summary->dataBytes / stats->phaseSec[PHASE_DATA_BLOCKS];
+    }
+    free(rtts);
+}
+
+static void writeJsonString(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; s && *s; s++) {
+        if ((*s == '"') || (*s == '\\')) {
+            fprintf(f, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void writeStatsJson(FILE *f, struct ManifestEntry *entries, int count, double totalSec) {
+    fprintf(f, "{\n  \"version\": \"" xstr(VERSION) "\",\n  \"total_sec\": %.3f,\n  \"devices\": [", totalSec);
+    for (int i = 0; i < count; i++) {
+        struct ManifestEntry *entry = &entries[i];
+        struct StatsSummary summary;
+        summarizeStats(&entry->stats, &summary);
+
+        fprintf(f, "%s\n    {\n      \"port\": ", i ? "," : "");
+        writeJsonString(f, entry->device);
+        fprintf(f, ",\n      \"modbus_id\": %d,\n      \"firmware\": ", entry->modbusID);
+        writeJsonString(f, entry->fileName);
+        fprintf(f, ",\n      \"status\": ");
+        writeJsonString(f, entry->status);
+        fprintf(f, ",\n      \"elapsed_sec\": %.3f,\n      \"phases_sec\": {", entry->elapsedSec);
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            fprintf(f, "%s\"%s\": %.3f", p ? ", " : "", phaseNames[p], entry->stats.phaseSec[p]);
+        }
+        fprintf(f, "},\n      \"data_blocks\": %u,\n      \"failed_blocks\": %u,\n      \"retries\": %u,\n",
+                summary.dataBlocks, summary.failedBlocks, summary.retries);
+        fprintf(f, "      \"rtt_ms\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f, \"mean\": %.2f},\n",
+                summary.p50 * 1000, summary.p90 * 1000, summary.p99 * 1000, summary.max * 1000, summary.mean * 1000);
+        fprintf(f, "      \"throughput_bytes_per_sec\": %.1f,\n      \"blocks\": [", summary.bytesPerSec);
+        for (unsigned int b = 0; b < entry->stats.blockCount; b++) {
+            const struct BlockStat *block = &entry->stats.blocks[b];
+            fprintf(f, "%s\n        {\"block\": %u, \"rtt_ms\": ", b ? "," : "", block->block);
+            if (block->rttSec < 0) {
+                fprintf(f, "null");
             } else {
-                printf("    Signature: <read error>\n");
+                fprintf(f, "%.2f", block->rttSec * 1000);
             }
+            fprintf(f, ", \"retries\": %d, \"errno\": %d, \"error\": ", block->retries, block->lastErrno);
+            writeJsonString(f, block->lastErrno ? modbus_strerror(block->lastErrno) : "");
+            fprintf(f, "}");
+        }
+        fprintf(f, "%s]\n    }", entry->stats.blockCount ? "\n      " : "");
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
 
-            free(model);
-            free(signature);
-            free(version);
+// Quoted CSV field, a quote inside doubled: port and file names may hold commas
+static void writeCsvField(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; s && *s; s++) {
+        if (*s == '"') {
+            fputc('"', f);
         }
+        fputc(*s, f);
     }
+    fputc('"', f);
+}
 
+static void writeStatsCsv(FILE *f, struct ManifestEntry *entries, int count) {
+    fprintf(f, "port,modbus_id,firmware,status,elapsed_sec");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        fprintf(f, ",%s_sec", phaseNames[p]);
+    }
+    fprintf(f, ",data_blocks,failed_blocks,retries,rtt_p50_ms,rtt_p90_ms,rtt_p99_ms,rtt_max_ms,rtt_mean_ms,throughput_bytes_per_sec\n");
+    for (int i = 0; i < count; i++) {
+        struct ManifestEntry *entry = &entries[i];
+        struct StatsSummary summary;
+        summarizeStats(&entry->stats, &summary);
+        writeCsvField(f, entry->device);
+        fprintf(f, ",%d,", entry->modbusID);
+        writeCsvField(f, entry->fileName);
+        fputc(',', f);
+        writeCsvField(f, entry->status);
+        fprintf(f, ",%.3f", entry->elapsedSec);
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            fprintf(f, ",%.3f", entry->stats.phaseSec[p]);
+        }
+        fprintf(f, ",%u,%u,%u,%.2f,%.2f,%.2f,%.2f,%.2f,%.1f\n", summary.dataBlocks, summary.failedBlocks, summary.retries,
+                summary.p50 * 1000, summary.p90 * 1000, summary.p99 * 1000, summary.max * 1000, summary.mean * 1000, summary.bytesPerSec);
+    }
+}
+
+/*
+Writes --stats report: JSON with per-block records, or one CSV line per
+device if the file name ends with ".csv".
+*/
+int writeStatsReport(const char *fileName, struct ManifestEntry *entries, int count, double totalSec) {
+    FILE *f = fopen(fileName, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Can't write stats to %s: %s\n", fileName, strerror(errno));
+        return -1;
+    }
+    size_t len = strlen(fileName);
+    if ((len > 4) && (strcmp(fileName + len - 4, ".csv") == 0)) {
+        writeStatsCsv(f, entries, count);
+    } else {
+        writeStatsJson(f, entries, count, totalSec);
+    }
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Can't write stats to %s: %s\n", fileName, strerror(errno));
+        return -1;
+    }
+    printf("Stats written to %s\n", fileName);
     return 0;
 }
 
-struct timeval parseResponseTimeout(float timeoutSec) {
-    long decimalPart = (long)timeoutSec;
-    float fractPart = timeoutSec - decimalPart;
-    struct timeval responseTimeout;
-    responseTimeout.tv_sec = decimalPart;
-    responseTimeout.tv_usec = (long)(fractPart * 1000000); // Microseconds
-    return responseTimeout;
+// Single device mode report, does nothing without --stats
+int writeSingleReport(const char *fileName, struct ManifestEntry *report, const struct timeval *start, const char *status) {
+    if (fileName == NULL) {
+        return 0;
+    }
+    report->status = status;
+    report->elapsedSec = secondsSince(start);
+    int rc = writeStatsReport(fileName, report, 1, report->elapsedSec);
+    freeStats(&report->stats);
+    return rc;
+}
+
+/*
+Parses --scan list: comma-separated "<baudrate><parity><stopbits>" items,
+parity and stopbits may be omitted (taken from defaults), or "all" for
+every supported baudrate (fastest first) with every parity.
+Returns number of settings or -1 on error.
+*/
+int parseScanParams(const char *list, struct UartSettings defaults, struct UartSettings *params, int maxCount) {
+    int count = 0;
+    if (strcmp(list, "all") == 0) {
+        for (int b = ARRAY_SIZE(allowedBaudrates) - 1; b >= 0; b--) {
+            for (unsigned int p = 0; (p < ARRAY_SIZE(allowedParity)) && (count < maxCount); p++) {
+                params[count] = defaults;
+                params[count].baudrate = allowedBaudrates[b];
+                params[count].parity = allowedParity[p];
+                count++;
+            }
+        }
+        return count;
+    }
+
+    const char *item = list;
+    while (*item) {
+        struct UartSettings s = defaults;
+        char parity = 0;
+        int stopbits = 0;
+        int len = strcspn(item, ",");
+        char buf[32];
+        if ((len == 0) || (len >= (int)sizeof(buf)) || (count == maxCount)) {
+            printf("Bad scan settings list (--scan=%s)!\n", list);
+            return -1;
+        }
+        memcpy(buf, item, len);
+        buf[len] = '\0';
+        int fields = sscanf(buf, "%d%c%d", &s.baudrate, &parity, &stopbits);
+        if (fields >= 2) {
+            s.parity = parity;
+        }
+        if (fields == 3) {
+            s.stopbits = stopbits;
+            s.stopbitsAreForced = 1;
+        }
+        if ((fields < 1) || !ensureIntIn(s.baudrate, allowedBaudrates, ARRAY_SIZE(allowedBaudrates)) ||
+            !ensureCharIn(s.parity, allowedParity, ARRAY_SIZE(allowedParity)) ||
+            !ensureIntIn(s.stopbits, allowedStopBits, ARRAY_SIZE(allowedStopBits)))
+        {
+            printf("Scan settings %s are not supported!\n", buf);
+            return -1;
+        }
+        params[count++] = s;
+        item += len;
+        if (*item == ',') {
+            item++;
+        }
+    }
+    return count;
 }
 
-void setResponseTimeout(struct timeval timeoutStruct, modbus_t *modbusContext){
-    #if LIBMODBUS_VERSION_CHECK(3, 1, 2)
-        modbus_set_response_timeout(modbusContext, timeoutStruct.tv_sec, timeoutStruct.tv_usec);
-    #else
-        modbus_set_response_timeout(modbusContext, &timeoutStruct);
-    #endif
+static int addressFound(const struct ScanResult *results, int count, const char *device, int modbusID) {
+    for (int i = 0; i < count; i++) {
+        if ((results[i].device == device) && (results[i].modbusID == modbusID)) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-void interFrameDelay(void) {
-    // Workaround for issue FW-1187 (unexpected timeout error).
-    // In rare cases the next frame may start too soon after the previous one,
-    // which can cause a receiving error. Ensuring a minimal gap between frames
-    // resolves the issue. A 100 µs delay is sufficient in practice.
-    // However, we do not have a portable way to implement such a small delay
-    // on all platforms, and sleep(0) has proven to be sufficient.
-    sleep(0);
+/*
+Probes every address with a timeout just above the line time of the probe.
+Allowance for device's reply delay starts small and grows with the slowest
+reply seen, so a bus of missing addresses is swept quickly and slow devices
+are still caught. Addresses already found on the port at previous settings
+are skipped. Responders' signature and versions are read afterwards with
+the normal response timeout. Results are appended to the array.
+Returns 0, or -1 if the port can't be opened.
+*/
+int scanBus(struct PortConnection *port, const struct UartSettings *params, int paramsCount, float responseTimeout, FILE *log, struct ScanResult **results, int *count) {
+    int firstResult = *count;
+
+    for (int i = 0; i < paramsCount; i++) {
+        if (openPortConnection(port, params[i], SCAN_FIRST_ADDRESS, responseTimeout, STOPBITS_FROM_PARAMS) == NULL) {
+            return -1;
+        }
+        if ((port->transport != TRANSPORT_SERIAL) && (i > 0)) {
+            break;      // line settings are the gateway's business
+        }
+
+        float lineSec = probeLineSec(params[i].baudrate);
+        float turnaround = SCAN_TURNAROUND_SEC;
+        if (port->transport != TRANSPORT_SERIAL) {
+            turnaround += NETWORK_LATENCY_SEC;
+        }
+
+        for (int addr = SCAN_FIRST_ADDRESS; addr <= SCAN_LAST_ADDRESS; addr++) {
+            if (addressFound(*results + firstResult, *count - firstResult, port->device, addr)) {
+                continue;
+            }
+            if (port->transport == TRANSPORT_SERIAL) {
+                fprintf(log, "\rScanning %s at %d%c%d: address %d...", port->device, params[i].baudrate, params[i].parity, params[i].stopbits, addr);
+            } else {
+                fprintf(log, "\rScanning %s: address %d...", port->device, addr);
+            }
+            fflush(log);
+
+            float timeout = lineSec + turnaround;
+            if (timeout > responseTimeout) {
+                timeout = responseTimeout;
+            }
+            modbus_set_slave(port->ctx, addr);
+            setResponseTimeout(parseResponseTimeout(timeout), port->ctx);
+            flushPortConnection(port);
+
+            struct timeval sent;
+            gettimeofday(&sent, NULL);
+            char *signature = mbReadString(port->ctx, HOLD_REG_FIRMWARE_SIGNATURE, FW_SIG_LEN);   // the probe, kept for inventory
+            if ((signature == NULL) &&
+                (!isModbusException(errno) || (errno == EMBXGPATH) || (errno == EMBXGTAR)))    // gateway's reply for no device
+            {
+                continue;
+            }
+            float replySec = secondsSince(&sent);
+            if ((replySec - lineSec) * SCAN_TURNAROUND_FACTOR > turnaround) {
+                turnaround = (replySec - lineSec) * SCAN_TURNAROUND_FACTOR;
+            }
+
+            struct ScanResult *grown = realloc(*results, (*count + 1) * sizeof(struct ScanResult));
+            if (grown == NULL) {
+                free(signature);
+                break;
+            }
+            *results = grown;
+            (*results)[(*count)++] = (struct ScanResult) {
+                .device = port->device,
+                .modbusID = addr,
+                .transport = port->transport,
+                .params = params[i],
+                .replySec = replySec,
+                .signature = signature
+            };
+            fprintf(log, " found\n");
+        }
+        fprintf(log, "\r\n");
+    }
+
+    // Responders only, with the normal timeout
+    setResponseTimeout(parseResponseTimeout(responseTimeout), port->ctx);
+    for (int i = firstResult; i < *count; i++) {
+        struct ScanResult *r = &(*results)[i];
+        if (openPortConnection(port, r->params, r->modbusID, responseTimeout, STOPBITS_FROM_PARAMS) == NULL) {
+            return -1;
+        }
+        r->firmwareVersion = mbReadString(port->ctx, HOLD_REG_FIRMWARE_VERSION, FW_VERSION_LEN);
+        r->bootloaderVersion = mbReadString(port->ctx, HOLD_REG_BOOTLOADER_VERSION, BOOTLOADER_VERSION_LEN);
+    }
+    return 0;
+}
+
+void printScanResults(FILE *f, const struct ScanResult *results, int count, int json) {
+    if (json) {
+        fprintf(f, "{\n  \"version\": \"" xstr(VERSION) "\",\n  \"devices\": [");
+        for (int i = 0; i < count; i++) {
+            const struct ScanResult *r = &results[i];
+            fprintf(f, "%s\n    {\"port\": ", i ? "," : "");
+            writeJsonString(f, r->device);
+            fprintf(f, ", \"modbus_id\": %d, ", r->modbusID);
+            if (r->transport == TRANSPORT_SERIAL) {
+                fprintf(f, "\"baudrate\": %d, \"parity\": \"%c\", \"stopbits\": %d, ", r->params.baudrate, r->params.parity, r->params.stopbits);
+            }
+            fprintf(f, "\"reply_ms\": %.1f, \"mode\": \"%s\"", r->replySec * 1000, r->firmwareVersion ? "firmware" : "bootloader");
+            const char *names[] = {"fw_sig", "firmware_version", "bootloader_version"};
+            const char *values[] = {r->signature, r->firmwareVersion, r->bootloaderVersion};
+            for (unsigned int v = 0; v < ARRAY_SIZE(names); v++) {
+                fprintf(f, ", \"%s\": ", names[v]);
+                if (values[v]) {
+                    writeJsonString(f, values[v]);
+                } else {
+                    fprintf(f, "null");
+                }
+            }
+            fprintf(f, "}");
+        }
+        fprintf(f, "%s]\n}\n", count ? "\n  " : "");
+        return;
+    }
+
+    if (count == 0) {
+        return;
+    }
+    fprintf(f, "\n%-20s %4s  %-8s %-10s %-12s %-15s %-10s %s\n", "Port", "Addr", "Settings", "Mode", "Signature", "Firmware", "Bootloader", "Reply, ms");
+    for (int i = 0; i < count; i++) {
+        const struct ScanResult *r = &results[i];
+        char settings[16] = "-";
+        if (r->transport == TRANSPORT_SERIAL) {
+            snprintf(settings, sizeof(settings), "%d%c%d", r->params.baudrate, r->params.parity, r->params.stopbits);
+        }
+        fprintf(f, "%-20s %4d  %-8s %-10s %-12s %-15s %-10s %.1f\n", r->device, r->modbusID, settings,
+                r->firmwareVersion ? "firmware" : "bootloader",
+                r->signature ? r->signature : "-",
+                r->firmwareVersion ? r->firmwareVersion : "-",
+                r->bootloaderVersion ? r->bootloaderVersion : "-",
+                r->replySec * 1000);
+    }
+}
+
+void freeScanResults(struct ScanResult *results, int count) {
+    for (int i = 0; i < count; i++) {
+        free(results[i].signature);
+        free(results[i].firmwareVersion);
+        free(results[i].bootloaderVersion);
+    }
+    free(results);
 }
@@ -4,6 +4,16 @@ CONFIG -= app_bundle
 CONFIG -= qt
 
 SOURCES += \
-    flasher.c
+    flasher.c \
+    wbflasher.c \
+    firmware_image.c \
+    checkpoint.c \
+    uart_cache.c
 
-LIBS += -lmodbus
+HEADERS += \
+    wbflasher.h \
+    firmware_image.h \
+    checkpoint.h \
+    uart_cache.h
+
+LIBS += -lmodbus -lpthread
@@ -0,0 +1,181 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#endif
+
+#include "uart_cache.h"
+
+#define UART_CACHE_HEADER           "# wb-mcu-fw-flasher UART settings"
+#define UART_CACHE_LINE_MAX         512
+
+// Splits "<port> <modbus_addr> <settings>" in place, the port may have spaces in it
+static int parseLine(char *line, char **device, int *modbusID, struct UartSettings *params) {
+    line[strcspn(line, "\r\n")] = '\0';
+    char *settings = strrchr(line, ' ');
+    if ((line[0] == '#') || (settings == NULL) || (settings == line)) {
+        return -1;
+    }
+    *settings++ = '\0';
+    char *addr = strrchr(line, ' ');
+    if ((addr == NULL) || (addr == line)) {
+        return -1;
+    }
+    *addr++ = '\0';
+
+    memset(params, 0, sizeof(*params));
+    params->databits = 8;
+    char tail;
+    if ((sscanf(addr, "%d%c", modbusID, &tail) != 1) ||
+        (sscanf(settings, "%d%c%d%c", &params->baudrate, &params->parity, &params->stopbits, &tail) != 3)) {
+        return -1;
+    }
+    *device = line;
+    return 0;
+}
+
+int loadUartSettings(const char *fileName, const char *device, int modbusID, struct UartSettings *params) {
+    FILE *f = fopen(fileName, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char line[UART_CACHE_LINE_MAX];
+    int rc = -1;
+    while (fgets(line, sizeof(line), f)) {
+        char *lineDevice;
+        int lineID;
+        struct UartSettings lineParams;
+        if ((parseLine(line, &lineDevice, &lineID, &lineParams) == 0) && (lineID == modbusID) && (strcmp(lineDevice, device) == 0)) {
+            *params = lineParams;
+            rc = 0;
+        }
+    }
+    fclose(f);
+    return rc;
+}
+
+#if defined(_WIN32)
+static int lockCache(const char *fileName) {
+    (void)fileName;
+    return 0;
+}
+
+static void unlockCache(int fd) {
+    (void)fd;
+}
+
+static FILE *createTemp(const char *fileName, char *tmpName, size_t size) {
+    if (snprintf(tmpName, size, "%s.tmp", fileName) >= (int)size) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    return fopen(tmpName, "w");
+}
+#else
+/*
+flock() on the cache file itself, held for the whole read-modify-write.
+The file is replaced while locked, so a lock taken on the replaced one
+is dropped and taken again on the current file.
+*/
+static int lockCache(const char *fileName) {
+    for (;;) {
+        int fd = open(fileName, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            return -1;
+        }
+        struct stat locked, current;
+        if (flock(fd, LOCK_EX) != 0) {
+            close(fd);
+            return -1;
+        }
+        if ((fstat(fd, &locked) == 0) && (stat(fileName, &current) == 0) &&
+            (locked.st_dev == current.st_dev) && (locked.st_ino == current.st_ino)) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+static void unlockCache(int fd) {
+    close(fd);
+}
+
+// Unique name next to the file, so two writers never share it and rename() stays on one filesystem
+static FILE *createTemp(const char *fileName, char *tmpName, size_t size) {
+    if (snprintf(tmpName, size, "%s.XXXXXX", fileName) >= (int)size) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    int fd = mkstemp(tmpName);
+    if (fd < 0) {
+        return NULL;
+    }
+    fchmod(fd, 0644);
+    FILE *f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        remove(tmpName);
+    }
+    return f;
+}
+#endif
+
+int saveUartSettings(const char *fileName, const char *device, int modbusID, struct UartSettings params) {
+    int lock = lockCache(fileName);
+    if (lock < 0) {
+        return -1;
+    }
+    char tmpName[FILENAME_MAX];
+    FILE *out = createTemp(fileName, tmpName, sizeof(tmpName));
+    if (out == NULL) {
+        unlockCache(lock);
+        return -1;
+    }
+    fprintf(out, UART_CACHE_HEADER "\n");
+
+    // Other devices' lines are kept
+    FILE *in = fopen(fileName, "r");
+    if (in) {
+        char line[UART_CACHE_LINE_MAX];
+        while (fgets(line, sizeof(line), in)) {
+            char *lineDevice;
+            int lineID;
+            struct UartSettings lineParams;
+            if ((parseLine(line, &lineDevice, &lineID, &lineParams) < 0) ||
+                ((lineID == modbusID) && (strcmp(lineDevice, device) == 0))) {
+                continue;
+            }
+            fprintf(out, "%s %d %d%c%d\n", lineDevice, lineID, lineParams.baudrate, lineParams.parity, lineParams.stopbits);
+        }
+        fclose(in);
+    }
+    fprintf(out, "%s %d %d%c%d\n", device, modbusID, params.baudrate, params.parity, params.stopbits);
+
+    int rc = 0;
+    if (fclose(out) != 0) {
+        rc = -1;
+    }
+#if defined(_WIN32)
+    if (rc == 0) {
+        remove(fileName);   // rename() doesn't replace files there
+    }
+#endif
+    if ((rc == 0) && (rename(tmpName, fileName) != 0)) {
+        rc = -1;
+    }
+    if (rc < 0) {
+        int error = errno;
+        remove(tmpName);
+        errno = error;
+    }
+    unlockCache(lock);
+    return rc;
+}
@@ -0,0 +1,28 @@
+#ifndef UART_CACHE_H
+#define UART_CACHE_H
+
+#include "wbflasher.h"
+
+#if defined(_WIN32)
+#define UART_CACHE_DEFAULT_FILE     "wb-mcu-fw-flasher-uart.txt"
+#else
+#define UART_CACHE_DEFAULT_FILE     "/var/lib/wb-mcu-fw-flasher/uart-settings"
+#endif
+
+/*
+UART settings devices were last found on by --detect-uart, one line per port
+and Modbus address: "<port> <modbus_addr> <baudrate><parity><stopbits>".
+The next detection tries them first and usually needs a single probe.
+*/
+
+// Returns -1 if the file or the device's line is missing
+int loadUartSettings(const char *fileName, const char *device, int modbusID, struct UartSettings *params);
+
+/*
+Replaces the device's line, the file is replaced atomically. Concurrent
+savers, flashers or the daemon, take turns on flock() of the file, so no
+update is lost. Returns -1 on error, the previous file stays then.
+*/
+int saveUartSettings(const char *fileName, const char *device, int modbusID, struct UartSettings params);
+
+#endif
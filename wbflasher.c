@@ -0,0 +1,2127 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <modbus.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <stdarg.h>
+#include <time.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <termios.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(__linux__)
+#include <linux/serial.h>
+#endif
+#endif
+
+#include "wbflasher.h"
+
+#define MAX_ERROR_COUNT             3
+
+#define INFO_BLOCK_RETRY_DELAY_SEC     3
+
+#define RTT_MIN_SAMPLES                3       // blocks measured before the timeout is cut below -t
+#define RTT_TIMEOUT_MARGIN_SEC         0.1     // host scheduling and USB adapter latency on top of the estimate
+
+#define READY_POLL_INITIAL_SEC         0.05
+#define READY_POLL_MAX_SEC             0.8
+
+#define AUTO_BAUD_TEST_READS           3       // replies in a row to accept a baudrate
+
+#define DEFAULT_TCP_PORT               502
+#define HOST_NAME_MAX_LEN              256
+
+#define WINDOW_TID_BASE                0x8000  // keep clear of libmodbus own transaction ids
+#define MBAP_HEADER_LEN                7
+#define MODBUS_FC_READ_INPUT_BITS      0x02
+#define MODBUS_FC_READ_HOLDING_REGS    0x03
+#define MODBUS_FC_WRITE_SINGLE_REG     0x06
+#define MODBUS_FC_WRITE_MULTIPLE_REGS  0x10
+
+// Component firmware registers
+#define COMP_FW_FLAGS_REG               0xFE80
+#define COMP_FW_BASE_REG                0xFD00
+#define COMP_FW_INFO_STRIDE             48
+#define COMP_FW_MODEL_OFFSET            0
+#define COMP_FW_MODEL_LEN               20
+#define COMP_FW_SIGNATURE_OFFSET        0x14
+#define COMP_FW_SIGNATURE_LEN           12
+#define COMP_FW_VERSION_OFFSET          0x20
+#define COMP_FW_VERSION_LEN             16
+#define COMP_FW_READ_MAX                (MODBUS_MAX_READ_REGISTERS / COMP_FW_INFO_STRIDE)  // info blocks per read
+
+#define WIN32_SLEEP_GRANULARITY_SEC     0.016   // scheduler tick, Sleep() may be late by that much
+
+#define LOG_MESSAGE_MAX                 1024
+
+#define SERIAL_TUNINGS_MAX              64      // serial ports tuned by lowLatency at once
+
+#define PORT_LOCK_DIR                   "/var/lock"
+#define PORT_LOCK_POLL_SEC              0.2     // how often a busy port is checked
+#define PORT_LOCK_FILES_MAX             64      // lock files held at once
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+const int allowedBaudrates[ALLOWED_BAUDRATES_COUNT] = {1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400};
+const int allowedStopBits[ALLOWED_STOPBITS_COUNT] = {1, 2};
+const char allowedParity[ALLOWED_PARITY_COUNT] = {'N', 'E', 'O'};
+
+enum window_result {
+    WINDOW_DONE,                // all data blocks acknowledged
+    WINDOW_STOPPED,             // stopped on a failed block, nothing after it was written
+    WINDOW_BROKEN               // a block after the failed one was written, image order is broken
+};
+
+void initPortConnection(struct PortConnection *port, char *device) {
+    memset(port, 0, sizeof(*port));
+    port->device = device;
+    port->responseTimeout = BL_MINIMAL_RESPONSE_TIMEOUT;
+    port->readyTimeout = READY_TIMEOUT_SEC;
+    port->minBaudrate = allowedBaudrates[0];
+    port->window = 1;
+    port->retries = DATA_BLOCK_RETRIES;
+    port->retryBackoffSec = RETRY_BACKOFF_SEC;
+    port->lockTimeoutSec = PORT_LOCK_TIMEOUT_SEC;
+    port->lockFd = -1;
+}
+
+void portLog(struct PortConnection *port, enum log_level level, const char *format, ...) {
+    if (port->callbacks.log == NULL) {
+        return;
+    }
+    char text[LOG_MESSAGE_MAX];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    port->callbacks.log(port, level, text);
+}
+
+static void notifyPhase(struct PortConnection *port, enum flash_phase phase) {
+    if (port->callbacks.phase) {
+        port->callbacks.phase(port, phase);
+    }
+}
+
+static void notifyBlock(struct PortConnection *port, unsigned int block, unsigned int size, double rttSec, int retries, int lastErrno) {
+    if (port->callbacks.block) {
+        struct BlockEvent event = {block, size, rttSec, retries, lastErrno};
+        port->callbacks.block(port, &event);
+    }
+}
+
+static void notifyProgress(struct PortConnection *port, int acked, unsigned int blockCount) {
+    if (port->callbacks.progress) {
+        port->callbacks.progress(port, acked, blockCount);
+    }
+}
+
+/*
+Splits "tcp://host[:port]" and "rtu-over-tcp://host[:port]" device URIs,
+IPv6 host should be in brackets. Anything else is a serial port.
+Host and port are filled only for network transports, host may be NULL.
+Returns transport or -1 on malformed URI.
+*/
+int parseDeviceUri(const char *device, char *host, size_t hostSize, int *tcpPort) {
+    enum transport transport;
+    const char *address;
+
+    if (strncmp(device, TCP_URI_PREFIX, strlen(TCP_URI_PREFIX)) == 0) {
+        transport = TRANSPORT_TCP;
+        address = device + strlen(TCP_URI_PREFIX);
+    } else if (strncmp(device, RTU_OVER_TCP_URI_PREFIX, strlen(RTU_OVER_TCP_URI_PREFIX)) == 0) {
+        transport = TRANSPORT_RTU_OVER_TCP;
+        address = device + strlen(RTU_OVER_TCP_URI_PREFIX);
+    } else {
+        return TRANSPORT_SERIAL;
+    }
+
+    const char *hostEnd;
+    const char *portStart = NULL;
+    if (address[0] == '[') {
+        address++;
+        hostEnd = strchr(address, ']');
+        if (hostEnd == NULL) {
+            return -1;
+        }
+        if (hostEnd[1] == ':') {
+            portStart = hostEnd + 2;
+        } else if (hostEnd[1] != '\0') {
+            return -1;
+        }
+    } else {
+        hostEnd = strchr(address, ':');
+        if (hostEnd) {
+            portStart = hostEnd + 1;
+        } else {
+            hostEnd = address + strlen(address);
+        }
+    }
+
+    size_t hostLen = hostEnd - address;
+    if ((hostLen == 0) || (host && (hostLen >= hostSize))) {
+        return -1;
+    }
+
+    int port = DEFAULT_TCP_PORT;
+    if (portStart) {
+        char *end;
+        long value = strtol(portStart, &end, 10);
+        if ((*portStart == '\0') || (*end != '\0') || (value <= 0) || (value > 65535)) {
+            return -1;
+        }
+        port = (int)value;
+    }
+
+    if (host) {
+        memcpy(host, address, hostLen);
+        host[hostLen] = '\0';
+    }
+    if (tcpPort) {
+        *tcpPort = port;
+    }
+    return transport;
+}
+
+/*
+Opens TCP connection for RTU-over-TCP. Returns socket or -1 with errno set.
+*/
+static int connectTcpSocket(const char *host, int tcpPort) {
+#if defined(_WIN32)
+    // libmodbus RTU backend talks to a HANDLE on Windows, not to a socket
+    errno = ENOTSUP;
+    return -1;
+#else
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM
+    };
+    struct addrinfo *addresses;
+    char service[8];
+    snprintf(service, sizeof(service), "%d", tcpPort);
+
+    int rc = getaddrinfo(host, service, &hints, &addresses);
+    if (rc != 0) {
+        errno = (rc == EAI_SYSTEM) ? errno : EHOSTUNREACH;
+        return -1;
+    }
+
+    int s = -1;
+    for (struct addrinfo *ai = addresses; ai; ai = ai->ai_next) {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s < 0) {
+            continue;
+        }
+        if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        int savedErrno = errno;
+        close(s);
+        errno = savedErrno;
+        s = -1;
+    }
+    freeaddrinfo(addresses);
+
+    if (s >= 0) {
+        // Requests are small and strictly request-reply, don't let Nagle hold them
+        int flag = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    }
+    return s;
+#endif
+}
+
+static void deinitModbus(modbus_t *modbusConnection) {
+    modbus_close(modbusConnection);
+    modbus_free(modbusConnection);
+}
+
+#if !defined(_WIN32)
+enum serial_tuning_change {
+    TUNED_LOW_LATENCY = 1,          // ASYNC_LOW_LATENCY, e.g. FTDI latency timer down to 1 ms
+    TUNED_RS485 = 2,                // kernel drives the transmitter enable with RTS
+    TUNED_READ_THRESHOLDS = 4       // VMIN/VTIME
+};
+
+// What lowLatency changed on an open serial port, undone before it's closed
+struct SerialTuning {
+    volatile sig_atomic_t changes;  // TUNED_* bits, 0 for a free slot
+    int fd;
+    unsigned int rs485Flags;
+    cc_t vmin;
+    cc_t vtime;
+};
+
+/*
+Slots are taken and freed under the lock. restoreSerialPorts() reads them
+without it, so that it can run in a signal handler: undoing needs only
+ioctl() and tcsetattr().
+*/
+static struct SerialTuning serialTunings[SERIAL_TUNINGS_MAX];
+static pthread_mutex_t serialTuningsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void undoSerialTuning(struct SerialTuning *tuning) {
+    int changes = tuning->changes;
+#if defined(__linux__)
+    if (changes & TUNED_LOW_LATENCY) {
+        struct serial_struct serial;
+        if (ioctl(tuning->fd, TIOCGSERIAL, &serial) == 0) {
+            serial.flags &= ~ASYNC_LOW_LATENCY;
+            ioctl(tuning->fd, TIOCSSERIAL, &serial);
+        }
+    }
+    if (changes & TUNED_RS485) {
+        struct serial_rs485 rs485;
+        if (ioctl(tuning->fd, TIOCGRS485, &rs485) == 0) {
+            rs485.flags = tuning->rs485Flags;
+            ioctl(tuning->fd, TIOCSRS485, &rs485);
+        }
+    }
+#endif
+    if (changes & TUNED_READ_THRESHOLDS) {
+        struct termios tios;
+        if (tcgetattr(tuning->fd, &tios) == 0) {
+            tios.c_cc[VMIN] = tuning->vmin;
+            tios.c_cc[VTIME] = tuning->vtime;
+            tcsetattr(tuning->fd, TCSANOW, &tios);
+        }
+    }
+}
+
+/*
+Turns on what the driver supports for short round trips and reports what
+it accepted. Kernel RS-485 mode that is already on is left as the board
+configured it: RTS polarity and delays are the hardware's business.
+*/
+static void tuneSerialPort(struct PortConnection *port) {
+    struct SerialTuning tuning = {.fd = modbus_get_socket(port->ctx)};
+    const char *lowLatency = "not supported on this system";
+    const char *rs485 = lowLatency;
+
+#if defined(__linux__)
+    struct serial_struct serial;
+    if (ioctl(tuning.fd, TIOCGSERIAL, &serial) != 0) {
+        lowLatency = "not supported by the driver";
+    } else if (serial.flags & ASYNC_LOW_LATENCY) {
+        lowLatency = "already on";
+    } else {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        if ((ioctl(tuning.fd, TIOCSSERIAL, &serial) == 0) && (ioctl(tuning.fd, TIOCGSERIAL, &serial) == 0) && (serial.flags & ASYNC_LOW_LATENCY)) {
+            lowLatency = "on";
+            tuning.changes |= TUNED_LOW_LATENCY;
+        } else {
+            lowLatency = "refused by the driver";
+        }
+    }
+
+    struct serial_rs485 rs485Config;
+    if (ioctl(tuning.fd, TIOCGRS485, &rs485Config) != 0) {
+        rs485 = "not supported by the driver";
+    } else if (rs485Config.flags & SER_RS485_ENABLED) {
+        rs485 = "already on";
+    } else {
+        tuning.rs485Flags = rs485Config.flags;
+        rs485Config.flags = (rs485Config.flags | SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND) & ~SER_RS485_RTS_AFTER_SEND;
+        // The driver writes back what it actually set
+        if ((ioctl(tuning.fd, TIOCSRS485, &rs485Config) == 0) && (rs485Config.flags & SER_RS485_ENABLED)) {
+            rs485 = "on";
+            tuning.changes |= TUNED_RS485;
+        } else {
+            rs485 = "refused by the driver";
+        }
+    }
+#endif
+
+    // libmodbus waits for data in select(), so a read must return whatever has arrived
+    const char *thresholds;
+    struct termios tios;
+    if (tcgetattr(tuning.fd, &tios) != 0) {
+        thresholds = "unknown";
+    } else if ((tios.c_cc[VMIN] == 0) && (tios.c_cc[VTIME] == 0)) {
+        thresholds = "already minimal";
+    } else {
+        tuning.vmin = tios.c_cc[VMIN];
+        tuning.vtime = tios.c_cc[VTIME];
+        tios.c_cc[VMIN] = 0;
+        tios.c_cc[VTIME] = 0;
+        if (tcsetattr(tuning.fd, TCSANOW, &tios) == 0) {
+            thresholds = "set to minimal";
+            tuning.changes |= TUNED_READ_THRESHOLDS;
+        } else {
+            thresholds = "refused by the driver";
+        }
+    }
+
+    if (!port->lowLatencyReported || port->debug) {
+        portLog(port, LOG_LEVEL_INFO, "Low latency on %s: ASYNC_LOW_LATENCY %s, kernel RS-485 direction control %s, VMIN/VTIME %s\n",
+                port->device, lowLatency, rs485, thresholds);
+        port->lowLatencyReported = 1;
+    }
+
+    if (tuning.changes == 0) {
+        return;
+    }
+    pthread_mutex_lock(&serialTuningsLock);
+    for (unsigned int i = 0; i < ARRAY_SIZE(serialTunings); i++) {
+        if (serialTunings[i].changes == 0) {
+            serialTunings[i].fd = tuning.fd;
+            serialTunings[i].rs485Flags = tuning.rs485Flags;
+            serialTunings[i].vmin = tuning.vmin;
+            serialTunings[i].vtime = tuning.vtime;
+            serialTunings[i].changes = tuning.changes;  // the last: the slot is complete for restoreSerialPorts()
+            port->tuning = &serialTunings[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&serialTuningsLock);
+    if (port->tuning == NULL) {
+        portLog(port, LOG_LEVEL_ERROR, "Too many tuned ports, low latency settings of %s are undone\n", port->device);
+        undoSerialTuning(&tuning);
+    }
+}
+
+static void releaseSerialTuning(struct PortConnection *port) {
+    if (port->tuning == NULL) {
+        return;
+    }
+    undoSerialTuning(port->tuning);
+    pthread_mutex_lock(&serialTuningsLock);
+    port->tuning->changes = 0;
+    pthread_mutex_unlock(&serialTuningsLock);
+    port->tuning = NULL;
+}
+#endif
+
+void restoreSerialPorts(void) {
+#if !defined(_WIN32)
+    for (unsigned int i = 0; i < ARRAY_SIZE(serialTunings); i++) {
+        if (serialTunings[i].changes) {
+            undoSerialTuning(&serialTunings[i]);
+            serialTunings[i].changes = 0;
+        }
+    }
+#endif
+}
+
+#if !defined(_WIN32)
+/*
+Lock files held, so removePortLockFiles() finds them when the process dies.
+A path belongs to whoever takes it out of its slot, atomically: the port
+closing or the signal handler.
+*/
+static char *portLockFiles[PORT_LOCK_FILES_MAX];
+
+static int keepLockFile(char *path) {
+    for (unsigned int i = 0; i < ARRAY_SIZE(portLockFiles); i++) {
+        char *expected = NULL;
+        if (__atomic_compare_exchange_n(&portLockFiles[i], &expected, path, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Returns 1 if the path was still in its slot, the caller owns it then
+static int dropLockFile(const char *path) {
+    for (unsigned int i = 0; i < ARRAY_SIZE(portLockFiles); i++) {
+        char *expected = (char *)path;
+        if (__atomic_compare_exchange_n(&portLockFiles[i], &expected, NULL, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+Lock file of the UUCP convention other serial programs follow: PORT_LOCK_DIR/LCK..<tty>
+with the owner's pid as ten characters. A link to the tty, as udev makes them, is
+named by the tty, so both names get one lock. Returns -1 if the lock directory can't be used.
+*/
+static int lockFilePath(const struct PortConnection *port, char *path, size_t size) {
+    char target[FILENAME_MAX];
+    ssize_t targetLen = readlink(port->device, target, sizeof(target) - 1);
+    if (targetLen > 0) {
+        target[targetLen] = '\0';  // udev names are links to the tty
+    }
+    const char *name = (targetLen > 0) ? target : port->device;
+    if (strrchr(name, '/')) {
+        name = strrchr(name, '/') + 1;
+    }
+    return (snprintf(path, size, PORT_LOCK_DIR "/LCK..%s", name) < (int)size) ? 0 : -1;
+}
+
+// Pid in the lock file, 0 if there is none or it's being written
+static pid_t lockFileOwner(const char *path) {
+    long pid = 0;
+    FILE *f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%ld", &pid) != 1) {
+            pid = 0;
+        }
+        fclose(f);
+    }
+    return (pid_t)pid;
+}
+
+/*
+Returns 0 with the lock file taken or if the lock directory can't be used (flock() is
+left then), -1 if a live process holds it, *holder is its pid. Flashers come here
+holding flock() on the tty, one at a time, so a stale file removed is the one read;
+it's read again before removal in case a program of the convention took it meanwhile.
+*/
+static int takeLockFile(struct PortConnection *port, pid_t *holder) {
+    *holder = 0;
+    if (port->lockFile) {
+        return 0;
+    }
+    char path[FILENAME_MAX];
+    if (lockFilePath(port, path, sizeof(path)) < 0) {
+        return 0;
+    }
+
+    while (1) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0) {
+            char pid[16];
+            int pidLen = snprintf(pid, sizeof(pid), "%10ld\n", (long)getpid());
+            int written = (write(fd, pid, pidLen) == pidLen);
+            close(fd);
+            char *lockFile = written ? duplicateString(path) : NULL;
+            if ((lockFile == NULL) || (keepLockFile(lockFile) < 0)) {
+                unlink(path);   // one that might be left behind isn't kept
+                free(lockFile);
+                return 0;
+            }
+            port->lockFile = lockFile;
+            return 0;
+        }
+        if (errno != EEXIST) {
+            return 0;
+        }
+
+        pid_t pid = lockFileOwner(path);
+        if ((pid > 0) && (pid != getpid()) && (kill(pid, 0) != 0) && (errno == ESRCH)) {
+            if (lockFileOwner(path) == pid) {
+                unlink(path);   // its owner is gone
+            }
+            continue;
+        }
+        *holder = pid;
+        return -1;
+    }
+}
+
+static void unlockPort(struct PortConnection *port) {
+    if (port->lockFd >= 0) {
+        close(port->lockFd);
+        port->lockFd = -1;
+    }
+    if (port->lockFile) {
+        if (dropLockFile(port->lockFile)) {
+            unlink(port->lockFile);
+            free(port->lockFile);
+        }
+        port->lockFile = NULL;
+    }
+}
+
+/*
+Makes the port ours before it's opened: flock() on a file of the port kept open
+while the port is locked, so reopening on other settings doesn't let anyone in,
+then the lock file. Waits for other programs up to port->lockTimeoutSec; the
+port open in this process under another name fails at once. Returns -1 with
+errno set if the port stays busy or can't be opened.
+*/
+static int lockPort(struct PortConnection *port) {
+    if (port->lockFd >= 0) {
+        return 0;
+    }
+    int fd = open(port->device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        portLog(port, LOG_LEVEL_ERROR, "Can't open %s: %s\n", port->device, strerror(errno));
+        return -1;
+    }
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    int waiting = 0;
+    int locked = 0;
+    while (1) {
+        // flock() is kept while a program of the lock file convention is waited for: the next flasher queues behind us
+        pid_t holder = 0;
+        if (!locked) {
+            locked = (flock(fd, LOCK_EX | LOCK_NB) == 0);
+        }
+        if (locked) {
+            if (takeLockFile(port, &holder) == 0) {
+                break;
+            }
+        } else {
+            char path[FILENAME_MAX];
+            if (lockFilePath(port, path, sizeof(path)) == 0) {
+                holder = lockFileOwner(path);
+            }
+        }
+        if (holder == getpid()) {
+            portLog(port, LOG_LEVEL_ERROR, "Port %s is already open in this process under another name\n", port->device);
+            close(fd);
+            unlockPort(port);
+            errno = EBUSY;
+            return -1;
+        }
+        char who[32] = "another program";
+        if (holder > 0) {
+            snprintf(who, sizeof(who), "process %ld", (long)holder);
+        }
+        if (secondsSince(&start) + PORT_LOCK_POLL_SEC > port->lockTimeoutSec) {
+            portLog(port, LOG_LEVEL_ERROR, "Port %s is busy: locked by %s%s\n", port->device, who, waiting ? ", gave up waiting" : "");
+            close(fd);
+            unlockPort(port);
+            errno = EBUSY;
+            return -1;
+        }
+        if (!waiting) {
+            portLog(port, LOG_LEVEL_INFO, "Port %s is locked by %s, waiting up to %.0f s\n", port->device, who, port->lockTimeoutSec);
+            waiting = 1;
+        }
+        sleepSeconds(PORT_LOCK_POLL_SEC);
+    }
+    if (waiting) {
+        portLog(port, LOG_LEVEL_INFO, "Port %s is free, waited %.1f s\n", port->device, secondsSince(&start));
+    }
+    port->lockFd = fd;
+    return 0;
+}
+#endif
+
+void removePortLockFiles(void) {
+#if !defined(_WIN32)
+    for (unsigned int i = 0; i < ARRAY_SIZE(portLockFiles); i++) {
+        char *path = __atomic_exchange_n(&portLockFiles[i], NULL, __ATOMIC_ACQ_REL);
+        if (path) {
+            unlink(path);
+        }
+    }
+#endif
+}
+
+static modbus_t *initModbus(struct PortConnection *port, struct UartSettings deviceParams, int slaveAddr, float responseTimeout, enum stopbits_mode stopbitsMode) {
+    char *device = port->device;
+    if (stopbitsMode == STOPBITS_FORCE_TWO) {
+        deviceParams.stopbits = 2;
+        deviceParams.stopbitsAreForced = 1;
+    }
+    char host[HOST_NAME_MAX_LEN];
+    int tcpPort;
+    int transport = parseDeviceUri(device, host, sizeof(host), &tcpPort);
+    modbus_t *mbConnection;
+
+    if (transport < 0) {
+        portLog(port, LOG_LEVEL_ERROR, "Invalid device %s, expected serial port, " TCP_URI_PREFIX "host[:port] or " RTU_OVER_TCP_URI_PREFIX "host[:port]\n", device);
+        return NULL;
+    }
+#if !defined(_WIN32)
+    if ((transport == TRANSPORT_SERIAL) && (lockPort(port) < 0)) {
+        return NULL;
+    }
+#endif
+
+    if (transport == TRANSPORT_TCP) {
+        char service[8];
+        snprintf(service, sizeof(service), "%d", tcpPort);
+        mbConnection = modbus_new_tcp_pi(host, service);
+    } else if (transport == TRANSPORT_RTU_OVER_TCP) {
+        // RTU framing on a socket: RTU backend is given the socket instead of a tty
+        mbConnection = modbus_new_rtu(device, deviceParams.baudrate, deviceParams.parity, deviceParams.databits, deviceParams.stopbits);
+    } else {
+#if defined(_WIN32)  // different stopbits for receiving & transmitting are supported only in posix
+        mbConnection = modbus_new_rtu(device, deviceParams.baudrate, deviceParams.parity, deviceParams.databits, deviceParams.stopbits);
+#else
+        int stopbitsReceiving = (deviceParams.stopbitsAreForced == 0) ? 1 : deviceParams.stopbits;
+        mbConnection = modbus_new_rtu_different_stopbits(device, deviceParams.baudrate, deviceParams.parity, deviceParams.databits, deviceParams.stopbits, stopbitsReceiving);
+#endif
+    }
+
+    if (mbConnection == NULL) {
+        portLog(port, LOG_LEVEL_ERROR, "Unknown error.\n");
+        return NULL;
+    }
+
+    int connected;
+    if (transport == TRANSPORT_RTU_OVER_TCP) {
+        int s = connectTcpSocket(host, tcpPort);
+        connected = (s >= 0) && (modbus_set_socket(mbConnection, s) == 0);
+    } else {
+        connected = (modbus_connect(mbConnection) == 0);
+    }
+    if (!connected) {
+        portLog(port, LOG_LEVEL_ERROR, "Connection to %s failed: %s\n", device, modbus_strerror(errno));
+        modbus_free(mbConnection);
+        return NULL;
+    }
+
+    if (transport == TRANSPORT_TCP) {
+        // Gateway may drop an idle connection while the device reboots
+        modbus_set_error_recovery(mbConnection, MODBUS_ERROR_RECOVERY_LINK | MODBUS_ERROR_RECOVERY_PROTOCOL);
+    } else {
+        modbus_set_error_recovery(mbConnection, MODBUS_ERROR_RECOVERY_PROTOCOL);
+    }
+
+    if (modbus_set_slave(mbConnection, slaveAddr) != 0) {
+        if (errno == EINVAL) {
+            portLog(port, LOG_LEVEL_ERROR, "Invalid slave id!\nChoose from 0 to 247\n");
+        } else {
+            portLog(port, LOG_LEVEL_ERROR, "Unknown error on setting slave id.\n");
+        }
+        deinitModbus(mbConnection);
+        return NULL;
+    };
+
+    struct timeval timeout = parseResponseTimeout(responseTimeout);
+    setResponseTimeout(timeout, mbConnection);
+
+    modbus_flush(mbConnection);
+    modbus_set_debug(mbConnection, port->debug);
+    return mbConnection;
+}
+
+/*
+modbus_flush() can't flush a socket given to RTU backend (it calls tcflush),
+so stale bytes are drained by hand.
+*/
+void flushPortConnection(struct PortConnection *port) {
+    modbus_flush(port->ctx);
+#if !defined(_WIN32)
+    if (port->transport == TRANSPORT_RTU_OVER_TCP) {
+        uint8_t buf[256];
+        while (recv(modbus_get_socket(port->ctx), buf, sizeof(buf), MSG_DONTWAIT) > 0) {};
+    }
+#endif
+}
+
+int isModbusException(int error) {
+    return (error > MODBUS_ENOBASE) && (error < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX);
+}
+
+// Device's final answer, asking again won't change it
+static int isPermanentException(int error) {
+    return isModbusException(error) && (error != EMBXSBUSY) && (error != EMBXACK);
+}
+
+static char *registersToString(const uint16_t *vals, int len) {
+    char *buf = malloc(len + 1);
+    if (buf) {
+        for (int i = 0; i < len; i++) {
+            buf[i] = (char)vals[i];
+        }
+        buf[len] = '\0';
+    }
+    return buf;
+}
+
+// Seconds on a clock that only goes forward, for short intervals
+static double monotonicSec(void) {
+#if defined(_WIN32)
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1000000000.0;
+#endif
+}
+
+/*
+Frame's number is cleared while it's written and set after it, then the count
+is published: writeFrameTrace() running in a signal handler or another thread
+can tell a frame that changed under it.
+*/
+static void traceFrame(struct PortConnection *port, char direction, int function, int addr, int count, int error, const uint8_t *data, unsigned int dataSize) {
+    unsigned int number = port->trace.recorded + 1;
+    struct TracedFrame *frame = &port->trace.frames[port->trace.recorded % FRAME_TRACE_SIZE];
+    __atomic_store_n(&frame->number, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    frame->timeSec = monotonicSec();
+    frame->direction = direction;
+    frame->slave = modbus_get_slave(port->ctx);
+    frame->function = function;
+    frame->addr = addr;
+    frame->count = count;
+    frame->error = error;
+    frame->dataSize = (dataSize < sizeof(frame->data)) ? dataSize : sizeof(frame->data);
+    if (data) {
+        memcpy(frame->data, data, frame->dataSize);
+    }
+    __atomic_store_n(&frame->number, number, __ATOMIC_RELEASE);
+    __atomic_store_n(&port->trace.recorded, number, __ATOMIC_RELEASE);
+}
+
+// A broadcast request gets no reply, there is nothing to record then
+static void traceReply(struct PortConnection *port, int function, int addr, int count, int rc) {
+    int error = errno;
+    if (modbus_get_slave(port->ctx) != MODBUS_BROADCAST_ADDRESS) {
+        traceFrame(port, '<', function, addr, count, (rc < 0) ? error : 0, NULL, 0);
+    }
+    errno = error;
+}
+
+static int readHoldingRegisters(struct PortConnection *port, int addr, int count, uint16_t *dest) {
+    traceFrame(port, '>', MODBUS_FC_READ_HOLDING_REGS, addr, count, 0, NULL, 0);
+    int rc = modbus_read_registers(port->ctx, addr, count, dest);
+    traceReply(port, MODBUS_FC_READ_HOLDING_REGS, addr, count, rc);
+    return rc;
+}
+
+static int readInputBits(struct PortConnection *port, int addr, int count, uint8_t *dest) {
+    traceFrame(port, '>', MODBUS_FC_READ_INPUT_BITS, addr, count, 0, NULL, 0);
+    int rc = modbus_read_input_bits(port->ctx, addr, count, dest);
+    traceReply(port, MODBUS_FC_READ_INPUT_BITS, addr, count, rc);
+    return rc;
+}
+
+static int writeHoldingRegisters(struct PortConnection *port, int addr, int count, const uint16_t *data) {
+    uint8_t bytes[DATA_BLOCK_SIZE_MAX];
+    for (int i = 0; (i < count) && (i < MODBUS_MAX_WRITE_REGISTERS); i++) {
+        bytes[2 * i] = data[i] >> 8;
+        bytes[2 * i + 1] = data[i] & 0xFF;
+    }
+    traceFrame(port, '>', MODBUS_FC_WRITE_MULTIPLE_REGS, addr, count, 0, bytes, 2 * count);
+    int rc = modbus_write_registers(port->ctx, addr, count, data);
+    traceReply(port, MODBUS_FC_WRITE_MULTIPLE_REGS, addr, count, rc);
+    return rc;
+}
+
+int writeHoldingRegister(struct PortConnection *port, int addr, int value) {
+    uint8_t bytes[2] = {value >> 8, value & 0xFF};
+    traceFrame(port, '>', MODBUS_FC_WRITE_SINGLE_REG, addr, 1, 0, bytes, sizeof(bytes));
+    int rc = modbus_write_register(port->ctx, addr, value);
+    traceReply(port, MODBUS_FC_WRITE_SINGLE_REG, addr, 1, rc);
+    return rc;
+}
+
+// Trace line built without stdio, writeFrameTrace() must stay async-signal-safe
+struct TraceLine {
+    char text[96 + 2 * DATA_BLOCK_SIZE_MAX];
+    size_t len;
+};
+
+static void appendChar(struct TraceLine *line, char c) {
+    if (line->len < sizeof(line->text)) {
+        line->text[line->len++] = c;
+    }
+}
+
+static void appendText(struct TraceLine *line, const char *text) {
+    while (*text && (line->len < sizeof(line->text))) {
+        line->text[line->len++] = *text++;
+    }
+}
+
+static void appendDecimal(struct TraceLine *line, long value) {
+    char digits[24];
+    int n = 0;
+    unsigned long magnitude = (value < 0) ? -(unsigned long)value : (unsigned long)value;
+    do {
+        digits[n++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0) {
+        digits[n++] = '-';
+    }
+    while (n && (line->len < sizeof(line->text))) {
+        line->text[line->len++] = digits[--n];
+    }
+}
+
+static void appendHex(struct TraceLine *line, unsigned int value, int width) {
+    static const char hex[] = "0123456789abcdef";
+    for (int shift = 4 * (width - 1); (shift >= 0) && (line->len < sizeof(line->text)); shift -= 4) {
+        line->text[line->len++] = hex[(value >> shift) & 0xF];
+    }
+}
+
+static void appendResult(struct TraceLine *line, const struct TracedFrame *frame) {
+    if (frame->direction == '>') {
+        appendChar(line, '-');
+    } else if (frame->error == 0) {
+        appendText(line, "ok");
+    } else if (frame->error == ETIMEDOUT) {
+        appendText(line, "timeout");
+    } else if (isModbusException(frame->error)) {
+        appendText(line, "exception:");
+        appendDecimal(line, frame->error - MODBUS_ENOBASE);
+    } else {
+        appendText(line, "error:");
+        appendDecimal(line, frame->error);
+    }
+}
+
+static int writeLine(int fd, const struct TraceLine *line) {
+    return (write(fd, line->text, line->len) == (ssize_t)line->len) ? 0 : -1;
+}
+
+// Copies the frame with the given number, 0 if it's being written or was overwritten meanwhile
+static int copyFrame(const struct FrameTrace *trace, unsigned int number, struct TracedFrame *copy) {
+    const struct TracedFrame *frame = &trace->frames[(number - 1) % FRAME_TRACE_SIZE];
+    if (__atomic_load_n(&frame->number, __ATOMIC_ACQUIRE) != number) {
+        return 0;
+    }
+    memcpy(copy, frame, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&frame->number, __ATOMIC_RELAXED) == number;
+}
+
+int writeFrameTrace(const struct PortConnection *port, int fd) {
+    const struct FrameTrace *trace = &port->trace;
+    unsigned int recorded = __atomic_load_n(&trace->recorded, __ATOMIC_ACQUIRE);
+    unsigned int first = (recorded > FRAME_TRACE_SIZE) ? recorded - FRAME_TRACE_SIZE : 0;
+
+    struct TraceLine line = {.len = 0};
+    appendText(&line, "# ");
+    appendText(&line, port->device);
+    appendChar(&line, ' ');
+    appendDecimal(&line, port->params.baudrate);
+    appendChar(&line, port->params.parity);
+    appendDecimal(&line, port->params.stopbits);
+    appendText(&line, " at ");
+    appendDecimal(&line, (long)time(NULL));
+    appendText(&line, ", frames ");
+    appendDecimal(&line, first + 1);
+    appendText(&line, "..");
+    appendDecimal(&line, recorded);
+    appendChar(&line, '\n');
+    if (writeLine(fd, &line) < 0) {
+        return -1;
+    }
+
+    int started = 0;
+    double startSec = 0;
+    for (unsigned int i = first; i < recorded; i++) {
+        struct TracedFrame frame;
+        if (!copyFrame(trace, i + 1, &frame)) {
+            continue;
+        }
+        if (!started) {
+            startSec = frame.timeSec;
+            started = 1;
+        }
+        line.len = 0;
+        appendDecimal(&line, (long)((frame.timeSec - startSec) * 1000000));
+        appendChar(&line, ' ');
+        appendChar(&line, frame.direction);
+        appendChar(&line, ' ');
+        appendDecimal(&line, frame.slave);
+        appendChar(&line, ' ');
+        appendHex(&line, frame.function, 2);
+        appendChar(&line, ' ');
+        appendHex(&line, frame.addr, 4);
+        appendChar(&line, ' ');
+        appendDecimal(&line, frame.count);
+        appendChar(&line, ' ');
+        appendResult(&line, &frame);
+        if (frame.dataSize) {
+            appendChar(&line, ' ');
+            for (unsigned int b = 0; b < frame.dataSize; b++) {
+                appendHex(&line, frame.data[b], 2);
+            }
+        }
+        appendChar(&line, '\n');
+        if (writeLine(fd, &line) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+char *mbReadString(modbus_t *ctx, int startAddr, int len){
+    uint16_t vals[len];
+    int rc = modbus_read_registers(ctx, startAddr, len, vals);
+    if (rc >= 0) {
+        return registersToString(vals, rc);
+    }
+    return NULL;
+}
+
+static char *readPortString(struct PortConnection *port, int startAddr, int len) {
+    uint16_t vals[len];
+    int rc = readHoldingRegisters(port, startAddr, len, vals);
+    if (rc >= 0) {
+        return registersToString(vals, rc);
+    }
+    return NULL;
+}
+
+static int probePort(struct PortConnection *port) {
+    uint16_t firmwareSignature[FW_SIG_LEN];
+    return readHoldingRegisters(port, HOLD_REG_FIRMWARE_SIGNATURE, FW_SIG_LEN, firmwareSignature);
+}
+
+int probeConnection(modbus_t *ctx){
+    uint16_t firmwareSignature[FW_SIG_LEN];  // reading fw-sig is supported both in firmware and bootloader
+    return modbus_read_registers(ctx, HOLD_REG_FIRMWARE_SIGNATURE, FW_SIG_LEN, firmwareSignature);
+}
+
+static const struct {
+    int addr;
+    int len;
+} infoStringRegs[INFO_STRING_COUNT] = {
+    [INFO_FIRMWARE_SIGNATURE] = {HOLD_REG_FIRMWARE_SIGNATURE, FW_SIG_LEN},
+    [INFO_FIRMWARE_VERSION] = {HOLD_REG_FIRMWARE_VERSION, FW_VERSION_LEN},
+    [INFO_BOOTLOADER_VERSION] = {HOLD_REG_BOOTLOADER_VERSION, BOOTLOADER_VERSION_LEN}
+};
+
+void clearDeviceInfo(struct DeviceInfo *info) {
+    for (int i = 0; i < INFO_STRING_COUNT; i++) {
+        free(info->strings[i]);
+    }
+    for (int i = 0; i < COMP_FW_MAX_COUNT; i++) {
+        free(info->components[i].model);
+        free(info->components[i].signature);
+        free(info->components[i].version);
+    }
+    memset(info, 0, sizeof(*info));
+}
+
+// Cached info of the device the port is talking to
+static struct DeviceInfo *deviceInfo(struct PortConnection *port) {
+    int modbusID = modbus_get_slave(port->ctx);
+    if (port->info.modbusID != modbusID) {
+        clearDeviceInfo(&port->info);
+        port->info.modbusID = modbusID;
+    }
+    return &port->info;
+}
+
+const char *readInfoString(struct PortConnection *port, enum info_string which) {
+    struct DeviceInfo *info = deviceInfo(port);
+    if (info->errors[which]) {
+        errno = info->errors[which];
+        return NULL;
+    }
+    if (info->strings[which] == NULL) {
+        info->strings[which] = readPortString(port, infoStringRegs[which].addr, infoStringRegs[which].len);
+        if ((info->strings[which] == NULL) && isPermanentException(errno)) {
+            info->errors[which] = errno;
+        }
+    }
+    return info->strings[which];
+}
+
+int probeDevice(struct PortConnection *port) {
+    return (readInfoString(port, INFO_FIRMWARE_SIGNATURE) == NULL) ? -1 : 0;
+}
+
+static void readComponentFields(struct ComponentInfo *component, const uint16_t *block) {
+    component->model = registersToString(block + COMP_FW_MODEL_OFFSET, COMP_FW_MODEL_LEN);
+    component->signature = registersToString(block + COMP_FW_SIGNATURE_OFFSET, COMP_FW_SIGNATURE_LEN);
+    component->version = registersToString(block + COMP_FW_VERSION_OFFSET, COMP_FW_VERSION_LEN);
+}
+
+/*
+Reads component flags, then info blocks of present components. Model,
+signature and version fill the whole COMP_FW_INFO_STRIDE block, and blocks
+of neighbour components follow each other, so adjacent present components
+are read together, COMP_FW_READ_MAX blocks per request. A device that
+refuses such read gets the fields read one by one.
+Returns 0 or -1 with errno set if flags can't be read.
+*/
+int readComponentFirmwares(struct PortConnection *port) {
+    struct DeviceInfo *info = deviceInfo(port);
+    if (info->componentsError) {
+        errno = info->componentsError;
+        return -1;
+    }
+    if (info->componentsRead) {
+        return 0;
+    }
+
+    if (readInputBits(port, COMP_FW_FLAGS_REG, COMP_FW_MAX_COUNT, info->componentFlags) < 0) {
+        if (isPermanentException(errno)) {
+            info->componentsError = errno;
+        }
+        return -1;
+    }
+
+    for (int first = 0; first < COMP_FW_MAX_COUNT; first++) {
+        if (!info->componentFlags[first]) {
+            continue;
+        }
+        int count = 1;
+        while ((count < COMP_FW_READ_MAX) && (first + count < COMP_FW_MAX_COUNT) && info->componentFlags[first + count]) {
+            count++;
+        }
+
+        uint16_t regs[COMP_FW_READ_MAX * COMP_FW_INFO_STRIDE];
+        int baseAddr = COMP_FW_BASE_REG + first * COMP_FW_INFO_STRIDE;
+        if (readHoldingRegisters(port, baseAddr, count * COMP_FW_INFO_STRIDE, regs) == count * COMP_FW_INFO_STRIDE) {
+            for (int i = 0; i < count; i++) {
+                readComponentFields(&info->components[first + i], regs + i * COMP_FW_INFO_STRIDE);
+            }
+        } else {
+            for (int i = 0; i < count; i++) {
+                struct ComponentInfo *component = &info->components[first + i];
+                int addr = baseAddr + i * COMP_FW_INFO_STRIDE;
+                component->model = readPortString(port, addr + COMP_FW_MODEL_OFFSET, COMP_FW_MODEL_LEN);
+                component->signature = readPortString(port, addr + COMP_FW_SIGNATURE_OFFSET, COMP_FW_SIGNATURE_LEN);
+                component->version = readPortString(port, addr + COMP_FW_VERSION_OFFSET, COMP_FW_VERSION_LEN);
+            }
+        }
+        first += count - 1;
+    }
+    info->componentsRead = 1;
+    return 0;
+}
+
+struct timeval parseResponseTimeout(float timeoutSec) {
+    long decimalPart = (long)timeoutSec;
+    float fractPart = timeoutSec - decimalPart;
+    struct timeval responseTimeout;
+    responseTimeout.tv_sec = decimalPart;
+    responseTimeout.tv_usec = (long)(fractPart * 1000000); // Microseconds
+    return responseTimeout;
+}
+
+void setResponseTimeout(struct timeval timeoutStruct, modbus_t *modbusContext){
+    #if LIBMODBUS_VERSION_CHECK(3, 1, 2)
+        modbus_set_response_timeout(modbusContext, timeoutStruct.tv_sec, timeoutStruct.tv_usec);
+    #else
+        modbus_set_response_timeout(modbusContext, &timeoutStruct);
+    #endif
+}
+
+/*
+Modbus RTU frame ends with 3.5 characters of silence on the line: start bit,
+data bits, parity bit and stop bits each. The spec fixes it at 1.75 ms above
+19200, but our devices need much less (FW-1187 is fine with 100 us), so the
+exact interval is kept at every baudrate.
+*/
+double frameGapSec(struct UartSettings params) {
+    int bits = 1 + params.databits + ((params.parity == 'N') ? 0 : 1) + params.stopbits;
+    return 3.5 * bits / params.baudrate;
+}
+
+// Called right after an exchange, the gap before the next request is counted from here
+static void markLineIdle(struct PortConnection *port) {
+    if (port->transport != TRANSPORT_SERIAL) {
+        return;
+    }
+#if !defined(_WIN32)
+    tcdrain(modbus_get_socket(port->ctx));    // a broadcast request gets no reply, it may be still going out
+#endif
+    port->lineIdleSec = monotonicSec();
+}
+
+/*
+Workaround for issue FW-1187 (unexpected timeout error): a frame started
+too soon after the previous one is dropped by the device. Waits until the
+silent interval for the port's settings has passed since markLineIdle().
+Gateways frame requests themselves, nothing to wait for them.
+*/
+void interFrameDelay(struct PortConnection *port) {
+    if (port->transport != TRANSPORT_SERIAL) {
+        return;
+    }
+    double deadline = port->lineIdleSec + frameGapSec(port->params);
+#if defined(_WIN32)
+    double left = deadline - monotonicSec();
+    if (left > WIN32_SLEEP_GRANULARITY_SEC) {
+        Sleep((DWORD)((left - WIN32_SLEEP_GRANULARITY_SEC) * 1000));
+    }
+    while (monotonicSec() < deadline) {};   // the rest is shorter than Sleep() can do
+#else
+    struct timespec until;
+    until.tv_sec = (time_t)deadline;
+    until.tv_nsec = (long)((deadline - until.tv_sec) * 1000000000);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {};
+#endif
+}
+
+int jumpToBootloader(struct PortConnection *port, enum jump_mode *jumpMode, int baudrate) {
+    int inBootloader = 0;
+
+    clearDeviceInfo(&port->info);   // firmware's answers are not bootloader's
+
+    if (*jumpMode == JUMP_FASTEST) {
+        portLog(port, LOG_LEVEL_INFO, "Try to jump to bootloader keeping baudrate %d...\n", baudrate);
+        if (writeHoldingRegister(port, HOLD_REG_JUMP_TO_BOOT_CURRENT_BAUD, 1) == 1) {
+            portLog(port, LOG_LEVEL_INFO, "Ok, device supports this.\n");
+            *jumpMode = JUMP_CURRENT_BAUD;
+            return 1;
+        }
+        if ((errno != EMBXILADD) && (errno != EMBXILVAL)) {
+            portLog(port, LOG_LEVEL_INFO, "Error: %s.\n", modbus_strerror(errno));
+            portLog(port, LOG_LEVEL_INFO, "May be device already in bootloader, will look for it on all baudrates\n");
+            return 0;
+        }
+        portLog(port, LOG_LEVEL_INFO, "Not supported by the device, using standard jump.\n");
+        *jumpMode = JUMP_STANDARD_BAUD;
+    }
+
+    if (*jumpMode == JUMP_STANDARD_BAUD) {
+        portLog(port, LOG_LEVEL_INFO, "Send jump to bootloader command...\n");
+        if (writeHoldingRegister(port, HOLD_REG_JUMP_TO_BOOT_STANDARD_BAUD, 1) == 1) {
+            portLog(port, LOG_LEVEL_INFO, "Ok, device will jump to bootloader.\n");
+            inBootloader = 1;
+        } else {
+            portLog(port, LOG_LEVEL_INFO, "Error: %s.\n", modbus_strerror(errno));
+            if ((errno == EMBXILADD) ||
+                (errno == EMBXILVAL))  // some of ours fw report illegal data value on nonexistent register
+            {
+                portLog(port, LOG_LEVEL_ERROR, "Device probably doesn't support in-field firmware upgrade\n");
+                return -1;
+            }
+            //Devices firmwares have bug: writing to  HOLD_REG_JUMP_TO_BOOTLOADER at low BDs causes modbus timeout error.
+            //"1" in HOLD_REG_JUMP_TO_BOOTLOADER causes reboot to bootloader, and device have ~5ms to send a responce
+            portLog(port, LOG_LEVEL_INFO, "May be device already in bootloader, check status led\n");
+        }
+    } else if (*jumpMode == JUMP_CURRENT_BAUD) {
+        portLog(port, LOG_LEVEL_INFO, "Try to jump to bootloader using current baudrate...\n");
+        if (writeHoldingRegister(port, HOLD_REG_JUMP_TO_BOOT_CURRENT_BAUD, 1) == 1) {
+            portLog(port, LOG_LEVEL_INFO, "Ok, device supports this. Baudrate %d will be used for flashing.\n", baudrate);
+            inBootloader = 1;
+        } else {
+            portLog(port, LOG_LEVEL_ERROR, "Error while writing register %d: %s.\n", HOLD_REG_JUMP_TO_BOOT_CURRENT_BAUD, modbus_strerror(errno));
+            if (errno == EMBXILADD) {
+                portLog(port, LOG_LEVEL_ERROR, "Firmware and/or bootloader doesn't support this command. Please upgrade firmware and/or bootloader.\n");
+                portLog(port, LOG_LEVEL_ERROR, "Alternatively, you can use -j option to jump to bootloader using standard baudrate.\n");
+            } else {
+                portLog(port, LOG_LEVEL_ERROR, "Other error, check device connection parameters.\n");
+            }
+            return -1;
+        }
+    }
+    return inBootloader;
+}
+
+int jumpToFirmware(struct PortConnection *port) {
+    clearDeviceInfo(&port->info);   // bootloader's answers are not firmware's
+    portLog(port, LOG_LEVEL_INFO, "Send jump to firmware command...\n");
+    if (writeHoldingRegister(port, HOLD_REG_CMD_JUMP_TO_FIRMWARE, 1) == 1) {
+        portLog(port, LOG_LEVEL_INFO, "Ok, device will start the firmware.\n");
+        return 0;
+    }
+    portLog(port, LOG_LEVEL_INFO, "Error: %s.\n", modbus_strerror(errno));
+    if (isModbusException(errno)) {
+        portLog(port, LOG_LEVEL_ERROR, "Bootloader refused to start the firmware\n");
+        return -1;
+    }
+    // Bootloader may restart before the reply is out, as on jump to bootloader
+    return 0;
+}
+
+/*
+Compares the device with the image before it's sent to bootloader: fw-sig
+should be one the image is for, and the running firmware shouldn't be the
+image's version already. Nothing is decided on what can't be read: the
+bootloader checks the signature anyway, and in bootloader there is no
+running version.
+*/
+enum preflight_result preflightCheck(struct PortConnection *port, const struct FirmwareImage *firmware, const char *imageVersion) {
+    const char *signature = readInfoString(port, INFO_FIRMWARE_SIGNATURE);
+    if (signature == NULL) {
+        portLog(port, LOG_LEVEL_INFO, "Pre-flight check: can't read signature (%s), not checked\n", modbus_strerror(errno));
+        return PREFLIGHT_FLASH;
+    }
+    if (signature[0] && !firmwareHasSignature(firmware, signature)) {
+        portLog(port, LOG_LEVEL_ERROR, "Pre-flight check: %s is not for this device, device signature is %s\n", firmware->fileName, signature);
+        portLog(port, LOG_LEVEL_ERROR, "Download firmwares: https://fw-releases.wirenboard.com/?prefix=fw/by-signature/%s/\n", signature);
+        return PREFLIGHT_WRONG_SIGNATURE;
+    }
+
+    const char *version = readInfoString(port, INFO_FIRMWARE_VERSION);
+    if (version && imageVersion && imageVersion[0] && (strcmp(version, imageVersion) == 0)) {
+        portLog(port, LOG_LEVEL_INFO, "Pre-flight check: device already runs firmware %s, skipping\n", version);
+        return PREFLIGHT_CURRENT;
+    }
+    portLog(port, LOG_LEVEL_INFO, "Pre-flight check: signature %s, firmware %s -> %s\n", signature[0] ? signature : "(none)",
+            version ? version : "(bootloader)", (imageVersion && imageVersion[0]) ? imageVersion : "(unknown version)");
+    return PREFLIGHT_FLASH;
+}
+
+static int sendInfoBlock(struct PortConnection *port, const struct FirmwareImage *firmware) {
+    uint16_t data[INFO_BLOCK_SIZE / 2];
+    int errorCount = 0;
+    int lastErrno = 0;
+    struct timeval sent;
+
+    blockToRegisters(firmwareInfoBlock(firmware), INFO_BLOCK_SIZE, data);
+    notifyPhase(port, PHASE_INFO_BLOCK);
+    portLog(port, LOG_LEVEL_INFO, "\nSending info block...");
+    while (errorCount < MAX_ERROR_COUNT) {
+        gettimeofday(&sent, NULL);
+        if (writeHoldingRegisters(port, INFO_BLOCK_REG_ADDRESS, INFO_BLOCK_SIZE / 2, data) == (INFO_BLOCK_SIZE / 2)) {
+            markLineIdle(port);
+            notifyBlock(port, 0, INFO_BLOCK_SIZE, secondsSince(&sent), errorCount, lastErrno);
+            portLog(port, LOG_LEVEL_INFO, " OK\n");
+            interFrameDelay(port);
+            return 0;
+        }
+        lastErrno = errno;
+        notifyBlock(port, 0, INFO_BLOCK_SIZE, -1, errorCount, lastErrno);
+        portLog(port, LOG_LEVEL_INFO, "\n");
+        portLog(port, LOG_LEVEL_ERROR, "Error while sending info block: %s\n", modbus_strerror(errno));
+        if (errno == EMBXSFAIL) {
+            portLog(port, LOG_LEVEL_ERROR, "Data format is invalid or firmware signature doesn't match the device\n");
+            return -1;
+        } else if ((errno == EMBXILADD) ||
+                   (errno == EMBXILVAL))  // some of our fws report illegal data value on nonexistent register
+        {
+            portLog(port, LOG_LEVEL_ERROR, "Not in bootloader mode? Try repeating with -j\n");
+            return -1;
+        }
+        notifyPhase(port, PHASE_WAIT);
+        waitDeviceReady(port, NULL, INFO_BLOCK_RETRY_DELAY_SEC);
+        notifyPhase(port, PHASE_INFO_BLOCK);
+        errorCount++;
+    }
+    portLog(port, LOG_LEVEL_ERROR, "Error while sending info block.\n");
+    portLog(port, LOG_LEVEL_ERROR, "Check connection, jump to bootloader and try again.\n");
+    return -1;
+}
+
+#if !defined(_WIN32)
+static int receiveAll(int s, uint8_t *buf, size_t len, float timeout) {
+    size_t received = 0;
+    while (received < len) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(s, &fds);
+        struct timeval tv = parseResponseTimeout(timeout);
+        int rc = select(s + 1, &fds, NULL, NULL, &tv);
+        if (rc == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ssize_t n = recv(s, buf + received, len - received, 0);
+        if (n <= 0) {
+            errno = (n == 0) ? ECONNRESET : errno;
+            return -1;
+        }
+        received += n;
+    }
+    return 0;
+}
+#endif
+
+/*
+Keeps up to `window` data block writes in flight on a Modbus TCP connection,
+so the gateway queues them for the serial line instead of waiting a network
+round trip per block. Replies are matched by transaction id and may come in
+any order. Bootloader writes blocks in the order they arrive, so a failed block
+can be resent only if everything sent after it was rejected: then *filePointer
+is left at the failed block for the stop-and-wait loop to go on. Otherwise the
+image has to be sent again from the info block.
+*/
+static enum window_result sendDataBlocksWindowed(struct PortConnection *port, const struct FirmwareImage *firmware, unsigned int *filePointer, int window) {
+#if defined(_WIN32)
+    return WINDOW_STOPPED;
+#else
+    int s = modbus_get_socket(port->ctx);
+    int unitId = modbus_get_slave(port->ctx);
+    unsigned int blockSize = port->blockSize;
+    unsigned int blockCount = firmwareBlockCount(firmware, blockSize);
+    unsigned int first = (*filePointer - INFO_BLOCK_SIZE) / blockSize;
+    signed char *status = calloc(blockCount, 1);    // 0 in flight or not sent, 1 acknowledged, -1 failed
+    struct timeval *sentAt = calloc(blockCount, sizeof(struct timeval));
+    if ((status == NULL) || (sentAt == NULL)) {
+        free(status);
+        free(sentAt);
+        return WINDOW_STOPPED;
+    }
+
+    unsigned int next = first;          // next block to send
+    unsigned int acked = first;         // blocks before this one are acknowledged
+    unsigned int failed = blockCount;   // first failed block
+    int inFlight = 0;
+    int lastErrno = 0;
+
+    while (1) {
+        while ((inFlight < window) && (next < blockCount) && (failed == blockCount)) {
+            uint16_t tid = WINDOW_TID_BASE + next;
+            uint8_t frame[MBAP_HEADER_LEN + 6 + DATA_BLOCK_SIZE_MAX];
+            unsigned int size;
+            const uint8_t *data = firmwareDataBlock(firmware, next, blockSize, &size);
+            int pduLen = 6 + size;
+            int frameLen = MBAP_HEADER_LEN + pduLen;
+            frame[0] = tid >> 8;
+            frame[1] = tid & 0xFF;
+            frame[2] = 0;
+            frame[3] = 0;
+            frame[4] = (pduLen + 1) >> 8;
+            frame[5] = (pduLen + 1) & 0xFF;
+            frame[6] = unitId;
+            frame[7] = MODBUS_FC_WRITE_MULTIPLE_REGS;
+            frame[8] = DATA_BLOCK_REG_ADDRESS >> 8;
+            frame[9] = DATA_BLOCK_REG_ADDRESS & 0xFF;
+            frame[10] = 0;
+            frame[11] = size / 2;
+            frame[12] = size;
+            memcpy(&frame[13], data, size);     // already in wire order
+            gettimeofday(&sentAt[next], NULL);
+            if (send(s, frame, frameLen, MSG_NOSIGNAL) != frameLen) {
+                lastErrno = errno;
+                failed = next;
+                break;
+            }
+            traceFrame(port, '>', MODBUS_FC_WRITE_MULTIPLE_REGS, DATA_BLOCK_REG_ADDRESS, size / 2, 0, data, size);
+            next++;
+            inFlight++;
+        }
+        if (inFlight == 0) {
+            break;
+        }
+
+        uint8_t reply[MBAP_HEADER_LEN + 253];
+        if (receiveAll(s, reply, MBAP_HEADER_LEN, port->responseTimeout) < 0) {
+            lastErrno = errno;
+            traceFrame(port, '<', MODBUS_FC_WRITE_MULTIPLE_REGS, DATA_BLOCK_REG_ADDRESS, 0, lastErrno, NULL, 0);
+            break;      // blocks still in flight stay unknown
+        }
+        unsigned int len = (reply[4] << 8) | reply[5];
+        if ((len < 2) || (len > 254) || (receiveAll(s, reply + MBAP_HEADER_LEN, len - 1, port->responseTimeout) < 0)) {
+            lastErrno = (len < 2) || (len > 254) ? EMBBADDATA : errno;
+            traceFrame(port, '<', MODBUS_FC_WRITE_MULTIPLE_REGS, DATA_BLOCK_REG_ADDRESS, 0, lastErrno, NULL, 0);
+            break;
+        }
+        // Write multiple registers reply echoes address and quantity, an exception has its code only
+        int ack = (len == 6) && (reply[7] == MODBUS_FC_WRITE_MULTIPLE_REGS);
+        int exception = (len == 3) && (reply[7] == (MODBUS_FC_WRITE_MULTIPLE_REGS | 0x80));
+        unsigned int block = (uint16_t)(((reply[0] << 8) | reply[1]) - WINDOW_TID_BASE);
+        int inWindow = (block >= first) && (block < next);
+        unsigned int size = 0;
+        if (inWindow) {
+            firmwareDataBlock(firmware, block, blockSize, &size);
+        }
+        if ((reply[2] != 0) || (reply[3] != 0) || (reply[6] != unitId) ||
+            (inWindow && !(exception || (ack && (((reply[8] << 8) | reply[9]) == DATA_BLOCK_REG_ADDRESS) && ((unsigned int)((reply[10] << 8) | reply[11]) == size / 2))))) {
+            lastErrno = EMBBADDATA;
+            traceFrame(port, '<', MODBUS_FC_WRITE_MULTIPLE_REGS, DATA_BLOCK_REG_ADDRESS, 0, lastErrno, NULL, 0);
+            break;      // not a reply to our request, the stream can't be trusted
+        }
+        if (!inWindow || status[block]) {
+            continue;   // late reply from an earlier transaction
+        }
+        inFlight--;
+        traceFrame(port, '<', MODBUS_FC_WRITE_MULTIPLE_REGS, DATA_BLOCK_REG_ADDRESS, size / 2, ack ? 0 : MODBUS_ENOBASE + reply[8], NULL, 0);
+        if (ack) {
+            status[block] = 1;
+            notifyBlock(port, block + 1, size, secondsSince(&sentAt[block]), 0, 0);
+        } else {
+            status[block] = -1;
+            lastErrno = MODBUS_ENOBASE + reply[8];
+            notifyBlock(port, block + 1, size, -1, 0, lastErrno);
+            if (block < failed) {
+                failed = block;
+            }
+        }
+        while ((acked < blockCount) && (status[acked] == 1)) {
+            acked++;
+        }
+        portLog(port, LOG_LEVEL_INFO, "\rSending data block %u of %u...", acked, blockCount);
+    }
+
+    enum window_result result = WINDOW_DONE;
+    if (acked < blockCount) {
+        // Resending is safe only if every block after the first unacknowledged one was rejected
+        result = WINDOW_STOPPED;
+        for (unsigned int i = acked + 1; i < next; i++) {
+            if (status[i] != -1) {
+                result = WINDOW_BROKEN;
+            }
+        }
+        portLog(port, LOG_LEVEL_INFO, "\n");
+        portLog(port, LOG_LEVEL_ERROR, "Error while sending data block %u in window: %s\n", acked + 1, modbus_strerror(lastErrno));
+        flushPortConnection(port);
+    }
+    *filePointer = (acked < blockCount) ? INFO_BLOCK_SIZE + acked * blockSize : firmware->size;
+    free(status);
+    free(sentAt);
+    return result;
+#endif
+}
+
+/*
+Response timeout for the next data block: measured round trip plus four
+deviations and a margin, as TCP computes its retransmission timeout, doubled
+for every timeout in a row. Full -t until a few blocks are measured and never
+above it, so a slow bootloader gets as long as before.
+*/
+static float blockTimeout(struct PortConnection *port, int timeouts) {
+    struct BlockTimer *timer = &port->blockTimer;
+    if ((timer->baudrate != port->params.baudrate) || (timer->blockSize != port->blockSize)) {
+        memset(timer, 0, sizeof(*timer));
+        timer->baudrate = port->params.baudrate;
+        timer->blockSize = port->blockSize;
+    }
+    if (timer->samples < RTT_MIN_SAMPLES) {
+        return port->responseTimeout;
+    }
+    double timeout = timer->srttSec + 4 * timer->rttvarSec + RTT_TIMEOUT_MARGIN_SEC;
+    for (int i = 0; (i < timeouts) && (timeout < port->responseTimeout); i++) {
+        timeout *= 2;
+    }
+    return (timeout < port->responseTimeout) ? timeout : port->responseTimeout;
+}
+
+static void addBlockRtt(struct PortConnection *port, double rttSec) {
+    struct BlockTimer *timer = &port->blockTimer;
+    if (timer->samples == 0) {
+        timer->srttSec = rttSec;
+        timer->rttvarSec = rttSec / 2;
+    } else {
+        double deviation = (rttSec > timer->srttSec) ? (rttSec - timer->srttSec) : (timer->srttSec - rttSec);
+        timer->rttvarSec = 0.75 * timer->rttvarSec + 0.25 * deviation;
+        timer->srttSec = 0.875 * timer->srttSec + 0.125 * rttSec;
+    }
+    timer->samples++;
+}
+
+/*
+Bootloaders that take data blocks larger than the file's ones tell how large
+in a register, the rest answer the read with an exception. Anything that
+can't be used as a block size leaves the file's one. A bootloader that
+ignores the read costs a line time, not the block timeout.
+*/
+static unsigned int negotiateBlockSize(struct PortConnection *port) {
+    float probeTimeout = probeLineSec(port->params.baudrate) + 0.05f;   // plus turnaround
+    if (port->transport != TRANSPORT_SERIAL) {
+        probeTimeout += NETWORK_LATENCY_SEC;
+    }
+    setResponseTimeout(parseResponseTimeout(probeTimeout), port->ctx);
+    uint16_t value;
+    int rc = readHoldingRegisters(port, HOLD_REG_DATA_BLOCK_SIZE_MAX, 1, &value);
+    int readErrno = errno;
+    setResponseTimeout(parseResponseTimeout(port->responseTimeout), port->ctx);
+    if (rc != 1) {
+        if (!isModbusException(readErrno)) {
+            flushPortConnection(port);
+        }
+        return DATA_BLOCK_SIZE;
+    }
+    markLineIdle(port);
+    interFrameDelay(port);
+    unsigned int size = (value < DATA_BLOCK_SIZE_MAX) ? value : DATA_BLOCK_SIZE_MAX;
+    size &= ~1u;    // whole registers
+    return (size > DATA_BLOCK_SIZE) ? size : DATA_BLOCK_SIZE;
+}
+
+// Info block starts a new bootloader session, progress of the previous one is void from the moment it is sent
+static int startSession(struct PortConnection *port, const struct FirmwareImage *firmware) {
+    unsigned int blockCount = firmwareBlockCount(firmware, port->blockSize);
+    notifyProgress(port, -1, blockCount);
+    if (sendInfoBlock(port, firmware) < 0) {
+        return -1;
+    }
+    notifyProgress(port, 0, blockCount);
+    return 0;
+}
+
+int flashFirmware(struct PortConnection *port, const struct FirmwareImage *firmware) {
+    uint16_t data[DATA_BLOCK_SIZE_MAX / 2];
+    unsigned int filesize = firmware->size;
+    int errorCount = 0;
+    unsigned int filePointer = 0;
+
+    if (port->blockSize == 0) {
+        port->blockSize = DATA_BLOCK_SIZE;
+    }
+    int resuming = port->resume && (port->resumeAcked < firmwareBlockCount(firmware, port->blockSize));
+    port->resume = 0;
+    if (!resuming) {
+        port->blockSize = negotiateBlockSize(port);     // the interrupted session goes on with its own
+        if (port->blockSize > DATA_BLOCK_SIZE) {
+            portLog(port, LOG_LEVEL_INFO, "Bootloader accepts %u bytes data blocks\n", port->blockSize);
+        }
+    }
+    unsigned int blockSize = port->blockSize;
+    unsigned int blockCount = firmwareBlockCount(firmware, blockSize);
+
+    clearDeviceInfo(&port->info);
+    if (resuming) {
+        filePointer = INFO_BLOCK_SIZE + port->resumeAcked * blockSize;
+        portLog(port, LOG_LEVEL_INFO, "\nResuming from data block %u of %u\n", port->resumeAcked + 1, blockCount);
+    } else {
+        if (startSession(port, firmware) < 0) {
+            return -1;
+        }
+        filePointer = INFO_BLOCK_SIZE;
+    }
+
+    notifyPhase(port, PHASE_DATA_BLOCKS);
+    if ((port->window > 1) && (port->transport == TRANSPORT_TCP)) {
+        unsigned int windowStart = filePointer;
+        enum window_result rc = sendDataBlocksWindowed(port, firmware, &filePointer, port->window);
+        if (rc == WINDOW_BROKEN) {
+            portLog(port, LOG_LEVEL_INFO, "Blocks after the failed one were written, sending firmware again without window\n");
+            if (startSession(port, firmware) < 0) {
+                return -1;
+            }
+            filePointer = INFO_BLOCK_SIZE;
+            resuming = 0;
+            notifyPhase(port, PHASE_DATA_BLOCKS);
+        } else {
+            notifyProgress(port, (filePointer - INFO_BLOCK_SIZE + blockSize - 1) / blockSize, blockCount);
+            if (filePointer != windowStart) {
+                resuming = 0;
+            }
+        }
+    }
+
+    int lastErrno = 0;
+    int timeouts = 0;           // in a row, each one doubles the block timeout
+    struct timeval sent;
+
+    portLog(port, LOG_LEVEL_INFO, "\n");
+    while (filePointer < filesize) {
+        unsigned int block = (filePointer - INFO_BLOCK_SIZE) / blockSize + 1;
+        portLog(port, LOG_LEVEL_INFO, "\rSending data block %u of %u...", block, blockCount);
+        unsigned int size;
+        const uint8_t *bytes = firmwareDataBlock(firmware, block - 1, blockSize, &size);
+        blockToRegisters(bytes, size, data);
+        setResponseTimeout(parseResponseTimeout(blockTimeout(port, timeouts)), port->ctx);
+        gettimeofday(&sent, NULL);
+        int rc = writeHoldingRegisters(port, DATA_BLOCK_REG_ADDRESS, size / 2, data);
+        double rttSec = secondsSince(&sent);
+        int writeErrno = errno;
+        setResponseTimeout(parseResponseTimeout(port->responseTimeout), port->ctx);
+        if (rc == (int)(size / 2)) {
+            markLineIdle(port);
+            notifyBlock(port, block, size, rttSec, errorCount, lastErrno);
+            if ((errorCount == 0) && (size == blockSize)) {
+                addBlockRtt(port, rttSec);  // a reply after a retry may be to any attempt, a short last block is no sample
+            }
+            filePointer += size;
+            notifyProgress(port, block, blockCount);
+            errorCount = 0;
+            lastErrno = 0;
+            timeouts = 0;
+            resuming = 0;
+            interFrameDelay(port);
+        } else {
+            lastErrno = writeErrno;
+            portLog(port, LOG_LEVEL_INFO, "\n");
+            if (resuming && isPermanentException(lastErrno)) {
+                // Device rebooted since the checkpoint: bootloader has no session to continue
+                portLog(port, LOG_LEVEL_ERROR, "Error while sending data block %u: %s\n", block, modbus_strerror(lastErrno));
+                portLog(port, LOG_LEVEL_INFO, "Bootloader can't continue the interrupted transfer, flashing from the start\n");
+                notifyBlock(port, block, size, -1, errorCount, lastErrno);
+                resuming = 0;
+                if (startSession(port, firmware) < 0) {
+                    return -1;
+                }
+                notifyPhase(port, PHASE_DATA_BLOCKS);
+                filePointer = INFO_BLOCK_SIZE;
+                errorCount = 0;
+                lastErrno = 0;
+                timeouts = 0;
+                continue;
+            }
+            if (errorCount >= port->retries) {
+                // Skipping the block would shift the rest of the image in flash
+                notifyBlock(port, block, size, -1, errorCount, lastErrno);
+                portLog(port, LOG_LEVEL_ERROR, "Error while sending data block %u: %s, no retries left\n", block, modbus_strerror(lastErrno));
+                return -1;
+            }
+            double backoffSec = port->retryBackoffSec * (1 << (errorCount < 16 ? errorCount : 16));
+            if (backoffSec > RETRY_BACKOFF_MAX_SEC) {
+                backoffSec = RETRY_BACKOFF_MAX_SEC;
+            }
+            portLog(port, LOG_LEVEL_ERROR, "Error while sending data block %u: %s, retry %d of %d in %.0f ms\n",
+                    block, modbus_strerror(lastErrno), errorCount + 1, port->retries, backoffSec * 1000);
+            if (port->autoBaud && (errorCount == MAX_ERROR_COUNT - 1)) {
+                portLog(port, LOG_LEVEL_INFO, "Too many errors at %d, looking for bootloader at this and lower baudrates...\n", port->params.baudrate);
+                notifyPhase(port, PHASE_WAIT);
+                detectBootloaderBaudrate(port, modbus_get_slave(port->ctx), port->params, port->responseTimeout, port->params.baudrate, NULL);
+                notifyPhase(port, PHASE_DATA_BLOCKS);
+            }
+            timeouts = (lastErrno == ETIMEDOUT) ? timeouts + 1 : 0;
+            sleepSeconds(backoffSec);
+            flushPortConnection(port);  // a late reply to this attempt must not acknowledge the next one
+            errorCount++;
+        }
+    }
+
+    portLog(port, LOG_LEVEL_INFO, " OK.\n");
+    return 0;
+}
+
+/*
+Waits until a device of the group is done with the broadcast block just sent:
+it answers a request to its own address only then. Replies to the broadcast,
+if devices send them at all, collide on the line and are flushed by the probe.
+A busy device answers late, so the probe waits the whole response timeout;
+the next device becomes the pilot whenever the current one keeps silent.
+Returns 0, or -1 if none of them answered.
+*/
+static int waitPilot(struct PortConnection *port, const int *slaveAddrs, int count, int *pilot) {
+    int rc = -1;
+    markLineIdle(port);
+    flushPortConnection(port);
+    for (int tries = 0; tries < count; tries++) {
+        interFrameDelay(port);
+        modbus_set_slave(port->ctx, slaveAddrs[*pilot]);
+        int replied = (probePort(port) >= 0) || isModbusException(errno);
+        markLineIdle(port);
+        if (replied) {
+            rc = 0;
+            break;
+        }
+        flushPortConnection(port);
+        *pilot = (*pilot + 1) % count;
+    }
+    modbus_set_slave(port->ctx, MODBUS_BROADCAST_ADDRESS);
+    interFrameDelay(port);
+    return rc;
+}
+
+static int sendBroadcastBlock(struct PortConnection *port, int regAddress, const uint8_t *block, unsigned int size) {
+    uint8_t raw[7 + DATA_BLOCK_SIZE_MAX];
+    raw[0] = MODBUS_BROADCAST_ADDRESS;
+    raw[1] = MODBUS_FC_WRITE_MULTIPLE_REGS;
+    raw[2] = regAddress >> 8;
+    raw[3] = regAddress & 0xFF;
+    raw[4] = 0;
+    raw[5] = size / 2;
+    raw[6] = size;
+    memcpy(&raw[7], block, size);   // already in wire order
+    traceFrame(port, '>', MODBUS_FC_WRITE_MULTIPLE_REGS, regAddress, size / 2, 0, block, size);
+    return (modbus_send_raw_request(port->ctx, raw, 7 + size) < 0) ? -1 : 0;
+}
+
+int broadcastFirmware(struct PortConnection *port, const struct FirmwareImage *firmware, const int *slaveAddrs, int count) {
+    if (port->transport == TRANSPORT_TCP) {
+        portLog(port, LOG_LEVEL_ERROR, "Broadcast is not forwarded by Modbus TCP gateways, use a serial port or rtu-over-tcp://\n");
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // Every device must take the blocks, so they are as large as the least capable one accepts
+    unsigned int blockSize = DATA_BLOCK_SIZE_MAX;
+    for (int i = 0; i < count; i++) {
+        modbus_set_slave(port->ctx, slaveAddrs[i]);
+        unsigned int size = negotiateBlockSize(port);
+        if (size < blockSize) {
+            blockSize = size;
+        }
+    }
+    modbus_set_slave(port->ctx, MODBUS_BROADCAST_ADDRESS);
+    port->blockSize = blockSize;
+    if (blockSize > DATA_BLOCK_SIZE) {
+        portLog(port, LOG_LEVEL_INFO, "Bootloaders accept %u bytes data blocks\n", blockSize);
+    }
+    clearDeviceInfo(&port->info);
+
+    int pilot = 0;
+    struct timeval sent;
+    notifyPhase(port, PHASE_INFO_BLOCK);
+    portLog(port, LOG_LEVEL_INFO, "\nBroadcasting info block to %d devices...", count);
+    gettimeofday(&sent, NULL);
+    if ((sendBroadcastBlock(port, INFO_BLOCK_REG_ADDRESS, firmwareInfoBlock(firmware), INFO_BLOCK_SIZE) < 0) ||
+        (waitPilot(port, slaveAddrs, count, &pilot) < 0))
+    {
+        notifyBlock(port, 0, INFO_BLOCK_SIZE, -1, 0, errno);
+        portLog(port, LOG_LEVEL_INFO, "\n");
+        portLog(port, LOG_LEVEL_ERROR, "No device answers after the info block: %s\n", modbus_strerror(errno));
+        return -1;
+    }
+    notifyBlock(port, 0, INFO_BLOCK_SIZE, secondsSince(&sent), 0, 0);
+    portLog(port, LOG_LEVEL_INFO, " OK\n");
+
+    notifyPhase(port, PHASE_DATA_BLOCKS);
+    unsigned int blockCount = firmwareBlockCount(firmware, blockSize);
+    portLog(port, LOG_LEVEL_INFO, "\n");
+    for (unsigned int block = 1; block <= blockCount; block++) {
+        portLog(port, LOG_LEVEL_INFO, "\rBroadcasting data block %u of %u...", block, blockCount);
+        unsigned int size;
+        const uint8_t *data = firmwareDataBlock(firmware, block - 1, blockSize, &size);
+        gettimeofday(&sent, NULL);
+        if ((sendBroadcastBlock(port, DATA_BLOCK_REG_ADDRESS, data, size) < 0) ||
+            (waitPilot(port, slaveAddrs, count, &pilot) < 0))
+        {
+            notifyBlock(port, block, size, -1, 0, errno);
+            portLog(port, LOG_LEVEL_INFO, "\n");
+            portLog(port, LOG_LEVEL_ERROR, "No device answers after data block %u: %s\n", block, modbus_strerror(errno));
+            return -1;
+        }
+        notifyBlock(port, block, size, secondsSince(&sent), 0, 0);
+    }
+    portLog(port, LOG_LEVEL_INFO, " OK.\n");
+    return 0;
+}
+
+static int sameUartSettings(struct UartSettings a, struct UartSettings b) {
+    return (a.baudrate == b.baudrate) && (a.parity == b.parity) && (a.databits == b.databits) &&
+           (a.stopbits == b.stopbits) && (a.stopbitsAreForced == b.stopbitsAreForced);
+}
+
+// Closes the connection, the port stays locked: it's reopened on other settings or closed for good
+static void dropConnection(struct PortConnection *port) {
+    if (port->ctx) {
+#if !defined(_WIN32)
+        releaseSerialTuning(port);
+#endif
+        deinitModbus(port->ctx);
+        port->ctx = NULL;
+    }
+    clearDeviceInfo(&port->info);
+}
+
+modbus_t *openPortConnection(struct PortConnection *port, struct UartSettings params, int slaveAddr, float responseTimeout, enum stopbits_mode stopbitsMode) {
+    if (stopbitsMode == STOPBITS_FORCE_TWO) {
+        params.stopbits = 2;
+        params.stopbitsAreForced = 1;
+    }
+
+    port->transport = parseDeviceUri(port->device, NULL, 0, NULL);
+    if (port->ctx && ((port->transport != TRANSPORT_SERIAL) || sameUartSettings(port->params, params))) {
+        // Same line settings or a gateway: just retarget the open connection
+        if (modbus_set_slave(port->ctx, slaveAddr) != 0) {
+            portLog(port, LOG_LEVEL_ERROR, "Invalid slave id!\nChoose from 0 to 247\n");
+            return NULL;
+        }
+        setResponseTimeout(parseResponseTimeout(responseTimeout), port->ctx);
+        flushPortConnection(port);
+        port->params = params;
+        port->responseTimeout = responseTimeout;
+        return port->ctx;
+    }
+
+    dropConnection(port);
+    port->ctx = initModbus(port, params, slaveAddr, responseTimeout, stopbitsMode);
+#if !defined(_WIN32)
+    if (port->ctx && port->lowLatency && (port->transport == TRANSPORT_SERIAL)) {
+        tuneSerialPort(port);
+    }
+#endif
+    port->params = params;
+    port->responseTimeout = responseTimeout;
+    return port->ctx;
+}
+
+void closePortConnection(struct PortConnection *port) {
+    dropConnection(port);
+#if !defined(_WIN32)
+    unlockPort(port);
+#endif
+}
+
+float probeLineSec(int baudrate) {
+    // Probe request and reply, 11 bits per character
+    return (8 + 5 + 2 * FW_SIG_LEN) * 11.0f / baudrate;
+}
+
+/*
+Single probe with response timeout just enough for the current baudrate.
+Returns 1 if the device replied (even with an exception), 0 otherwise.
+*/
+int probeReply(struct PortConnection *port) {
+    float probeTimeout = probeLineSec(port->params.baudrate) + 0.05f;   // plus turnaround
+    if (port->transport != TRANSPORT_SERIAL) {
+        probeTimeout += NETWORK_LATENCY_SEC;
+    }
+    setResponseTimeout(parseResponseTimeout(probeTimeout), port->ctx);
+    flushPortConnection(port);
+
+    int replied = (probePort(port) >= 0) || isModbusException(errno);
+
+    setResponseTimeout(parseResponseTimeout(port->responseTimeout), port->ctx);
+    flushPortConnection(port);
+    return replied;
+}
+
+/*
+Bootloader listens on a fixed baudrate: 9600 after reg 129, firmware's
+baudrate after reg 131, 115200 in factory fast mode. Looks for it from
+maxBaudrate down to port->minBaudrate (with the given parity, then with
+no parity) and takes the first baudrate that passes AUTO_BAUD_TEST_READS
+probes in a row. Sweeps are repeated until port->readyTimeout since the
+given time (or since now), so a rebooting device is caught too.
+Returns found baudrate with the port open on it, or -1 leaving the port
+open on the given params.
+*/
+int detectBootloaderBaudrate(struct PortConnection *port, int slaveAddr, struct UartSettings params, float responseTimeout, int maxBaudrate, const struct timeval *since) {
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    if (since == NULL) {
+        since = &start;
+    }
+    const char parities[] = {params.parity, 'N'};
+    int parityCount = (params.parity == 'N') ? 1 : 2;
+    double interval = READY_POLL_INITIAL_SEC;
+
+    if (parseDeviceUri(port->device, NULL, 0, NULL) != TRANSPORT_SERIAL) {
+        portLog(port, LOG_LEVEL_INFO, "Baudrate is set on the gateway, not detecting it\n");
+        if (openPortConnection(port, params, slaveAddr, responseTimeout, STOPBITS_FORCE_TWO) == NULL) {
+            return -1;
+        }
+        waitDeviceReady(port, since, JUMP_REBOOT_DELAY_SEC);
+        return params.baudrate;
+    }
+
+    if (slaveAddr == MODBUS_BROADCAST_ADDRESS) {
+        portLog(port, LOG_LEVEL_ERROR, "Baudrate can't be detected on broadcast address\n");
+    } else while (1) {
+        for (int i = ARRAY_SIZE(allowedBaudrates) - 1; i >= 0; i--) {
+            if ((allowedBaudrates[i] > maxBaudrate) || (allowedBaudrates[i] < port->minBaudrate)) {
+                continue;
+            }
+            for (int p = 0; p < parityCount; p++) {
+                struct UartSettings candidate = params;
+                candidate.baudrate = allowedBaudrates[i];
+                candidate.parity = parities[p];
+                if (openPortConnection(port, candidate, slaveAddr, responseTimeout, STOPBITS_FORCE_TWO) == NULL) {
+                    return -1;
+                }
+                int replies = 0;
+                while ((replies < AUTO_BAUD_TEST_READS) && probeReply(port)) {
+                    replies++;
+                }
+                if (port->debug && replies) {
+                    portLog(port, LOG_LEVEL_INFO, "%d%c2: %d of %d test reads passed\n", candidate.baudrate, candidate.parity, replies, AUTO_BAUD_TEST_READS);
+                }
+                if (replies == AUTO_BAUD_TEST_READS) {
+                    portLog(port, LOG_LEVEL_INFO, "Bootloader answers on %d%c2, using it\n", candidate.baudrate, candidate.parity);
+                    return candidate.baudrate;
+                }
+            }
+        }
+        if (secondsSince(since) + interval > port->readyTimeout) {
+            portLog(port, LOG_LEVEL_ERROR, "Bootloader doesn't answer on any baudrate from %d to %d\n", port->minBaudrate, maxBaudrate);
+            break;
+        }
+        sleepSeconds(interval);
+        interval = (interval * 2 < READY_POLL_MAX_SEC) ? interval * 2 : READY_POLL_MAX_SEC;
+    }
+
+    openPortConnection(port, params, slaveAddr, responseTimeout, STOPBITS_FORCE_TWO);
+    return -1;
+}
+
+// Baudrates in the order devices are usually found on: factory default, then the fast ones
+static const int likelyBaudrates[] = {9600, 115200, 57600, 38400, 19200, 230400, 4800, 2400, 1200};
+
+static int sameGuess(struct UartSettings a, struct UartSettings b) {
+    return (a.baudrate == b.baudrate) && (a.parity == b.parity) && (a.stopbits == b.stopbits);
+}
+
+// Returns 1 if the device passed AUTO_BAUD_TEST_READS probes in a row on the settings, -1 if the port can't be opened
+static int tryUartSettings(struct PortConnection *port, int slaveAddr, struct UartSettings params, float responseTimeout) {
+    if (openPortConnection(port, params, slaveAddr, responseTimeout, STOPBITS_FROM_PARAMS) == NULL) {
+        return -1;
+    }
+    int replies = 0;
+    while ((replies < AUTO_BAUD_TEST_READS) && probeReply(port)) {
+        replies++;
+    }
+    if (port->debug) {
+        portLog(port, LOG_LEVEL_INFO, "%d%c%d: %d of %d test reads passed\n", params.baudrate, params.parity, params.stopbits, replies, AUTO_BAUD_TEST_READS);
+    }
+    return (replies == AUTO_BAUD_TEST_READS);
+}
+
+int detectUartSettings(struct PortConnection *port, int slaveAddr, const struct UartSettings *guesses, int guessCount, float responseTimeout, struct UartSettings *found) {
+#if defined(_WIN32)
+    const int stopbitsChoices[] = {2, 1};       // sent and expected alike there
+#else
+    const int stopbitsChoices[] = {2};          // two are sent, replies with one or two are taken
+#endif
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    int probes = 0;
+
+    if (parseDeviceUri(port->device, NULL, 0, NULL) != TRANSPORT_SERIAL) {
+        portLog(port, LOG_LEVEL_INFO, "UART settings are set on the gateway, not detecting them\n");
+    } else if (slaveAddr == MODBUS_BROADCAST_ADDRESS) {
+        portLog(port, LOG_LEVEL_ERROR, "UART settings can't be detected on broadcast address\n");
+    } else {
+        for (int i = 0; i < guessCount; i++) {
+            int seen = 0;
+            for (int j = 0; j < i; j++) {
+                seen |= sameGuess(guesses[i], guesses[j]);
+            }
+            if (seen) {
+                continue;
+            }
+            probes++;
+            int rc = tryUartSettings(port, slaveAddr, guesses[i], responseTimeout);
+            if (rc < 0) {
+                return -1;
+            }
+            if (rc) {
+                *found = guesses[i];
+                portLog(port, LOG_LEVEL_INFO, "Device %d answers on %d%c%d\n", slaveAddr, found->baudrate, found->parity, found->stopbits);
+                return 0;
+            }
+        }
+
+        // Other parity is a rarer change than other baudrate, and stop bits are rarer still
+        for (unsigned int s = 0; s < ARRAY_SIZE(stopbitsChoices); s++) {
+            for (unsigned int p = 0; p < ARRAY_SIZE(allowedParity); p++) {
+                for (unsigned int b = 0; b < ARRAY_SIZE(likelyBaudrates); b++) {
+                    struct UartSettings candidate = {
+                        .baudrate = likelyBaudrates[b],
+                        .parity = allowedParity[p],
+                        .databits = 8,
+                        .stopbits = stopbitsChoices[s]
+                    };
+                    int seen = 0;
+                    for (int j = 0; j < guessCount; j++) {
+                        seen |= sameGuess(candidate, guesses[j]);
+                    }
+                    if (seen) {
+                        continue;
+                    }
+                    probes++;
+                    int rc = tryUartSettings(port, slaveAddr, candidate, responseTimeout);
+                    if (rc < 0) {
+                        return -1;
+                    }
+                    if (rc) {
+                        *found = candidate;
+                        portLog(port, LOG_LEVEL_INFO, "Device %d answers on %d%c%d, found in %d tries (%.1f s)\n",
+                                slaveAddr, found->baudrate, found->parity, found->stopbits, probes, secondsSince(&start));
+                        return 0;
+                    }
+                }
+            }
+        }
+        portLog(port, LOG_LEVEL_ERROR, "Device %d doesn't answer on any UART settings (%d tried in %.1f s)\n", slaveAddr, probes, secondsSince(&start));
+    }
+
+    if (guessCount) {
+        openPortConnection(port, guesses[0], slaveAddr, responseTimeout, STOPBITS_FROM_PARAMS);
+    }
+    return -1;
+}
+
+/*
+Waits until the device answers on the port's current settings, e.g. after
+jump to bootloader or reset/erase command. Any reply counts, even an
+exception: the device is up and listening again. Polls with short response
+timeout and growing interval until port->readyTimeout since the given time
+(or since now). Broadcast address gets no replies, so fixed fallback delay
+is used for it.
+Returns 0 when the device is ready, -1 on timeout.
+*/
+int waitDeviceReady(struct PortConnection *port, const struct timeval *since, double fallbackDelaySec) {
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    if (since == NULL) {
+        since = &start;
+    }
+
+    if (modbus_get_slave(port->ctx) == MODBUS_BROADCAST_ADDRESS) {
+        double left = fallbackDelaySec - secondsSince(since);
+        if (left > 0) {
+            sleepSeconds(left);
+        }
+        return 0;
+    }
+
+    double interval = READY_POLL_INITIAL_SEC;
+    int probes = 0;
+    int ready = 0;
+    while (1) {
+        double left = READY_POLL_INITIAL_SEC - secondsSince(since);
+        if (left > 0) {
+            sleepSeconds(left);    // don't catch firmware before it reboots
+        }
+        probes++;
+        if (probeReply(port)) {
+            ready = 1;
+            break;
+        }
+        if (secondsSince(since) + interval > port->readyTimeout) {
+            break;
+        }
+        sleepSeconds(interval);
+        interval = (interval * 2 < READY_POLL_MAX_SEC) ? interval * 2 : READY_POLL_MAX_SEC;
+    }
+
+    if (ready) {
+        if (port->debug) {
+            portLog(port, LOG_LEVEL_INFO, "Device is ready after %.2f s (%d probes)\n", secondsSince(since), probes);
+        }
+        return 0;
+    }
+    portLog(port, LOG_LEVEL_ERROR, "Device doesn't answer after %.1f s, trying anyway\n", secondsSince(since));
+    return -1;
+}
+
+/*
+Returns a copy of the port name in the form the platform expects:
+Windows needs "\\.\COMxx", other platforms and gateway URIs take it as is.
+*/
+char *normalizePortName(char *device) {
+#if defined(_WIN32)
+    if (parseDeviceUri(device, NULL, 0, NULL) != TRANSPORT_SERIAL) {
+        return duplicateString(device);
+    }
+    // We expect device in a form of "COMxx". So strip leading "." and "\", and trailing ":".
+    size_t startPos = 0, endPos = strlen(device);
+
+    for (startPos=0;
+        (startPos < strlen(device)) && ((device[startPos] == '.') || (device[startPos] == '\\'));
+        ++startPos) {};
+
+    for (endPos=strlen(device) - 1;
+        (endPos >=0) && (device[endPos] == ':');
+        --endPos) {};
+
+    char deviceStripped[32] = {};
+    strncpy(deviceStripped, device + startPos, min(sizeof(deviceStripped) - 1, endPos - startPos + 1));
+
+    char buffer[40] = "\\\\.\\";
+    strncpy(buffer + strlen(buffer), deviceStripped, sizeof(buffer) - strlen(buffer));
+
+    return duplicateString(buffer);
+#else
+    return duplicateString(device);
+#endif
+}
+
+char *duplicateString(const char *s) {
+    size_t len = strlen(s);
+    char *copy = malloc(len + 1);
+    memcpy(copy, s, len + 1);
+    return copy;
+}
+
+double secondsSince(const struct timeval *start) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+void sleepSeconds(double seconds) {
+#if defined(_WIN32)
+    Sleep((DWORD)(seconds * 1000));
+#else
+    struct timespec delay;
+    delay.tv_sec = (time_t)seconds;
+    delay.tv_nsec = (long)((seconds - delay.tv_sec) * 1000000000);
+    while ((nanosleep(&delay, &delay) != 0) && (errno == EINTR)) {};
+#endif
+}
@@ -0,0 +1,365 @@
+#ifndef WBFLASHER_H
+#define WBFLASHER_H
+
+/*
+libwbflasher: flashing Wiren Board devices over Modbus, the core of
+wb-mcu-fw-flasher. A session is a struct PortConnection: one serial port or
+gateway connection, the device it talks to and its cached info. Functions
+return -1 (or NULL) with errno set instead of exiting; text output, stage
+changes and per-block results go to the session's callbacks. A session is
+driven by one thread at a time, different sessions are independent and
+can be driven concurrently.
+
+Typical use:
+    struct PortConnection port;
+    initPortConnection(&port, "/dev/ttyRS485-1");
+    port.callbacks.progress = onProgress;
+    openPortConnection(&port, firmwareParams, 10, 1.0, STOPBITS_FROM_PARAMS);
+    enum jump_mode jump = JUMP_STANDARD_BAUD;
+    jumpToBootloader(&port, &jump, firmwareParams.baudrate);
+    openPortConnection(&port, bootloaderParams, 10, BL_MINIMAL_RESPONSE_TIMEOUT, STOPBITS_FORCE_TWO);
+    waitDeviceReady(&port, &jumpTime, JUMP_REBOOT_DELAY_SEC);
+    flashFirmware(&port, &firmware);
+    closePortConnection(&port);
+*/
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <modbus.h>
+
+#include "firmware_image.h"
+
+#define INFO_BLOCK_REG_ADDRESS      0x1000
+#define DATA_BLOCK_REG_ADDRESS      0x2000
+
+#define HOLD_REG_JUMP_TO_BOOT_STANDARD_BAUD 129
+#define HOLD_REG_JUMP_TO_BOOT_CURRENT_BAUD  131
+#define HOLD_REG_CMD_UART_SETTINGS_RESET    1000
+#define HOLD_REG_CMD_EEPROM_ERASE           1001
+#define HOLD_REG_CMD_FLASHFS_ERASE_SETTINGS 1002
+#define HOLD_REG_CMD_JUMP_TO_FIRMWARE       1004
+#define HOLD_REG_CMD_FLASHFS_FULL_ERASE     1005
+#define HOLD_REG_DATA_BLOCK_SIZE_MAX        1006    // bytes per data block write, old bootloaders take DATA_BLOCK_SIZE only
+
+#define HOLD_REG_BOOTLOADER_VERSION 330
+#define BOOTLOADER_VERSION_LEN      8
+#define HOLD_REG_FIRMWARE_SIGNATURE 290
+#define FW_SIG_LEN                  12
+#define HOLD_REG_FIRMWARE_VERSION   250
+#define FW_VERSION_LEN              15
+
+#define COMP_FW_MAX_COUNT               8
+
+#define BL_MINIMAL_RESPONSE_TIMEOUT    5.0
+
+#define JUMP_REBOOT_DELAY_SEC          2       // device reboots into bootloader
+#define COMMAND_DELAY_SEC              1       // bootloader executes reset/erase command
+
+#define DATA_BLOCK_RETRIES             6       // default retries
+#define RETRY_BACKOFF_SEC              0.05    // default pause before a retry, doubled on every next one
+#define RETRY_BACKOFF_MAX_SEC          2.0
+#define READY_TIMEOUT_SEC              5.0     // default wait for device after jump or command
+#define PORT_LOCK_TIMEOUT_SEC          60.0    // default wait for a serial port other programs hold
+
+#define TCP_URI_PREFIX                 "tcp://"
+#define RTU_OVER_TCP_URI_PREFIX        "rtu-over-tcp://"
+#define NETWORK_LATENCY_SEC            0.2     // gateway round trip, added to timeouts computed from baudrate
+
+#define WINDOW_MAX                     32      // data blocks in flight on Modbus TCP
+
+#define DATA_BLOCK_SIZE_MAX            (MODBUS_MAX_WRITE_REGISTERS * 2)    // one write multiple registers request
+
+#define FRAME_TRACE_SIZE               64      // last Modbus frames kept per port
+
+#define ALLOWED_BAUDRATES_COUNT        9
+#define ALLOWED_STOPBITS_COUNT         2
+#define ALLOWED_PARITY_COUNT           3
+
+// Line settings devices support, baudrates ascending
+extern const int allowedBaudrates[ALLOWED_BAUDRATES_COUNT];
+extern const int allowedStopBits[ALLOWED_STOPBITS_COUNT];
+extern const char allowedParity[ALLOWED_PARITY_COUNT];
+
+struct UartSettings {
+    int baudrate;
+    char parity;
+    int databits;
+    int stopbits;
+    int stopbitsAreForced;
+};
+
+enum stopbits_mode {
+    STOPBITS_FROM_PARAMS,
+    STOPBITS_FORCE_TWO
+};
+
+enum jump_mode {
+    JUMP_NONE,
+    JUMP_STANDARD_BAUD,     // -j, reg 129
+    JUMP_CURRENT_BAUD,      // -J, reg 131
+    JUMP_FASTEST            // --auto-baud with -j: reg 131 if supported, reg 129 otherwise
+};
+
+enum transport {
+    TRANSPORT_SERIAL,           // local serial port
+    TRANSPORT_TCP,              // tcp://host[:port], Modbus TCP gateway
+    TRANSPORT_RTU_OVER_TCP      // rtu-over-tcp://host[:port], transparent serial gateway
+};
+
+// Where the time goes while flashing
+enum flash_phase {
+    PHASE_OTHER,                // firmware loading, logging, everything not below
+    PHASE_PORT_SETUP,
+    PHASE_JUMP,
+    PHASE_WAIT,                 // reboot after jump, reset/erase commands, baudrate detection
+    PHASE_INFO_BLOCK,
+    PHASE_DATA_BLOCKS,
+    PHASE_COUNT
+};
+
+enum preflight_result {
+    PREFLIGHT_FLASH,
+    PREFLIGHT_CURRENT,          // device already runs the image's version
+    PREFLIGHT_WRONG_SIGNATURE   // image is for other devices
+};
+
+enum log_level {
+    LOG_LEVEL_INFO,             // wb-mcu-fw-flasher prints it to stdout
+    LOG_LEVEL_ERROR             // and this to stderr
+};
+
+enum info_string {
+    INFO_FIRMWARE_SIGNATURE,
+    INFO_FIRMWARE_VERSION,
+    INFO_BOOTLOADER_VERSION,
+    INFO_STRING_COUNT
+};
+
+struct ComponentInfo {
+    char *model;            // NULL on read error
+    char *signature;
+    char *version;
+};
+
+// Device's identity read once per session: probe, info output and checks share it.
+// Only values and final exceptions are kept, a timed out or busy read is retried next time.
+struct DeviceInfo {
+    int modbusID;                           // whose info is cached, 0 if nothing is
+    char *strings[INFO_STRING_COUNT];       // NULL if not read
+    int errors[INFO_STRING_COUNT];          // exception the device answered the read with
+    int componentsRead;
+    int componentsError;
+    uint8_t componentFlags[COMP_FW_MAX_COUNT];
+    struct ComponentInfo components[COMP_FW_MAX_COUNT];
+};
+
+// Data block round trip estimate, smoothed as TCP does for its retransmission timeout
+struct BlockTimer {
+    int baudrate;           // estimate is for this baudrate and block size, dropped when they change
+    unsigned int blockSize;
+    int samples;
+    double srttSec;         // smoothed round trip
+    double rttvarSec;       // its mean deviation
+};
+
+// Outcome of a block write, after retries
+struct BlockEvent {
+    unsigned int block;     // 0 is the info block, data blocks are counted from 1
+    unsigned int size;      // bytes of the image in it
+    double rttSec;          // round trip of the acknowledged attempt, negative if not acknowledged
+    int retries;            // failed attempts before it
+    int lastErrno;          // error of the last failed attempt, 0 if none
+};
+
+// A request or its outcome, as the port's frame trace keeps it
+struct TracedFrame {
+    unsigned int number;    // its place in the trace from 1, 0 while it's being written
+    double timeSec;         // monotonic
+    char direction;         // '>' request, '<' reply or its failure
+    uint8_t slave;
+    uint8_t function;
+    uint16_t addr;
+    uint16_t count;         // registers or bits
+    int error;              // errno of the failed reply, 0 if it came
+    uint16_t dataSize;      // bytes written by the request, kept to replay it
+    uint8_t data[DATA_BLOCK_SIZE_MAX];
+};
+
+// Ring of the port's last frames, always on: a clock read and a copy per frame
+struct FrameTrace {
+    struct TracedFrame frames[FRAME_TRACE_SIZE];
+    unsigned int recorded;  // frames so far, the last FRAME_TRACE_SIZE of them are kept
+};
+
+struct PortConnection;
+
+// Called from the thread driving the session; NULL ones are skipped, all NULL is a silent session
+struct FlasherCallbacks {
+    // Text as wb-mcu-fw-flasher prints it: lines end with '\n', a progress line is rewritten after '\r'
+    void (*log)(struct PortConnection *port, enum log_level level, const char *text);
+    void (*phase)(struct PortConnection *port, enum flash_phase phase);
+    void (*block)(struct PortConnection *port, const struct BlockEvent *event);
+    // Data blocks acknowledged in a row in the bootloader session, -1 just before an info block starts a new one
+    void (*progress)(struct PortConnection *port, int acked, unsigned int blockCount);
+};
+
+// Serial port kept open between devices; reopened only when UART settings change.
+// Network connections are never reopened: line settings are the gateway's business.
+// Holds everything a per-port worker needs, so ports can be served in parallel.
+struct PortConnection {
+    char *device;
+    int debug;
+    enum transport transport;
+    modbus_t *ctx;
+    struct UartSettings params;
+    float responseTimeout;
+    double readyTimeout;            // how long to wait for device after jump or command
+    int autoBaud;                   // re-detect bootloader baudrate on errors
+    int minBaudrate;                // lowest baudrate tried by detection
+    int window;                     // data blocks in flight on Modbus TCP, 1 is stop-and-wait
+    int retries;                    // per data block, the transfer fails when they run out
+    double retryBackoffSec;         // pause before the first retry, doubled on every next one
+    int resume;                     // next flashFirmware() continues the bootloader session
+    unsigned int resumeAcked;       // from this many acknowledged data blocks
+    unsigned int blockSize;         // of them; flashFirmware() sets it anew for a new session
+    struct BlockTimer blockTimer;
+    double lineIdleSec;             // monotonic time the last exchange ended, for the inter-frame gap
+    int lowLatency;                 // tune a local serial port for short round trips when it's opened, POSIX only
+    int lowLatencyReported;
+    struct SerialTuning *tuning;    // what lowLatency changed on the open port, undone when it's closed
+    struct FrameTrace trace;
+    double lockTimeoutSec;          // how long to wait for a serial port other programs hold, 0 gives up at once
+    int lockFd;                     // the port's file holding flock(), -1 if the port isn't locked
+    char *lockFile;                 // UUCP lock file we created, NULL if none
+    struct DeviceInfo info;
+    struct FlasherCallbacks callbacks;
+    void *user;                     // the caller's, for callbacks
+};
+
+// Zeroed session with default timeouts and retries, nothing is opened
+void initPortConnection(struct PortConnection *port, char *device);
+
+/*
+(Re)opens the connection for the device at slaveAddr. Returns NULL on error.
+A serial port is locked first, as other serial programs do it: LCK..<tty> file
+in /var/lock and flock(). A port locked by others is waited for up to
+lockTimeoutSec, the wait is reported. The lock is kept until closePortConnection().
+*/
+modbus_t *openPortConnection(struct PortConnection *port, struct UartSettings params, int slaveAddr, float responseTimeout, enum stopbits_mode stopbitsMode);
+void flushPortConnection(struct PortConnection *port);
+void closePortConnection(struct PortConnection *port);
+
+/*
+Undoes what lowLatency changed on all open ports, e.g. before the process
+dies on a signal. Safe to call from a signal handler; the ports stay open.
+*/
+void restoreSerialPorts(void);
+
+/*
+Removes the lock files of all locked ports, e.g. before the process dies on
+a signal. Safe to call from a signal handler; flock() goes with the process.
+*/
+void removePortLockFiles(void);
+
+/*
+Returns 1 if the device confirmed the jump, 0 if there was no confirmation
+but the device may be in bootloader already, and -1 on fatal error.
+JUMP_FASTEST in *jumpMode is replaced with the jump actually made.
+Doesn't wait for the reboot: use waitDeviceReady() on bootloader settings.
+*/
+int jumpToBootloader(struct PortConnection *port, enum jump_mode *jumpMode, int baudrate);
+
+/*
+Asks the bootloader to start the firmware already in flash. Returns -1 if
+it refused. Doesn't wait for the start: use waitDeviceReady() on firmware
+settings.
+*/
+int jumpToFirmware(struct PortConnection *port);
+
+int waitDeviceReady(struct PortConnection *port, const struct timeval *since, double fallbackDelaySec);
+
+int detectBootloaderBaudrate(struct PortConnection *port, int slaveAddr, struct UartSettings params, float responseTimeout, int maxBaudrate, const struct timeval *since);
+
+/*
+Finds the UART settings the running device at slaveAddr answers on: the
+given guesses first (e.g. remembered ones), then every allowed baudrate,
+parity and stop bits, the common ones first. A wrong guess costs one probe
+with a timeout just enough for its baudrate. Returns 0 with the port open
+on the found settings and *found set, or -1 leaving the port open on the
+first guess.
+*/
+int detectUartSettings(struct PortConnection *port, int slaveAddr, const struct UartSettings *guesses, int guessCount, float responseTimeout, struct UartSettings *found);
+
+enum preflight_result preflightCheck(struct PortConnection *port, const struct FirmwareImage *firmware, const char *imageVersion);
+
+/*
+Sends the image to the bootloader the port is connected to. Returns -1 on error.
+Data blocks are as large as the bootloader accepts (HOLD_REG_DATA_BLOCK_SIZE_MAX),
+progress is counted in them.
+*/
+int flashFirmware(struct PortConnection *port, const struct FirmwareImage *firmware);
+
+/*
+Sends the image once to all the given devices, which must be in bootloader
+on the port's settings: blocks go to the broadcast address, paced by one of
+the devices answering by its own address. Returns -1 if the devices stopped
+answering. Devices don't acknowledge broadcast blocks, so whether each one
+got the whole image is for the caller to check, e.g. that it runs the new
+firmware afterwards.
+*/
+int broadcastFirmware(struct PortConnection *port, const struct FirmwareImage *firmware, const int *slaveAddrs, int count);
+
+/*
+Returns the string from the cache or reads it. Returns NULL with errno set
+on error; an exception is remembered and reported again without a request.
+*/
+const char *readInfoString(struct PortConnection *port, enum info_string which);
+
+// Reads fw-sig into the cache: it's both the connection check and the device's identity
+int probeDevice(struct PortConnection *port);
+
+// Fills port->info with component firmwares. Returns -1 with errno set if their flags can't be read.
+int readComponentFirmwares(struct PortConnection *port);
+
+void clearDeviceInfo(struct DeviceInfo *info);
+
+int probeReply(struct PortConnection *port);
+
+// Writes one register of the device the port is connected to, recorded in the frame trace
+int writeHoldingRegister(struct PortConnection *port, int addr, int value);
+
+/*
+Writes the port's traced frames to fd: a "# <device> <settings> at <unix time>"
+line, then the frames oldest first, one per line:
+"<usec> <dir> <slave> <fc> <addr> <count> <result> [<data>]", where usec is
+counted from the first frame, dir is '>' for a request and '<' for its reply,
+fc, addr and data are hex, and result is "-" for a request, "ok", "timeout",
+"exception:<code>" or "error:<errno>". Written data is kept, so the requests
+can be sent again with the same pauses. Formats without stdio and takes the
+frames it copies intact, so it is async-signal-safe and may run while the
+port's thread records frames; ones overwritten meanwhile are left out.
+The port must stay allocated while it runs. Returns -1 on write error.
+*/
+int writeFrameTrace(const struct PortConnection *port, int fd);
+float probeLineSec(int baudrate);
+
+void portLog(struct PortConnection *port, enum log_level level, const char *format, ...);
+
+int parseDeviceUri(const char *device, char *host, size_t hostSize, int *tcpPort);
+char *normalizePortName(char *device);
+char *duplicateString(const char *s);
+
+char *mbReadString(modbus_t *ctx, int startAddr, int len);
+int probeConnection(modbus_t *ctx);
+int isModbusException(int error);
+
+struct timeval parseResponseTimeout(float timeoutSec);
+void setResponseTimeout(struct timeval timeoutStruct, modbus_t *modbusContext);
+
+// Silent interval that ends a Modbus RTU frame on a line with these settings
+double frameGapSec(struct UartSettings params);
+void interFrameDelay(struct PortConnection *port);
+void sleepSeconds(double seconds);
+double secondsSince(const struct timeval *start);
+
+#endif